@@ -56,13 +56,21 @@
 #define _ACESRENDER_h__
 
 #include <rawtoaces/rta.h>
+#include <rawtoaces/bufferpool.h>
+#include <rawtoaces/idtcache.h>
+#include <rawtoaces/kernels.h>
+#include <rawtoaces/stats.h>
 
+#include <functional>
+#include <memory>
 #include <unordered_map>
 
 using namespace rta;
 
 void create_key( unordered_map<string, char> &keys );
 void usage( const char *prog );
+string acesTempPath( const string &path );
+bool   writeSettingsHash( const string &output, const string &hash );
 
 class LibRawAces : virtual public LibRaw
 {
@@ -73,12 +81,76 @@ public:
     void show() { printf( "I am here with LibRawAces.\n" ); }
 };
 
+struct AcesImage
+{
+    AcesImage();
+    ~AcesImage();
+
+    void allocate( BufferPool *bufferPool );
+    void release();
+
+    uint16_t    width;
+    uint16_t    height;
+    uint8_t     channels;
+    uint16_t   *pixels;
+    BufferPool *pool;
+
+    string cameraMake;
+    string cameraModel;
+    string lensMake;
+    string lensModel;
+    string lensSerialNumber;
+    string comments;
+    string artist;
+    float  isoSpeed;
+    float  expTime;
+    float  aperture;
+    float  focalLength;
+
+    // where the pixels sit in the whole frame (--roi); a display size of 0
+    // means the pixels cover all of it
+    int      originX;
+    int      originY;
+    uint16_t displayWidth;
+    uint16_t displayHeight;
+
+    int  compression; // exrCompression_t
+    bool durable;     // on disk before it is renamed into place (--journal)
+
+    // recorded next to the file as it is renamed into place, for
+    // --incremental (see AcesRender::settingsHash())
+    string settingsHash;
+
+private:
+    AcesImage( const AcesImage &image );
+    const AcesImage &operator=( const AcesImage &image );
+};
+
+// Converts rows [first, last) of an image into the given half buffer
+typedef function<void( uint16_t *, size_t, size_t )> AcesRowSource;
+
+// Takes rows [first, last) of an image from the given half buffer
+typedef function<void( const uint16_t *, size_t, size_t )> AcesRowSink;
+
+void streamBands(
+    const AcesRowSource &source,
+    int                  width,
+    int                  height,
+    int                  channels,
+    size_t               bandRows,
+    BufferPool          *pool,
+    const AcesRowSink   &sink );
+
 class AcesRender
 {
 public:
+    AcesRender();
+    ~AcesRender();
+
     static AcesRender &getInstance();
 
-    int configureSettings( int argc, char *argv[] );
+    int  configureSettings( int argc, char *argv[] );
+    void configureOptions( const vector<string> &options );
     int fetchCameraSenPath( const libraw_iparams_t &P );
     int fetchIlluminant( const char *illumType = "na" );
 
@@ -91,8 +163,14 @@ public:
     int  preprocessRaw( const char *path );
     int  postprocessRaw();
     void outputACES( const char *path );
+    void recycle();
 
     void initialize( const dataPath &dp );
+    void cloneSettings( const AcesRender &acesrender );
+    void resetSettings( const AcesRender &acesrender );
+    void setIdtCache( IdtCache *cache );
+    void setBufferPool( BufferPool *pool );
+    void setStats( FileStats *stats );
     void setPixels( libraw_processed_image_t *image );
     void gatherSupportedIllums();
     void gatherSupportedCameras();
@@ -102,6 +180,20 @@ public:
     void applyCAT( float *pixels, int channel, uint32_t total );
     void acesWrite( const char *name, float *aces, float ratio = 1.0 ) const;
 
+    static void writeACES(
+        const char          *name,
+        const AcesImage     &image,
+        const AcesRowSource &source = AcesRowSource(),
+        BufferPool          *pool   = nullptr );
+
+    AcesImage *prepareACES();
+
+    static AcesImage *resizeACES(
+        const AcesImage  &image,
+        const OutputSize &size,
+        int               threads,
+        BufferPool       *pool = nullptr );
+
     float *renderACES();
     float *renderDNG();
     float *renderNonDNG();
@@ -115,23 +207,87 @@ public:
     const libraw_processed_image_t *getImageBuffer() const;
     const struct Option             getSettings() const;
 
+    int    pixelThreads() const;
+    string settingsHash() const;
+
 private:
-    AcesRender();
-    ~AcesRender();
     static AcesRender &getPrivateInstance();
 
+    static void writeACESFile(
+        const char          *name,
+        const AcesImage     &image,
+        const AcesRowSource &source,
+        BufferPool          *pool );
+
+    void fillACES( AcesImage &image, float *aces, float ratio ) const;
+    void fillMetadata( AcesImage &image ) const;
+    void prepareTransform( float m[4][4] );
+    void transformRows(
+        uint16_t *aces, size_t first, size_t last, const float m[4][4] ) const;
+    void imageFormat( int &width, int &height, int &colors, int &bits ) const;
+
+    int  previewRaw();
+    bool cropRaw( int crop[4] );
+    int  locateROI( const int crop[4] );
+    void regionOfInterest( int roi[4] ) const;
+    void selectLut( const float m[4][4], int channels );
+
+    const Illum &namedIlluminant( const char *illumType );
+
+    bool                      directImage() const;
+    libraw_processed_image_t *memImage() const;
+
+    vector<vector<double>> renderMatrix();
+
     const AcesRender &operator=( const AcesRender &acesrender );
 
     char                     *_pathToRaw;
     Idt                      *_idt;
-    libraw_processed_image_t *_image;
+    IdtCache                 *_idtCache;
+    BufferPool               *_bufferPool;
+    FileStats                *_stats;
     LibRawAces               *_rawProcessor;
 
+    // created on demand by memImage()
+    mutable libraw_processed_image_t *_image;
+
+    // quarter-size image binned from the raw data by previewRaw()
+    uint16_t ( *_preview )[4];
+    int      _previewWidth;
+    int      _previewHeight;
+    int      _previewFlip;
+
+    // the region of interest in the processed image (a width of 0 means
+    // all of it), and its origin in the whole frame and the frame's size
+    int _roi[4];
+    int _window[4];
+
+    BufferPool             _ownPool;
+    vector<uint16_t>       _curve;
+
+    // lookup tables of the last matrix and how many files it was used for
+    ColorLut _lut;
+    float    _lutMatrix[4][4];
+    int      _lutUses;
+    bool     _useLut;
+
     Option                 _opts;
     vector<vector<double>> _idtm;
     vector<vector<double>> _catm;
     vector<double>         _wbv;
     vector<string>         _illuminants;
     vector<string>         _cameras;
+
+    // the light sources of --wb-method 1 loaded by their name, kept
+    // apart from the illuminants of the run the best one is chosen from
+    unordered_map<string, Illum> _namedIllums;
+
+    // the custom IDT matrix of --mat-method 3
+    float _customMatrix[3][3];
+
+    // the settings may point into the options of configureOptions(),
+    // which only accepts the options of a single file
+    vector<vector<char>> _options;
+    bool                 _fileOptions;
 };
 #endif
@@ -0,0 +1,165 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _BATCH_h__
+#define _BATCH_h__
+
+#include <rawtoaces/acesrender.h>
+#include <rawtoaces/claim.h>
+#include <rawtoaces/journal.h>
+#include <rawtoaces/queue.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+struct BatchJob
+{
+    string input;
+    string output;
+    string camera;
+
+    vector<string> proxies; // one per --proxy size
+};
+
+struct BatchResult
+{
+    int       status;
+    string    timing;
+    string    error;
+    FileStats stats;   // with --stats
+    bool      skipped; // left to another process (--claim)
+};
+
+struct BatchItem
+{
+    size_t      index;
+    AcesRender *render;
+    AcesImage  *image;
+};
+
+string acesOutputPath( const string &raw, const string &suffix = "" );
+bool outputsUpToDate(
+    const string         &input,
+    const vector<string> &outputs,
+    const string         &hash );
+vector<string> shardFiles(
+    const vector<string>   &files,
+    const vector<uint64_t> &sizes,
+    int                     index,
+    int                     count );
+
+class AcesBatch
+{
+public:
+    AcesBatch( const AcesRender &master );
+    ~AcesBatch();
+
+    void addFile( const string &path );
+    int  run( int jobs, int depth = 0 );
+
+    const vector<BatchJob>    getJobs() const;
+    const vector<BatchResult> getResults() const;
+
+private:
+    typedef chrono::steady_clock::time_point timePoint;
+
+    bool openRun( const Option &opts );
+    void skipUpToDate();
+    void skipJournaled();
+    void groupByCamera( int jobs );
+    void worker();
+    void pipeline( int jobs, int depth );
+    void decodeStage();
+    void transformStage();
+    void encodeStage();
+
+    bool claimFile( size_t index );
+    bool decodeFile( AcesRender &render, size_t index );
+    bool processFile( AcesRender &render, size_t index );
+    void writeBehind( BatchItem &item );
+    void writeOutputs( size_t index, const AcesImage &image );
+    void addTiming( size_t index, const char *msg, timePoint &start );
+    void addWritten( size_t index, const string &path );
+    FileStats *fileStats( size_t index );
+    void setError( size_t index, int status, const string &error );
+    void reportResult( size_t index );
+
+    const AcesRender &_master;
+    bool              _timing;
+    FILE             *_stats;
+    double            _started;
+    IdtCache          _idtCache;
+    BufferPool        _bufferPool;
+
+    vector<BatchJob>    _jobs;
+    vector<BatchResult> _results;
+    vector<char>        _done;
+    atomic<size_t>      _next;
+    size_t              _reported;
+    mutex               _mutex;
+    condition_variable  _isolation;
+
+    BoundedQueue<AcesRender *> *_renders;
+    BoundedQueue<BatchItem>    *_decoded;
+    BoundedQueue<BatchItem>    *_encoded;
+    ByteBudget                 *_budget;
+    ClaimDir                   *_claims;
+    string                      _settingsHash; // with --incremental
+    Journal                    *_journal;
+    size_t                      _isolated;  // files first run on their own
+    int                         _abandoned; // files left out by --resume
+};
+#endif
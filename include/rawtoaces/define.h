@@ -55,6 +55,7 @@
 #define _DEFINE_h__
 
 #include <string>
+#include <cstdio>
 #include <algorithm>
 #include <boost/filesystem.hpp>
 
@@ -113,6 +114,26 @@ enum wbMethods_t
     wbMethod4
 };
 
+// How OpenEXR files are written (--exr-compression): through
+// aces_container, or with OpenEXR and one of its compressions
+enum exrCompression_t
+{
+    exrContainer = -1,
+    exrNone      = 0,
+    exrZip       = 1,
+    exrPiz       = 2,
+    exrDwaa      = 3,
+    exrDwab      = 4
+};
+
+// A smaller output rendered from the same decode (--proxy)
+struct OutputSize
+{
+    int    divisor; // 1/divisor of the full size (0 if width is set)
+    int    width;   // a fixed width in pixels (0 if divisor is set)
+    string suffix;  // inserted in the name of the output file
+};
+
 struct Option
 {
     int ret;
@@ -127,6 +148,31 @@ struct Option
     int get_illums;
     int get_cameras;
     int get_libraw_cameras;
+    int jobs;
+    int pipeline;
+    int threads;
+    int preview;
+    int roi[4]; // x, y, width and height (--roi); a width of 0 means off
+    int lut;    // 0 = arithmetic, 1 = lookup tables, 2 = automatic (--lut)
+    int exrCompression; // exrCompression_t (--exr-compression)
+    int exrThreads;     // OpenEXR's thread pool, -1 to leave it as is
+    int writeBehind;    // MB of images waiting to be written (--write-behind)
+    int watchSettle;    // ms a watched file must be unchanged (--watch-settle)
+    int shard[2];       // share of this node and number of nodes (--shard)
+    int shardBySize;    // balance the shares by bytes (--shard-by-size)
+    int claimTimeout;   // seconds before a claim is stale (--claim-timeout)
+    int incremental;    // skip files whose outputs are current (--incremental)
+    int resume;         // skip the files the journal has done (--resume)
+
+    string idtCachePath;
+    string statsPath;    // JSON Lines timing records (--stats)
+    string serve;        // socket to serve requests on, "-" for stdin (--serve)
+    string claimPath;    // claims shared with other processes (--claim)
+    string manifestPath; // files to convert and their settings (--manifest)
+    string journalPath;  // start and end of every file (--journal)
+
+    vector<string>     watchDirs; // new files are converted (--watch)
+    vector<OutputSize> outputSizes;
 
     matMethods_t mat_method;
     wbMethods_t  wb_method;
@@ -146,10 +192,6 @@ struct dataPath
     vector<string> paths;
 };
 
-static float                  custom_Matrix[3][3] = { 0.0 };
-static float                  custom_Buffer[9]    = { 0.0 };
-static vector<vector<double>> custom_idtm;
-
 const double pi = 3.1416;
 // 216.0/24389.0
 const double e = 0.008856451679;
@@ -266,6 +308,13 @@ static const double XYZ_acesrgb_4[4][4] = {
     {  0.0,          0.0,           0.0,          1.0 }
 };
 
+// linear sRGB to XYZ, as LibRaw's convert_to_rgb() uses for XYZ output
+static const double srgb_XYZ_3[3][3] = {
+    { 0.412453, 0.357580, 0.180423 },
+    { 0.212671, 0.715160, 0.072169 },
+    { 0.019334, 0.119193, 0.950227 }
+};
+
 static const double acesrgb_XYZ_3[3][3] = {
     { 0.952552395938186, 0.0,                9.36786316604686e-05 },
     { 0.343966449765075, 0.728166096613485, -0.0721325463785608   },
@@ -436,6 +485,34 @@ inline bool isValidCT( string str )
     return true;
 };
 
+// Function to quote a string for JSON (e.g., a file name in a record)
+inline string jsonString( const string &value )
+{
+    string quoted = "\"";
+    for ( unsigned char c: value )
+    {
+        switch ( c )
+        {
+            case '"': quoted += "\\\""; break;
+            case '\\': quoted += "\\\\"; break;
+            case '\n': quoted += "\\n"; break;
+            case '\r': quoted += "\\r"; break;
+            case '\t': quoted += "\\t"; break;
+            default:
+                if ( c < 0x20 )
+                {
+                    char code[8];
+                    snprintf( code, sizeof( code ), "\\u%04x", c );
+                    quoted += code;
+                }
+                else
+                    quoted += char( c );
+        }
+    }
+
+    return quoted + "\"";
+};
+
 // Function to get environment variable for camera data
 inline dataPath &pathsFinder()
 {
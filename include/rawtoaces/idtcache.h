@@ -0,0 +1,121 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _IDTCACHE_h__
+#define _IDTCACHE_h__
+
+#include <rawtoaces/define.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+
+struct IdtCacheEntry
+{
+    vector<vector<double>> idt;
+    vector<double>         wb;
+    string                 illum;
+};
+
+string idtCacheKey(
+    const char  *tag,
+    const char  *make,
+    const char  *model,
+    const float *mul,
+    int          highlight,
+    const char  *illumType );
+
+class IdtCache
+{
+public:
+    IdtCache();
+    ~IdtCache();
+
+    bool fetch( const string &key, IdtCacheEntry &entry );
+    void store( const string &key, const IdtCacheEntry &entry );
+    void abandon( const string &key );
+
+    size_t getHits() const;
+    size_t getMisses() const;
+    size_t size() const;
+
+private:
+    map<string, IdtCacheEntry> _entries;
+    set<string>                _pending;
+    size_t                     _hits;
+    size_t                     _misses;
+    mutable mutex              _mutex;
+    condition_variable         _ready;
+};
+
+// A key left pending by a miss in IdtCache::fetch(), which is abandoned
+// when the scope ends unless it was stored, so that a calculation that
+// throws does not leave the other threads waiting for the key forever
+class IdtCacheMiss
+{
+public:
+    IdtCacheMiss( IdtCache *cache, const string &key );
+    ~IdtCacheMiss();
+
+    void store( const IdtCacheEntry &entry );
+
+private:
+    IdtCacheMiss( const IdtCacheMiss &miss );
+    const IdtCacheMiss &operator=( const IdtCacheMiss &miss );
+
+    IdtCache *_cache;
+    string    _key;
+};
+#endif
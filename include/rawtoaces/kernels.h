@@ -0,0 +1,166 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _KERNELS_h__
+#define _KERNELS_h__
+
+#include <rawtoaces/define.h>
+
+#include <functional>
+
+// Instruction sets the color matrix kernels can use; they are tried from
+// the highest level supported by the CPU downwards
+enum simdLevel_t
+{
+    simdScalar = 0,
+    simdSSE41  = 1,
+    simdAVX2   = 2,
+    simdAVX512 = 3
+};
+
+simdLevel_t getSimdLevel();
+const char *getSimdName( simdLevel_t level );
+
+// The products of a color matrix and every 16-bit sample: entry v of
+// input channel k holds m[j][k] * v for the 4 output channels j, i.e.
+// table[( k * 65536 + v ) * 4 + j]
+struct ColorLut
+{
+    int           channels;
+    vector<float> table;
+};
+
+void buildColorLut( const float m[4][4], int channels, ColorLut &lut );
+bool colorLutFaster();
+
+void transformPixels(
+    const float *in,
+    float       *out,
+    size_t       total,
+    int          channels,
+    const float  m[4][4],
+    simdLevel_t  level = getSimdLevel() );
+
+void transformPixels(
+    const uint16_t *in,
+    float          *out,
+    size_t          total,
+    int             channels,
+    const float     m[4][4],
+    simdLevel_t     level = getSimdLevel() );
+
+void transformHalf(
+    const uint16_t *in,
+    uint16_t       *out,
+    size_t          total,
+    int             channels,
+    const float     m[4][4],
+    simdLevel_t     level = getSimdLevel() );
+
+void transformHalf(
+    const uint16_t *in,
+    uint16_t       *out,
+    size_t          total,
+    const ColorLut &lut,
+    simdLevel_t     level = getSimdLevel() );
+
+void transformHalf(
+    const uint8_t *in,
+    uint16_t      *out,
+    size_t         total,
+    int            channels,
+    const float    m[4][4],
+    simdLevel_t    level = getSimdLevel() );
+
+void resampleHalf(
+    const uint16_t *in,
+    int             width,
+    int             height,
+    int             channels,
+    uint16_t       *out,
+    int             newWidth,
+    int             newHeight,
+    int             threads,
+    simdLevel_t     level = getSimdLevel() );
+
+void gatherRows(
+    const uint16_t ( *image )[4],
+    int             width,
+    int             height,
+    int             flip,
+    int             channels,
+    const uint16_t *curve,
+    size_t          left,
+    size_t          right,
+    size_t          first,
+    size_t          last,
+    uint16_t       *out );
+
+void binQuads(
+    const uint16_t *raw,
+    size_t          pitch,
+    const uint8_t   cfa[8][2],
+    const float     black[4],
+    const float     mul[4],
+    size_t          width,
+    size_t          first,
+    size_t          last,
+    uint16_t ( *out )[4] );
+
+void forEachTile(
+    size_t                                count,
+    size_t                                itemBytes,
+    int                                   threads,
+    const function<void( size_t, size_t )> &work );
+#endif
@@ -0,0 +1,173 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _QUEUE_h__
+#define _QUEUE_h__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// A FIFO queue shared between threads. push() blocks while the queue
+// holds "capacity" items, which throttles the producers to the pace of
+// the consumers. Once close() is called, pop() drains what is left and
+// then returns false.
+template <typename T> class BoundedQueue
+{
+public:
+    BoundedQueue( size_t capacity )
+        : _capacity( capacity > 0 ? capacity : 1 ), _closed( false ){};
+    ~BoundedQueue(){};
+
+    bool push( const T &item )
+    {
+        std::unique_lock<std::mutex> lock( _mutex );
+        _notFull.wait(
+            lock, [this] { return _closed || _items.size() < _capacity; } );
+
+        if ( _closed )
+            return false;
+
+        _items.push_back( item );
+        _notEmpty.notify_one();
+
+        return true;
+    };
+
+    bool pop( T &item )
+    {
+        std::unique_lock<std::mutex> lock( _mutex );
+        _notEmpty.wait( lock, [this] { return _closed || !_items.empty(); } );
+
+        if ( _items.empty() )
+            return false;
+
+        item = _items.front();
+        _items.pop_front();
+        _notFull.notify_one();
+
+        return true;
+    };
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _closed = true;
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+    };
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _items.size();
+    };
+
+    size_t capacity() const { return _capacity; };
+
+private:
+    BoundedQueue( const BoundedQueue &queue );
+    const BoundedQueue &operator=( const BoundedQueue &queue );
+
+    const size_t            _capacity;
+    bool                    _closed;
+    std::deque<T>           _items;
+    mutable std::mutex      _mutex;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+};
+
+// A number of bytes shared between threads, e.g. for the images waiting
+// to be written. acquire() blocks while the bytes in use and the ones
+// asked for would go over the limit, unless none are in use, so that a
+// request larger than the limit still goes through on its own.
+class ByteBudget
+{
+public:
+    ByteBudget( size_t limit ) : _limit( limit ), _used( 0 ){};
+    ~ByteBudget(){};
+
+    void acquire( size_t bytes )
+    {
+        std::unique_lock<std::mutex> lock( _mutex );
+        _released.wait(
+            lock, [&] { return _used == 0 || _used + bytes <= _limit; } );
+        _used += bytes;
+    };
+
+    void release( size_t bytes )
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _used -= bytes;
+        _released.notify_all();
+    };
+
+    size_t used() const
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        return _used;
+    };
+
+    size_t limit() const { return _limit; };
+
+private:
+    ByteBudget( const ByteBudget &budget );
+    const ByteBudget &operator=( const ByteBudget &budget );
+
+    const size_t            _limit;
+    size_t                  _used;
+    mutable std::mutex      _mutex;
+    std::condition_variable _released;
+};
+#endif
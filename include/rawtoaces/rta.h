@@ -184,9 +184,12 @@ public:
     void loadTrainingData( const string &path );
     void loadCMF( const string &path );
     void chooseIllumSrc( const vector<double> &src, int highlight );
-    void chooseIllumType( const char *type, int highlight );
+    int  chooseIllumType( const char *type, int highlight );
+    void chooseIllum( const Illum &Illuminant, int highlight );
     void setIlluminants( const Illum &Illuminant );
+    void setIlluminants( const vector<Illum> &Illuminants );
     void setVerbosity( const int verbosity );
+    void setCachePath( const string &path );
     void scaleLSC( Illum &Illuminant );
 
     vector<double>         calCM();
@@ -201,6 +204,10 @@ public:
         double                       *B );
     int calIDT();
 
+    string calCacheKey() const;
+    int    readIDTCache( const string &path );
+    void   writeIDTCache( const string &path ) const;
+
     const Spst                   getCameraSpst() const;
     const Illum                  getBestIllum() const;
     const vector<trainSpec>      getTrainingSpec() const;
@@ -211,9 +218,10 @@ public:
     const int                    getVerbosity() const;
 
 private:
-    Spst  _cameraSpst;
-    Illum _bestIllum;
-    int   _verbosity;
+    Spst   _cameraSpst;
+    Illum  _bestIllum;
+    int    _verbosity;
+    string _cachePath;
 
     vector<CMF>            _cmf;
     vector<trainSpec>      _trainingSpec;
@@ -0,0 +1,162 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _SERVER_h__
+#define _SERVER_h__
+
+#include <rawtoaces/acesrender.h>
+#include <rawtoaces/queue.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// A client of the server (--serve): where its requests come from and
+// where the responses go. The descriptors are closed when the last job
+// of the client is done.
+class ServerClient
+{
+public:
+    ServerClient( int in, int out );
+    ~ServerClient();
+
+    bool respond( const string &line );
+    int  input() const { return _in; };
+
+private:
+    ServerClient( const ServerClient &client );
+    const ServerClient &operator=( const ServerClient &client );
+
+    int   _in;
+    int   _out;
+    mutex _mutex;
+};
+
+struct ServerJob
+{
+    string         id;
+    string         input;
+    string         output;
+    vector<string> options; // command line options for this job only
+    double         received;
+
+    shared_ptr<ServerClient> client;
+};
+
+bool parseServerJob(
+    const string &line, ServerJob &job, bool &shutdown, string &error );
+string proxyOutputPath( const string &output, const string &suffix );
+bool   isWatchedFile( const string &name );
+
+vector<string> splitCsv( const string &line );
+bool parseManifestHeader(
+    const string &line, vector<string> &columns, string &error );
+bool parseManifestRow(
+    const string         &line,
+    const vector<string> &columns,
+    ServerJob            &job,
+    string               &error );
+
+class AcesServer
+{
+public:
+    AcesServer( const AcesRender &master );
+    ~AcesServer();
+
+    int run( int jobs, const string &address );
+    int watch( int jobs, const vector<string> &dirs, int settle );
+    int runManifest( int jobs, const string &path );
+
+private:
+    void worker();
+    void convert( AcesRender &render, ServerJob &job );
+    void report(
+        const ServerJob &job,
+        int              status,
+        const string    &error,
+        FileStats       &stats,
+        bool             skipped );
+    void writeOutputs( AcesRender &render, ServerJob &job, FileStats &stats );
+    void readJobs( shared_ptr<ServerClient> client );
+    int  acceptClients( const string &path );
+    void stop();
+    void startWorkers( int jobs, vector<thread> &pool );
+    bool openStats();
+    size_t closeStats();
+    void stopWorkers( vector<thread> &pool );
+
+    const AcesRender &_master;
+    IdtCache          _idtCache;
+    BufferPool        _bufferPool;
+    double            _started;
+    FILE             *_stats;
+    vector<FileStats> _finished; // reported without a client
+    size_t            _failed;
+    mutex             _reportMutex;
+
+    BoundedQueue<ServerJob> *_queue;
+    atomic<bool>             _stopping;
+    atomic<int>              _listener;
+
+    // the clients of the socket, and the number of threads still
+    // reading their requests
+    vector<weak_ptr<ServerClient>> _clients;
+    int                            _readers;
+    mutex                          _clientsMutex;
+    condition_variable             _readersDone;
+};
+#endif
@@ -0,0 +1,133 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _STATS_h__
+#define _STATS_h__
+
+#include <rawtoaces/define.h>
+#include <rawtoaces/trace.h>
+
+#include <cstdint>
+
+// The steps of converting a file that are timed for --stats. The
+// conversion to half floats is part of the transform kernels.
+enum stage_t
+{
+    stageOpen,
+    stageUnpack,
+    stageProcess,
+    stageMemImage,
+    stageIdt,
+    stageTransform,
+    stageResize,
+    stageWrite,
+    stageCount
+};
+
+struct StageTime
+{
+    double wall; // seconds
+    double cpu;  // seconds
+};
+
+struct FileStats
+{
+    StageTime stages[stageCount];
+    double    started;  // seconds since the batch started
+    double    finished; // seconds since the batch started
+    uint64_t  bytesRead;
+    uint64_t  bytesWritten;
+};
+
+const char *stageName( stage_t stage );
+double      wallTime();
+double      threadCpuTime();
+double      processCpuTime();
+double      percentile( vector<double> values, double p );
+
+string statsRecord(
+    const string    &input,
+    const string    &output,
+    int              status,
+    const FileStats &stats );
+string statsSummary(
+    const vector<FileStats> &stats, size_t failed, double elapsed, double cpu );
+
+// Adds the wall and CPU time of its scope to a stage of a file. Time
+// spent in timers nested on the same thread counts for their own stage
+// only, e.g. the bands transformed while a file is being written. The
+// stage is also an event of the --trace timeline.
+class StageTimer
+{
+public:
+    StageTimer( FileStats *stats, stage_t stage );
+    ~StageTimer();
+
+    void addCpu( double cpu );
+    bool active() const { return _stats != nullptr; };
+
+private:
+    StageTimer( const StageTimer &timer );
+    const StageTimer &operator=( const StageTimer &timer );
+
+    TraceScope  _trace;
+    FileStats  *_stats;
+    stage_t     _stage;
+    double      _wall;
+    double      _cpu;
+    double      _nestedWall;
+    double      _nestedCpu;
+    StageTimer *_parent;
+};
+#endif
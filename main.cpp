@@ -53,6 +53,8 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include <rawtoaces/acesrender.h>
+#include <rawtoaces/batch.h>
+#include <rawtoaces/server.h>
 #include <rawtoaces/usage.h>
 
 int main( int argc, char *argv[] )
@@ -71,7 +73,16 @@ int main( int argc, char *argv[] )
 
     // Fetch conditions and conduct some pre-processing
     Render.initialize( pathsFinder() );
-    int arg = Render.configureSettings( argc, argv );
+    int arg = 0;
+    try
+    {
+        arg = Render.configureSettings( argc, argv );
+    }
+    catch ( std::exception const &e )
+    {
+        fprintf( stderr, "%s", e.what() );
+        exit( -1 );
+    }
 
     // Gather all the raw images from arg list
     vector<string> RAWs;
@@ -104,9 +115,23 @@ int main( int argc, char *argv[] )
         }
     }
 
-    // Load illuminant dataset(s)
-    int    read = 0;
+    // Keep the share of this node only
     Option opts = Render.getSettings();
+    if ( opts.shard[1] > 0 )
+    {
+        vector<uint64_t> sizes;
+        if ( opts.shardBySize )
+        {
+            FORI( RAWs.size() )
+                sizes.push_back(
+                    stat( RAWs[i].c_str(), &st ) == 0 ? st.st_size : 0 );
+        }
+
+        RAWs = shardFiles( RAWs, sizes, opts.shard[0], opts.shard[1] );
+    }
+
+    // Load illuminant dataset(s)
+    int read = 0;
     if ( !opts.illumType )
         read = Render.fetchIlluminant();
     else
@@ -122,35 +147,46 @@ int main( int argc, char *argv[] )
         exit( -1 );
     }
 
-    // Process RAW files ...
-    FORI( RAWs.size() )
+    // Convert the files requested until told to stop
+    if ( !opts.serve.empty() )
     {
-        string raw = ( RAWs[i] ).c_str();
+        if ( RAWs.size() )
+            fprintf(
+                stderr,
+                "Warning: The files given are ignored with --serve.\n" );
 
-        timerstart_timeval();
-        Render.preprocessRaw( raw.c_str() );
-        if ( opts.use_timing )
-            timerprint( "AcesRender::preprocessRaw()", raw.c_str() );
+        AcesServer server( Render );
+        return server.run( opts.jobs, opts.serve ) ? 1 : 0;
+    }
 
-        timerstart_timeval();
-        Render.postprocessRaw();
-        if ( opts.use_timing )
-            timerprint( "AcesRender::postprocessRaw()", raw.c_str() );
+    // Convert the files listed in the manifest as it is read
+    if ( !opts.manifestPath.empty() )
+    {
+        if ( RAWs.size() )
+            fprintf(
+                stderr,
+                "Warning: The files given are ignored with --manifest.\n" );
 
-        timerstart_timeval();
+        AcesServer server( Render );
+        return server.runManifest( opts.jobs, opts.manifestPath ) ? 1 : 0;
+    }
 
-        string output;
-        size_t pos = raw.rfind( '.' );
-        if ( pos != std::string::npos )
-        {
-            output = raw.substr( 0, pos );
-        }
-        output += "_aces.exr";
+    // Convert the files copied into the directories until interrupted
+    if ( !opts.watchDirs.empty() )
+    {
+        if ( RAWs.size() )
+            fprintf(
+                stderr,
+                "Warning: The files given are ignored with --watch.\n" );
 
-        Render.outputACES( output.c_str() );
-        if ( opts.use_timing )
-            timerprint( "AcesRender::outputACES()", raw.c_str() );
+        AcesServer server( Render );
+        return server.watch( opts.jobs, opts.watchDirs, opts.watchSettle ) ? 1
+                                                                           : 0;
     }
 
-    return 0;
+    // Process RAW files ...
+    AcesBatch batch( Render );
+    FORI( RAWs.size() ) batch.addFile( RAWs[i] );
+
+    return batch.run( opts.jobs, opts.pipeline ) ? 1 : 0;
 }
@@ -54,16 +54,23 @@
 
 #include <rawtoaces/rta.h>
 #include <rawtoaces/mathOps.h>
+#include <rawtoaces/trace.h>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/foreach.hpp>
 
+#include <fstream>
+
 using namespace boost::property_tree;
 using namespace ceres;
 
 namespace rta
 {
+// Settings of the IDT regression; they are part of the IDT cache key
+static const double solverTolerance  = 1e-17;
+static const int    solverIterations = 300;
+
 Illum::Illum()
 {
     _inc = 5;
@@ -143,6 +150,7 @@ void Illum::setIllumIndex( const double &index )
 int Illum::readSPD( const string &path, const string &type )
 {
     assert( path.length() > 0 && type.length() > 0 );
+    TraceScope scope( "Illum::readSPD" );
 
     try
     {
@@ -593,6 +601,7 @@ int Spst::getWLIncrement()
 int Spst::loadSpst( const string &path, const char *maker, const char *model )
 {
     assert( path.length() > 0 && maker != nullptr && model != nullptr );
+    TraceScope scope( "Spst::loadSpst" );
 
     vector<RGBSen> rgbsen;
     vector<double> max( 3, dmin );
@@ -1067,6 +1076,20 @@ void Idt::setIlluminants( const Illum &Illuminant )
     _Illuminants.push_back( Illuminant );
 }
 
+//	=====================================================================
+//	Replace the Illuminants, e.g. by those of another Idt instance
+//
+//	inputs:
+//      vector < Illum >: Illuminants
+//
+//	outputs:
+//		N/A:   _Illuminants will be a copy of Illuminants
+
+void Idt::setIlluminants( const vector<Illum> &Illuminants )
+{
+    _Illuminants = Illuminants;
+}
+
 //	=====================================================================
 //	Set Verbosity value for the length of IDT generation status message
 //
@@ -1081,6 +1104,20 @@ void Idt::setVerbosity( const int verbosity )
     _verbosity = verbosity;
 }
 
+//	=====================================================================
+//	Set the directory of the persistent IDT cache
+//
+//	inputs:
+//      string: path to the directory ("" to disable the cache)
+//
+//	outputs:
+//		N/A: calIDT() will look up and fill the cache in _cachePath
+
+void Idt::setCachePath( const string &path )
+{
+    _cachePath = path;
+}
+
 //	=====================================================================
 //	Choose the best Light Source based on White Balance Coefficients from
 //  the camera read by libraw according to a given set of coefficients
@@ -1136,13 +1173,37 @@ void Idt::chooseIllumSrc( const vector<double> &src, int highlight )
 //      String: Light Source Name
 //
 //	outputs:
-//		Illum: the best _Illuminant
+//		int: "1" means the light source was found in _Illuminants by
+//           its name and chosen; "0" means it is not loaded
 
-void Idt::chooseIllumType( const char *type, int highlight )
+int Idt::chooseIllumType( const char *type, int highlight )
 {
-    assert( cmp_str( type, _Illuminants[0]._type.c_str() ) == 0 );
+    FORI( _Illuminants.size() )
+    {
+        if ( cmp_str( type, _Illuminants[i]._type.c_str() ) == 0 )
+        {
+            chooseIllum( _Illuminants[i], highlight );
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//	=====================================================================
+//	Choose a given Light Source, whether or not it is one of _Illuminants,
+//  and calculate its White Balance Coefficients
+//
+//	inputs:
+//      Illum: Light Source
+//      int: highlight mode
+//
+//	outputs:
+//		N/A: _bestIllum and _wb will be set
 
-    _bestIllum = _Illuminants[0];
+void Idt::chooseIllum( const Illum &Illuminant, int highlight )
+{
+    _bestIllum = Illuminant;
     _wb        = calWB( _bestIllum, highlight );
 
     //		if (_verbosity > 1)
@@ -1346,6 +1407,7 @@ int Idt::curveFit(
     const vector<vector<double>> &XYZ,
     double                       *B )
 {
+    TraceScope             scope( "Idt::curveFit" );
     Problem                problem;
     vector<vector<double>> outLAB = XYZtoLAB( XYZ );
 
@@ -1357,11 +1419,11 @@ int Idt::curveFit(
 
     ceres::Solver::Options options;
     options.linear_solver_type  = ceres::DENSE_QR;
-    options.parameter_tolerance = 1e-17;
+    options.parameter_tolerance = solverTolerance;
     //        options.gradient_tolerance = 1e-17;
-    options.function_tolerance        = 1e-17;
-    options.min_line_search_step_size = 1e-17;
-    options.max_num_iterations        = 300;
+    options.function_tolerance        = solverTolerance;
+    options.min_line_search_step_size = solverTolerance;
+    options.max_num_iterations        = solverIterations;
 
     if ( _verbosity > 2 )
         options.minimizer_progress_to_stdout = true;
@@ -1414,11 +1476,210 @@ int Idt::curveFit(
 
 int Idt::calIDT()
 {
+    string cacheFile;
+    if ( !_cachePath.empty() )
+    {
+        cacheFile = _cachePath + "/" + calCacheKey() + ".json";
+        if ( readIDTCache( cacheFile ) )
+        {
+            if ( _verbosity > 1 )
+                printf(
+                    "The IDT matrix is loaded from %s\n", cacheFile.c_str() );
+
+            return 1;
+        }
+    }
 
     double                 BStart[6] = { 1.0, 0.0, 0.0, 1.0, 0.0, 0.0 };
     vector<vector<double>> TI        = calTI();
 
-    return curveFit( calRGB( TI ), calXYZ( TI ), BStart );
+    int succeed = curveFit( calRGB( TI ), calXYZ( TI ), BStart );
+    if ( succeed && !cacheFile.empty() )
+        writeIDTCache( cacheFile );
+
+    return succeed;
+}
+
+//	=====================================================================
+//	Calculate the key of the IDT matrix in the persistent cache. It is a
+//  64-bit FNV-1a hash of everything the regression depends on: camera
+//  spectral sensitivity, SPD of the chosen light source, white balance,
+//  training data, color matching functions and solver settings.
+//
+//	inputs:
+//         N/A
+//
+//	outputs:
+//      string: the key as 16 hex digits
+
+string Idt::calCacheKey() const
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    auto mix = [&hash]( const void *data, size_t size ) {
+        const unsigned char *bytes = static_cast<const unsigned char *>( data );
+        FORI( size )
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+    auto mixV = [&mix]( const vector<double> &data ) {
+        if ( data.size() )
+            mix( &data[0], data.size() * sizeof( double ) );
+    };
+
+    FORI( _cameraSpst._rgbsen.size() )
+    {
+        const RGBSen &sen = _cameraSpst._rgbsen[i];
+        double        rgb[3] = { sen._RSen, sen._GSen, sen._BSen };
+        mix( rgb, sizeof( rgb ) );
+    }
+
+    mixV( _bestIllum._data );
+    mixV( _wb );
+
+    FORI( _trainingSpec.size() )
+    {
+        mix( &_trainingSpec[i]._wl, sizeof( _trainingSpec[i]._wl ) );
+        mixV( _trainingSpec[i]._data );
+    }
+
+    FORI( _cmf.size() )
+    {
+        double cmf[4] = { double( _cmf[i]._wl ),
+                          _cmf[i]._xbar,
+                          _cmf[i]._ybar,
+                          _cmf[i]._zbar };
+        mix( cmf, sizeof( cmf ) );
+    }
+
+    char solver[128];
+    snprintf(
+        solver,
+        sizeof( solver ),
+        "DENSE_QR %a %d 1,0,0,1,0,0",
+        solverTolerance,
+        solverIterations );
+    mix( solver, strlen( solver ) );
+#ifdef CERES_VERSION_STRING
+    mix( CERES_VERSION_STRING, strlen( CERES_VERSION_STRING ) );
+#endif
+
+    char key[17];
+    snprintf( key, sizeof( key ), "%016llx", (unsigned long long)hash );
+
+    return string( key );
+}
+
+//	=====================================================================
+//	Read the IDT matrix from the persistent cache
+//
+//	inputs:
+//      string: path to the cached file
+//
+//	outputs:
+//		int: 1 if the file exists and matches the current data
+//           (_idt and _wb are filled); otherwise 0
+
+int Idt::readIDTCache( const string &path )
+{
+    struct stat st;
+    if ( stat( path.c_str(), &st ) )
+        return 0;
+
+    try
+    {
+        ptree pt;
+        read_json( path, pt );
+
+        if ( pt.get<string>( "key" ) != calCacheKey() ||
+             pt.get<string>( "illuminant" ) != _bestIllum._type )
+            return 0;
+
+        vector<double> idt, wb;
+        BOOST_FOREACH ( ptree::value_type &cell, pt.get_child( "idt" ) )
+            idt.push_back( strtod( cell.second.data().c_str(), NULL ) );
+        BOOST_FOREACH ( ptree::value_type &cell, pt.get_child( "wb" ) )
+            wb.push_back( strtod( cell.second.data().c_str(), NULL ) );
+
+        if ( idt.size() != 9 || wb.size() != 3 )
+            return 0;
+
+        FORIJ( 3, 3 ) _idt[i][j] = idt[i * 3 + j];
+        FORI( 3 ) _wb[i]         = wb[i];
+    }
+    catch ( std::exception const &e )
+    {
+        // a damaged entry is simply calculated and written again
+        if ( _verbosity > 1 )
+            std::cerr << e.what() << std::endl;
+
+        return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Write the IDT matrix to the persistent cache. The file is written
+//  under a unique temporary name and then renamed, so other processes
+//  (also on other hosts sharing the directory) either see the complete
+//  file or none at all. Concurrent writers of the same key produce the
+//  same content, so it does not matter which rename wins.
+//
+//	inputs:
+//      string: path to the cached file
+//
+//	outputs:
+//		N/A: the file is created (failures are ignored)
+
+void Idt::writeIDTCache( const string &path ) const
+{
+    char  value[64];
+    ptree pt, idt, wb;
+
+    pt.put( "key", calCacheKey() );
+    pt.put( "illuminant", _bestIllum._type );
+
+    // hexadecimal floats keep every bit of the values
+    FORIJ( 3, 3 )
+    {
+        snprintf( value, sizeof( value ), "%a", _idt[i][j] );
+        idt.push_back( ptree::value_type( "", ptree( value ) ) );
+    }
+    FORI( 3 )
+    {
+        snprintf( value, sizeof( value ), "%a", _wb[i] );
+        wb.push_back( ptree::value_type( "", ptree( value ) ) );
+    }
+    pt.add_child( "idt", idt );
+    pt.add_child( "wb", wb );
+
+    boost::filesystem::path temp =
+        path +
+        boost::filesystem::unique_path( ".%%%%-%%%%-%%%%-%%%%.tmp" ).string();
+
+    try
+    {
+        {
+            std::ofstream file( temp.string().c_str() );
+            write_json( file, pt );
+            file.flush();
+            if ( !file )
+                throw std::runtime_error( "Cannot write " + temp.string() );
+        }
+
+        boost::filesystem::rename( temp, path );
+    }
+    catch ( std::exception const &e )
+    {
+        if ( _verbosity > 1 )
+            std::cerr << e.what() << std::endl;
+
+        boost::system::error_code ec;
+        boost::filesystem::remove( temp, ec );
+    }
 }
 
 //	=====================================================================
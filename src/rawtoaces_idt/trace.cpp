@@ -0,0 +1,288 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/trace.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+struct TraceEvent
+{
+    const char *name;
+    int64_t     begin; // nanoseconds since traceStart()
+    int64_t     end;
+    size_t      file; // index in TraceBuffer::files
+};
+
+struct TraceBuffer
+{
+    int                tid;
+    string             name;
+    vector<string>     files;
+    vector<TraceEvent> events;
+    mutex              eventsMutex;
+};
+
+atomic<bool> traceOn( false );
+
+static mutex                           traceMutex;
+static vector<unique_ptr<TraceBuffer>> traceBuffers;
+static FILE                           *traceOutput = nullptr;
+static chrono::steady_clock::time_point traceEpoch;
+
+// the buffers are kept until the process ends, so a thread can keep
+// pointing at its own across traces
+static thread_local TraceBuffer *threadBuffer = nullptr;
+
+//	=====================================================================
+//	Get the buffer of the calling thread, making it on its first event
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		TraceBuffer * : the buffer, with a file name entry for events
+//                      outside any file
+
+static TraceBuffer *traceBuffer()
+{
+    if ( !threadBuffer )
+    {
+        lock_guard<mutex> lock( traceMutex );
+
+        traceBuffers.emplace_back( new TraceBuffer() );
+        threadBuffer      = traceBuffers.back().get();
+        threadBuffer->tid = static_cast<int>( traceBuffers.size() );
+        threadBuffer->files.push_back( "" );
+    }
+
+    return threadBuffer;
+}
+
+//	=====================================================================
+//	Start recording a trace
+//
+//	inputs:
+//      const string & : path to the trace file
+//
+//	outputs:
+//		bool : false if the file cannot be written; otherwise the events
+//             are written to it by traceStop(), at the latest on exit
+
+bool traceStart( const string &path )
+{
+    static bool atExit = false;
+
+    traceStop();
+
+    if ( !( traceOutput = fopen( path.c_str(), "w" ) ) )
+        return false;
+
+    if ( !atExit )
+        atExit = atexit( traceStop ) == 0;
+
+    traceEpoch = chrono::steady_clock::now();
+    traceOn    = true;
+    traceThreadName( "main" );
+
+    return true;
+}
+
+//	=====================================================================
+//	Stop recording and write the trace file as a JSON object with a
+//  "traceEvents" array: the name of every thread ("M" events), then its
+//  events as complete ("X") events with their begin and duration in
+//  microseconds and the file they belong to
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		N/A : the file is written and closed
+
+void traceStop()
+{
+    if ( !traceOn.exchange( false ) )
+        return;
+
+    lock_guard<mutex> lock( traceMutex );
+
+    bool first = true;
+    fputs( "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", traceOutput );
+
+    FORI( traceBuffers.size() )
+    {
+        TraceBuffer      &buffer = *traceBuffers[i];
+        lock_guard<mutex> events( buffer.eventsMutex );
+
+        if ( !buffer.name.empty() )
+        {
+            fprintf(
+                traceOutput,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":%s}}",
+                first ? "" : ",\n",
+                buffer.tid,
+                jsonString( buffer.name ).c_str() );
+            first = false;
+        }
+
+        for ( const TraceEvent &event: buffer.events )
+        {
+            fprintf(
+                traceOutput,
+                "%s{\"name\":%s,\"cat\":\"rawtoaces\",\"ph\":\"X\","
+                "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                first ? "" : ",\n",
+                jsonString( event.name ).c_str(),
+                buffer.tid,
+                event.begin * 1e-3,
+                ( event.end - event.begin ) * 1e-3 );
+            if ( !buffer.files[event.file].empty() )
+                fprintf(
+                    traceOutput,
+                    ",\"args\":{\"file\":%s}",
+                    jsonString( buffer.files[event.file] ).c_str() );
+            fputs( "}", traceOutput );
+            first = false;
+        }
+
+        buffer.events.clear();
+        buffer.files.resize( 1 );
+    }
+
+    fputs( "\n]}\n", traceOutput );
+    fclose( traceOutput );
+    traceOutput = nullptr;
+}
+
+//	=====================================================================
+//	Name the calling thread in the trace (e.g. "decode")
+//
+//	inputs:
+//      const char * : the name
+//
+//	outputs:
+//		N/A : the thread shows up under this name
+
+void traceThreadName( const char *name )
+{
+    if ( !traceOn.load( memory_order_relaxed ) )
+        return;
+
+    TraceBuffer      *buffer = traceBuffer();
+    lock_guard<mutex> lock( buffer->eventsMutex );
+    buffer->name = name;
+}
+
+//	=====================================================================
+//	Set the file the calling thread works on, which the following events
+//  of the thread belong to
+//
+//	inputs:
+//      const string & : path to the file ("" for none)
+//
+//	outputs:
+//		N/A : the file is noted in the buffer of the thread
+
+void traceFile( const string &file )
+{
+    if ( !traceOn.load( memory_order_relaxed ) )
+        return;
+
+    TraceBuffer      *buffer = traceBuffer();
+    lock_guard<mutex> lock( buffer->eventsMutex );
+    if ( buffer->files.back() != file )
+        buffer->files.push_back( file );
+}
+
+//	=====================================================================
+//	Get the time on the clock of the trace
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		int64_t : nanoseconds since traceStart()
+
+int64_t TraceScope::traceClock()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now() - traceEpoch )
+        .count();
+}
+
+//	=====================================================================
+//	Record an event of the calling thread
+//
+//	inputs:
+//      const char * : the name of the event (a string literal)
+//      int64_t      : when it began (traceClock())
+//      int64_t      : when it ended (traceClock())
+//
+//	outputs:
+//		N/A : the event is in the buffer of the thread
+
+void TraceScope::traceEvent( const char *name, int64_t begin, int64_t end )
+{
+    if ( !traceOn.load( memory_order_relaxed ) )
+        return;
+
+    TraceBuffer      *buffer = traceBuffer();
+    lock_guard<mutex> lock( buffer->eventsMutex );
+
+    TraceEvent event = { name, begin, end, buffer->files.size() - 1 };
+    buffer->events.push_back( event );
+}
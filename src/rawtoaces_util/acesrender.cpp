@@ -53,6 +53,8 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include <rawtoaces/acesrender.h>
+#include <rawtoaces/exrwriter.h>
+#include <rawtoaces/kernels.h>
 #include <rawtoaces/mathOps.h>
 
 #include <Imath/half.h>
@@ -62,14 +64,32 @@
 
 #include <aces/aces_Writer.h>
 
+#include <atomic>
+#include <climits>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
 #ifndef WIN32
 #    include <fcntl.h>
 #    include <sys/mman.h>
+#    include <unistd.h>
+#else
+#    include <process.h>
 #endif
 
 using namespace std;
 using namespace boost::property_tree;
 
+// Rows are converted and written in bands of about this size
+static const size_t bandBytes = 4 * 1024 * 1024;
+
+// The options that can be given for a single file (see configureOptions()):
+// the color, white balance, region, proxy and compression settings, and
+// LibRaw's processing options
+static const char *fileKeys = "RpMAODZ0cCPKkSnHtjWbqhfmsGB";
+
 #include <boost/filesystem.hpp>
 
 //  =====================================================================
@@ -91,6 +111,32 @@ void create_key( unordered_map<string, char> &keys )
     keys["--headroom"]      = 'M';
     keys["--valid-illums"]  = 'z';
     keys["--valid-cameras"] = 'Q';
+    keys["--jobs"]          = 'J';
+    keys["--pipeline"]      = 'Y';
+    keys["--idt-cache"]     = 'X';
+    keys["--threads"]       = 'U';
+    keys["--preview"]       = 'A';
+    keys["--proxy"]         = 'O';
+    keys["--roi"]           = 'D';
+    keys["--lut"]           = 'L';
+    keys["--write-behind"]  = 'w';
+    keys["--stats"]         = 'e';
+    keys["--trace"]         = 'g';
+    keys["--serve"]         = 'r';
+    keys["--watch"]         = 'i';
+    keys["--watch-settle"]  = 'l';
+    keys["--shard"]         = 'a';
+    keys["--shard-by-size"] = 'o';
+    keys["--claim"]         = 'x';
+    keys["--claim-timeout"] = 'u';
+    keys["--manifest"]      = 'y';
+    keys["--incremental"]   = '0';
+    keys["--journal"]       = '1';
+    keys["--resume"]        = '2';
+
+    keys["--exr-compression"] = 'Z';
+    keys["--exr-threads"]     = 'N';
+
     keys["-c"]              = 'c';
     keys["-C"]              = 'C';
     keys["-P"]              = 'P';
@@ -161,6 +207,80 @@ void usage( const char *prog )
         "  --valid-cameras         Show a list of cameras/models with available\n"
         "                          spectral sensitivity datasets\n"
         "\n"
+        "Batch options:\n"
+        "  --jobs <num>            Number of files processed in parallel\n"
+        "                            0=use all available cores\n"
+        "                            (default = 1)\n"
+        "  --pipeline <num>        Decode, transform and write files in separate\n"
+        "                          stages, keeping up to <num> files queued between\n"
+        "                          them (--jobs sets the number of decoding threads)\n"
+        "                            (default = 0, no pipeline)\n"
+        "  --idt-cache <dir>       Keep IDT matrices calculated from spectral\n"
+        "                          sensitivities in this directory and reuse them\n"
+        "                          across runs\n"
+        "  --threads <num>         Number of threads converting the pixels of\n"
+        "                          each file\n"
+        "                            0=share all available cores among --jobs\n"
+        "                            (default = 0)\n"
+        "  --proxy <size>[:<suffix>]\n"
+        "                          Also write a downscaled copy of each file,\n"
+        "                          rendered from the same decode; <size> is 1/<n>\n"
+        "                          or a width in pixels, and <suffix> is inserted\n"
+        "                          in its name (default = _half, _quarter, _1-<n>\n"
+        "                          or _<width>); may be repeated\n"
+        "  --roi <x y w h>         Only convert and write this rectangle of the\n"
+        "                          image (in output pixels); the file keeps the\n"
+        "                          size of the whole frame as its display window\n"
+        "  --lut [0-2]             Convert 16-bit pixels with lookup tables of the\n"
+        "                          products of the matrix and every sample value\n"
+        "                            0=never, 1=always, 2=for files sharing a\n"
+        "                            matrix if faster on this CPU (default = 2)\n"
+        "  --exr-compression <type>\n"
+        "                          Write the files with OpenEXR instead of\n"
+        "                          aces_container, compressed with none, zip,\n"
+        "                          piz, dwaa or dwab (only uncompressed files are\n"
+        "                          flagged as ACES container files)\n"
+        "  --exr-threads <num>     Number of threads compressing the files written\n"
+        "                          with OpenEXR (implies --exr-compression none\n"
+        "                          unless given)\n"
+        "  --write-behind <MB>     Write the files on a thread of their own while\n"
+        "                          the next ones are converted, holding up to\n"
+        "                          this much memory of images waiting to be\n"
+        "                          written (default = 0, off)\n"
+        "  --serve <socket>        Keep running and convert the files requested\n"
+        "                          as JSON lines on this Unix domain socket (or on\n"
+        "                          the standard input with \"-\"), reusing the\n"
+        "                          loaded data across requests\n"
+        "  --watch <dir>           Keep running and convert the raw files copied\n"
+        "                          into this directory (or its subdirectories) as\n"
+        "                          they arrive; may be repeated\n"
+        "  --watch-settle <ms>     Time a file must be left unchanged after it is\n"
+        "                          written before it is converted\n"
+        "                            (default = 1000)\n"
+        "  --shard <i/N>           Only convert the i-th (0 to N-1) of N disjoint\n"
+        "                          shares of the files, e.g. on node i of a farm\n"
+        "  --shard-by-size         Balance the shares by bytes rather than by\n"
+        "                          number of files\n"
+        "  --claim <dir>           Share the files with other rawtoaces processes,\n"
+        "                          on any host, through claim files in this shared\n"
+        "                          directory: each file is converted once, by the\n"
+        "                          first process to claim it\n"
+        "  --claim-timeout <sec>   Take over the claims of processes that stopped\n"
+        "                          touching them for this long (default = 300)\n"
+        "  --manifest <file>       Convert the files listed in this JSON Lines or\n"
+        "                          CSV file (\"-\" for the standard input), each\n"
+        "                          with its own output and settings; not with\n"
+        "                          --claim, --shard, --pipeline, --write-behind\n"
+        "                          or --journal\n"
+        "  --incremental           Skip the files whose outputs are newer and were\n"
+        "                          written with the same settings\n"
+        "  --journal <file>        Record in this file when each file is started\n"
+        "                          and finished, so an interrupted batch can be\n"
+        "                          resumed\n"
+        "  --resume <file>         Go on with the batch of this journal, skipping\n"
+        "                          the files it has converted; the files that\n"
+        "                          failed are tried again\n"
+        "\n"
         "Raw conversion options:\n"
         "  -c float                Set adjust maximum threshold (default = 0.75)\n"
         "  -C <r b>                Correct chromatic aberration\n"
@@ -176,6 +296,8 @@ void usage( const char *prog )
         "  -b <num>                Adjust brightness (default = 1.0)\n"
         "  -q [0-3]                Set the interpolation quality\n"
         "  -h                      Half-size color image (twice as fast as \"-q 0\")\n"
+        "  --preview               Quarter-size image binned from the raw data,\n"
+        "                          skipping demosaicing (much faster than \"-h\")\n"
         "  -f                      Interpolate RGGB as four colors\n"
         "  -m <num>                Apply a 3x3 median filter to R-G and B-G\n"
         "  -s [0..N-1]             Select one raw image from input file\n"
@@ -186,6 +308,11 @@ void usage( const char *prog )
         "  -v                      Verbose: print progress messages (repeated -v will add verbosity)\n"
         "  -F                      Use FILE I/O instead of streambuf API\n"
         "  -d                      Detailed timing report\n"
+        "  --stats <file>          Write the wall and CPU time of every step, and\n"
+        "                          the bytes read and written, of each file to\n"
+        "                          this file as JSON Lines, then a summary\n"
+        "  --trace <file>          Record a timeline of the steps of every file on\n"
+        "                          every thread as a Chrome trace (for Perfetto)\n"
 #ifndef WIN32
         "  -E                      Use mmap()-ed buffer instead of plain FILE I/O\n"
 #endif
@@ -193,15 +320,104 @@ void usage( const char *prog )
     exit( -1 );
 };
 
+//  =====================================================================
+//	Constructor / Destructor of the rendered image
+
+AcesImage::AcesImage()
+    : width( 0 )
+    , height( 0 )
+    , channels( 0 )
+    , pixels( nullptr )
+    , pool( nullptr )
+    , isoSpeed( 0 )
+    , expTime( 0 )
+    , aperture( 0 )
+    , focalLength( 0 )
+    , originX( 0 )
+    , originY( 0 )
+    , displayWidth( 0 )
+    , displayHeight( 0 )
+    , compression( exrContainer )
+    , durable( false )
+{}
+
+AcesImage::~AcesImage()
+{
+    release();
+}
+
+//  =====================================================================
+//	Allocate the pixels for the width, height and channels of the image
+//
+//	inputs:
+//      BufferPool * : the pool to take the buffer from (nullptr to use
+//                     the heap); it must outlive the image
+//
+//	outputs:
+//      N/A : pixels points to the new (uninitialized) buffer
+
+void AcesImage::allocate( BufferPool *bufferPool )
+{
+    release();
+
+    size_t total = size_t( channels ) * width * height;
+
+    pool = bufferPool;
+    if ( pool )
+        pixels = (uint16_t *)pool->acquire( total * sizeof( uint16_t ) );
+    else
+        pixels = new ( std::nothrow ) uint16_t[total];
+
+    if ( !pixels )
+        throw std::bad_alloc();
+}
+
+//  =====================================================================
+//	Release the pixels (back to the pool they came from)
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : pixels is nullptr
+
+void AcesImage::release()
+{
+    if ( pool )
+        pool->release( pixels );
+    else
+        delete[] pixels;
+
+    pixels = nullptr;
+    pool   = nullptr;
+}
+
 //  =====================================================================
 //	Defaul Constructor
 
 AcesRender::AcesRender()
 {
+    _pathToRaw    = nullptr;
+    _idtCache     = nullptr;
+    _bufferPool   = &_ownPool;
+    _stats        = nullptr;
     _idt          = new Idt();
-    _image        = new libraw_processed_image_t();
+    _image        = nullptr;
+    _preview      = nullptr;
     _rawProcessor = new LibRawAces();
 
+    _previewWidth  = 0;
+    _previewHeight = 0;
+    _previewFlip   = 0;
+
+    FORI( 4 ) _roi[i] = _window[i] = 0;
+    FORIJ( 3, 3 ) _customMatrix[i][j] = 0.0f;
+    _fileOptions = false;
+
+    _lut.channels = 0;
+    _lutUses      = 0;
+    _useLut       = false;
+
     _idtm.resize( 3 );
     _wbv.resize( 3 );
     _catm.resize( 3 );
@@ -224,7 +440,7 @@ AcesRender::~AcesRender()
 {
     if ( _pathToRaw )
     {
-        delete _pathToRaw;
+        free( _pathToRaw );
         _pathToRaw = nullptr;
     }
 
@@ -236,10 +452,16 @@ AcesRender::~AcesRender()
 
     if ( _image )
     {
-        delete _image;
+        LibRaw::dcraw_clear_mem( _image );
         _image = nullptr;
     }
 
+    if ( _preview )
+    {
+        _bufferPool->release( _preview );
+        _preview = nullptr;
+    }
+
     if ( _rawProcessor )
     {
         delete _rawProcessor;
@@ -367,6 +589,31 @@ void AcesRender::initialize( const dataPath &dp )
     _opts.get_illums         = 0;
     _opts.get_cameras        = 0;
     _opts.get_libraw_cameras = 0;
+    _opts.jobs               = 1;
+    _opts.pipeline           = 0;
+    _opts.threads            = 0;
+    _opts.preview            = 0;
+    _opts.illumType          = nullptr;
+    _opts.idtCachePath.clear();
+    _opts.statsPath.clear();
+    _opts.serve.clear();
+    _opts.watchDirs.clear();
+    _opts.claimPath.clear();
+    _opts.manifestPath.clear();
+    _opts.journalPath.clear();
+    _opts.outputSizes.clear();
+    FORI( 4 ) _opts.roi[i] = 0;
+    _opts.lut            = 2;
+    _opts.exrCompression = exrContainer;
+    _opts.exrThreads     = -1;
+    _opts.writeBehind    = 0;
+    _opts.watchSettle    = 1000;
+    _opts.shard[0]       = 0;
+    _opts.shard[1]       = 0;
+    _opts.shardBySize    = 0;
+    _opts.claimTimeout   = 300;
+    _opts.incremental    = 0;
+    _opts.resume         = 0;
 
 #ifndef WIN32
     _opts.iobuffer = 0;
@@ -402,6 +649,214 @@ void AcesRender::initialize( const dataPath &dp )
     OUT.use_auto_wb    = 0;
 }
 
+//	=====================================================================
+//	Go back to the settings of another "AcesRender" instance, e.g. after
+//  a job of a server (--serve) changed some of them
+//
+//	inputs:
+//      const AcesRender & : a fully configured renderer (i.e., after
+//                           configureSettings() and fetchIlluminant())
+//
+//	outputs:
+//      N/A : _opts, _rawProcessor (imgdata.params) and the loaded
+//            illuminants will be copied from acesrender
+
+void AcesRender::resetSettings( const AcesRender &acesrender )
+{
+    _idt->setIlluminants( acesrender._idt->getIlluminants() );
+
+    _opts = acesrender._opts;
+    FORIJ( 3, 3 ) _customMatrix[i][j] = acesrender._customMatrix[i][j];
+
+#ifndef WIN32
+    _opts.msize    = 0;
+    _opts.iobuffer = 0;
+#endif
+
+    _rawProcessor->imgdata.params = acesrender._rawProcessor->imgdata.params;
+}
+
+//	=====================================================================
+//	Hash the settings that make a difference to the files written, for
+//  --incremental to tell whether an existing output is still what this
+//  run would write. It is a 64-bit FNV-1a hash of the version, the color
+//  and output settings, and the LibRaw settings that change the image.
+//  Left out are the settings of the run only (e.g. --jobs, --threads,
+//  --pipeline, --lut, which gives the same output either way, and
+//  --exr-threads) and the LibRaw settings fixed by configureSettings()
+//  or derived from the methods hashed here (output_color, output_bps,
+//  gamm, use_camera_wb, use_camera_matrix, use_auto_wb).
+//
+//	inputs:
+//         N/A
+//
+//	outputs:
+//      string: the hash as 16 hex digits
+
+string AcesRender::settingsHash() const
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    auto mix = [&hash]( const void *data, size_t size ) {
+        const unsigned char *bytes = static_cast<const unsigned char *>( data );
+        FORI( size )
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+    auto mixS = [&mix]( const char *text ) {
+        string value = text ? text : "";
+        mix( value.c_str(), value.size() + 1 );
+    };
+
+    mixS( VERSION );
+
+    mix( &_opts.mat_method, sizeof( _opts.mat_method ) );
+    mix( &_opts.wb_method, sizeof( _opts.wb_method ) );
+    mix( &_opts.use_illum, sizeof( _opts.use_illum ) );
+    mix( &_opts.use_mul, sizeof( _opts.use_mul ) );
+    mix( &_opts.highlight, sizeof( _opts.highlight ) );
+    mix( &_opts.preview, sizeof( _opts.preview ) );
+    mix( &_opts.scale, sizeof( _opts.scale ) );
+    mix( _opts.roi, sizeof( _opts.roi ) );
+    mix( &_opts.exrCompression, sizeof( _opts.exrCompression ) );
+    mixS( _opts.illumType );
+    if ( _opts.mat_method == matMethod3 )
+        mix( _customMatrix, sizeof( _customMatrix ) );
+
+    FORI( _opts.outputSizes.size() )
+    {
+        mix( &_opts.outputSizes[i].divisor, sizeof( int ) );
+        mix( &_opts.outputSizes[i].width, sizeof( int ) );
+        mixS( _opts.outputSizes[i].suffix.c_str() );
+    }
+
+    const libraw_output_params_t &params = _rawProcessor->imgdata.params;
+    mix( params.greybox, sizeof( params.greybox ) );
+    mix( params.cropbox, sizeof( params.cropbox ) );
+    mix( params.aber, sizeof( params.aber ) );
+    mix( params.user_mul, sizeof( params.user_mul ) );
+    mix( &params.bright, sizeof( params.bright ) );
+    mix( &params.threshold, sizeof( params.threshold ) );
+    mix( &params.adjust_maximum_thr, sizeof( params.adjust_maximum_thr ) );
+    mix( &params.half_size, sizeof( params.half_size ) );
+    mix( &params.four_color_rgb, sizeof( params.four_color_rgb ) );
+    mix( &params.highlight, sizeof( params.highlight ) );
+    mix( &params.user_flip, sizeof( params.user_flip ) );
+    mix( &params.user_qual, sizeof( params.user_qual ) );
+    mix( &params.user_black, sizeof( params.user_black ) );
+    mix( &params.user_sat, sizeof( params.user_sat ) );
+    mix( &params.med_passes, sizeof( params.med_passes ) );
+    mix( &params.no_auto_bright, sizeof( params.no_auto_bright ) );
+    mix( &params.use_fuji_rotate, sizeof( params.use_fuji_rotate ) );
+    mix( &params.green_matching, sizeof( params.green_matching ) );
+    mix( params.user_cblack, sizeof( params.user_cblack ) );
+    mix( &params.auto_bright_thr, sizeof( params.auto_bright_thr ) );
+    mix( &params.exp_correc, sizeof( params.exp_correc ) );
+    mix( &params.exp_shift, sizeof( params.exp_shift ) );
+    mix( &params.exp_preser, sizeof( params.exp_preser ) );
+    mixS( params.bad_pixels );
+    mixS( params.dark_frame );
+#if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION( 0, 21, 0 )
+    const libraw_raw_unpack_params_t &rawParams =
+        _rawProcessor->imgdata.rawparams;
+    mix( &rawParams.shot_select, sizeof( rawParams.shot_select ) );
+#else
+    mix( &params.shot_select, sizeof( params.shot_select ) );
+#endif
+
+    char hex[17];
+    snprintf( hex, sizeof( hex ), "%016llx", (unsigned long long)hash );
+    return hex;
+}
+
+//	=====================================================================
+//	Take over the settings of another "AcesRender" instance so that
+//  several renderers can process files independently of each other
+//
+//	inputs:
+//      const AcesRender & : a fully configured renderer (i.e., after
+//                           configureSettings() and fetchIlluminant())
+//
+//	outputs:
+//      N/A : the same as resetSettings()
+
+void AcesRender::cloneSettings( const AcesRender &acesrender )
+{
+    resetSettings( acesrender );
+}
+
+//	=====================================================================
+//	Share a cache of IDT matrices / white balance coefficients with other
+//  renderers, so that files from the same camera shot under the same
+//  conditions only go through the regression once
+//
+//	inputs:
+//      IdtCache * : the cache (nullptr to disable caching)
+//
+//	outputs:
+//      N/A : prepareIDT() and prepareWB() will look up the cache first
+
+void AcesRender::setIdtCache( IdtCache *cache )
+{
+    _idtCache = cache;
+}
+
+//	=====================================================================
+//	Share a pool of pixel buffers with other renderers. By default every
+//  renderer recycles buffers through a pool of its own.
+//
+//	inputs:
+//      BufferPool * : the pool (nullptr to go back to the own pool); it
+//                     must outlive the renderer and its images
+//
+//	outputs:
+//      N/A : rendered images take their buffers from the pool
+
+void AcesRender::setBufferPool( BufferPool *pool )
+{
+    _bufferPool = pool ? pool : &_ownPool;
+}
+
+//	=====================================================================
+//	Time the steps of converting the next file (--stats)
+//
+//	inputs:
+//      FileStats * : where the times of the file go (nullptr not to
+//                    time anything)
+//
+//	outputs:
+//      N/A : the steps add their wall and CPU time to the stages
+
+void AcesRender::setStats( FileStats *stats )
+{
+    _stats = stats;
+}
+
+//	=====================================================================
+//	Reject an option given to configureSettings(). The message is thrown
+//  rather than printed, so that a server (--serve) only fails the job
+//  that asked for it; main() prints it and exits.
+//
+//	inputs:
+//      const char * : printf() format of the message, then its arguments
+//
+//	outputs:
+//      N/A : std::invalid_argument is thrown
+
+[[noreturn]] static void optionError( const char *format, ... )
+{
+    char    message[1024];
+    va_list args;
+
+    va_start( args, format );
+    vsnprintf( message, sizeof( message ), format, args );
+    va_end( args );
+
+    throw std::invalid_argument( message );
+}
+
 //	=====================================================================
 //	Configure settings by taking in user specified options
 //
@@ -437,30 +892,40 @@ int AcesRender::configureSettings( int argc, char *argv[] )
 
         arg++;
 
-        static unordered_map<string, char> keys;
-        create_key( keys );
+        // made once, as renderers may be configured on several threads
+        static const unordered_map<string, char> keys = [] {
+            unordered_map<string, char> map;
+            create_key( map );
+            return map;
+        }();
 
-        char opt = keys[key];
+        auto found = keys.find( key );
+        char opt   = found != keys.end() ? found->second : 0;
 
         if ( !opt )
         {
-            fprintf(
-                stderr, "\nNon-recognizable flag - \"%s\"\n", key.c_str() );
-            exit( -1 );
+            optionError( "\nNon-recognizable flag - \"%s\"\n", key.c_str() );
+        }
+
+        // the options of a single file (see configureOptions()) can only
+        // change how that file is converted
+        if ( _fileOptions && !strchr( fileKeys, opt ) )
+        {
+            optionError(
+                "\nError: \"%s\" cannot be given for a single file.\n",
+                key.c_str() );
         }
 
-        if ( ( cp = strchr( sp = (char *)"HcnbksStqmBC", opt ) ) != 0 )
+        if ( ( cp = strchr( sp = (char *)"HcnbksStqmBCJYUODLNwlu", opt ) ) != 0 )
         {
-            for ( int i = 0; i < "111111111142"[cp - sp] - '0'; i++ )
+            for ( int i = 0; i < "1111111111421111411111"[cp - sp] - '0'; i++ )
             {
-                if ( !isdigit( argv[arg + i][0] ) )
+                if ( arg + i >= argc || !isdigit( argv[arg + i][0] ) )
                 {
-                    fprintf(
-                        stderr,
+                    optionError(
                         "\nError: Non-numeric argument to "
                         "\"%s\"\n",
                         key.c_str() );
-                    exit( -1 );
                 }
             }
         }
@@ -528,6 +993,142 @@ int AcesRender::configureSettings( int argc, char *argv[] )
                     break;
                 }
             case 'M': _opts.scale = atof( argv[arg++] ); break;
+            case 'J': {
+                _opts.jobs = atoi( argv[arg++] );
+                if ( _opts.jobs == 0 )
+                    _opts.jobs = std::max( 1u, thread::hardware_concurrency() );
+                break;
+            }
+            case 'Y': _opts.pipeline = atoi( argv[arg++] ); break;
+            case 'U': _opts.threads = atoi( argv[arg++] ); break;
+            case 'A': _opts.preview = 1; break;
+            case 'L': _opts.lut = atoi( argv[arg++] ); break;
+            case 'N': _opts.exrThreads = atoi( argv[arg++] ); break;
+            case 'w': _opts.writeBehind = atoi( argv[arg++] ); break;
+            case 'Z':
+                _opts.exrCompression = exrCompression( argv[arg] );
+                if ( _opts.exrCompression < 0 )
+                {
+                    optionError(
+                        "\nError: Unknown compression - \"%s\"\n", argv[arg] );
+                }
+                arg++;
+                break;
+            case 'D':
+                FORI( 4 ) _opts.roi[i] = atoi( argv[arg++] );
+                if ( _opts.roi[2] <= 0 || _opts.roi[3] <= 0 )
+                {
+                    optionError(
+                        "\nError: The region of interest of \"%s\" "
+                        "must not be empty\n",
+                        key.c_str() );
+                }
+                break;
+            case 'O': {
+                OutputSize size;
+                string     spec  = argv[arg++];
+                size_t     colon = spec.find( ':' );
+                if ( colon != string::npos )
+                {
+                    size.suffix = spec.substr( colon + 1 );
+                    spec        = spec.substr( 0, colon );
+                }
+
+                size.divisor = 0;
+                size.width   = 0;
+                if ( spec.compare( 0, 2, "1/" ) == 0 )
+                    size.divisor = atoi( spec.c_str() + 2 );
+                else
+                    size.width = atoi( spec.c_str() );
+
+                if ( size.divisor == 1 || size.divisor < 0 ||
+                     ( !size.divisor && size.width <= 0 ) )
+                {
+                    optionError(
+                        "\nError: Invalid argument to \"%s\" - \"%s\"\n",
+                        key.c_str(),
+                        spec.c_str() );
+                }
+
+                if ( colon == string::npos )
+                {
+                    if ( size.divisor == 2 )
+                        size.suffix = "_half";
+                    else if ( size.divisor == 4 )
+                        size.suffix = "_quarter";
+                    else if ( size.divisor )
+                        size.suffix = "_1-" + to_string( size.divisor );
+                    else
+                        size.suffix = "_" + to_string( size.width );
+                }
+
+                _opts.outputSizes.push_back( size );
+                break;
+            }
+            case 'e': _opts.statsPath = argv[arg++]; break;
+            case 'r': _opts.serve = argv[arg++]; break;
+            case 'i': _opts.watchDirs.push_back( argv[arg++] ); break;
+            case 'l': _opts.watchSettle = atoi( argv[arg++] ); break;
+            case 'a': {
+                char end;
+                if ( sscanf(
+                         argv[arg],
+                         "%d/%d%c",
+                         &_opts.shard[0],
+                         &_opts.shard[1],
+                         &end ) != 2 ||
+                     _opts.shard[1] <= 0 || _opts.shard[0] < 0 ||
+                     _opts.shard[0] >= _opts.shard[1] )
+                {
+                    optionError(
+                        "\nError: \"%s\" needs a share i/N with i from 0 "
+                        "to N-1, not \"%s\"\n",
+                        key.c_str(),
+                        argv[arg] );
+                }
+                arg++;
+                break;
+            }
+            case 'o': _opts.shardBySize = 1; break;
+            case 'x': _opts.claimPath = argv[arg++]; break;
+            case 'u': _opts.claimTimeout = atoi( argv[arg++] ); break;
+            case 'y': _opts.manifestPath = argv[arg++]; break;
+            case '0': _opts.incremental = 1; break;
+            case '1':
+                _opts.journalPath = argv[arg++];
+                _opts.resume      = 0;
+                break;
+            case '2':
+                _opts.journalPath = argv[arg++];
+                _opts.resume      = 1;
+                break;
+            case 'g': {
+                // started right away, so the data loaded before the
+                // batch is on the timeline too
+                if ( !traceStart( argv[arg] ) )
+                {
+                    optionError(
+                        "\nError: Cannot write the trace to \"%s\"\n",
+                        argv[arg] );
+                }
+                arg++;
+                break;
+            }
+            case 'X': {
+                _opts.idtCachePath = argv[arg++];
+
+                boost::system::error_code ec;
+                boost::filesystem::create_directories( _opts.idtCachePath, ec );
+                if ( ec )
+                {
+                    optionError(
+                        "\nError: Cannot create the IDT cache directory "
+                        "\"%s\" - %s\n",
+                        _opts.idtCachePath.c_str(),
+                        ec.message().c_str() );
+                }
+                break;
+            }
             case 'H': {
                 OUT.highlight   = atoi( argv[arg++] );
                 _opts.highlight = OUT.highlight;
@@ -537,50 +1138,29 @@ int AcesRender::configureSettings( int argc, char *argv[] )
                 _opts.mat_method = matMethods_t( atoi( argv[arg++] ) );
                 if ( _opts.mat_method > 3 || _opts.mat_method < 0 )
                 {
-                    fprintf(
-                        stderr,
+                    optionError(
                         "\nError: Invalid argument to "
                         "\"%s\" \n",
                         key.c_str() );
-                    exit( -1 );
                 }
 
                 if ( _opts.mat_method == matMethod3 )
                 {
-
-                    bool flag = false;
+                    float custom[9];
                     FORI( 9 )
                     {
-                        if ( isalpha( argv[arg][0] ) )
+                        if ( arg >= argc || isalpha( argv[arg][0] ) )
                         {
-                            fprintf(
-                                stderr,
+                            optionError(
                                 "\nError: Non-numeric argument to "
                                 "\"%s %i\" \n",
                                 key.c_str(),
                                 _opts.mat_method );
-                            exit( -1 );
-                        }
-                        custom_Buffer[i] =
-                            static_cast<float>( atof( argv[arg++] ) );
-                        if ( i == 8 )
-                        {
-                            flag = true;
                         }
+                        custom[i] = static_cast<float>( atof( argv[arg++] ) );
                     }
 
-                    // For testing purposes FORI(9){ cout<<custom_Buffer[i]<<endl;}
-                    if ( flag )
-                    {
-                        FORI( 3 )
-                        {
-                            FORJ( 3 )
-                            {
-                                custom_Matrix[i][j] = custom_Buffer[i * 3 + j];
-                                //cout<< custom_Matrix[i][j]<<endl;
-                            }
-                        }
-                    }
+                    FORIJ( 3, 3 ) _customMatrix[i][j] = custom[i * 3 + j];
                 }
                 break;
             }
@@ -590,11 +1170,9 @@ int AcesRender::configureSettings( int argc, char *argv[] )
                 {
                     if ( !isdigit( flag[i] ) )
                     {
-                        fprintf(
-                            stderr,
+                        optionError(
                             "\nNon-recognizable argument to "
                             "\"--wb-method\".\n" );
-                        exit( -1 );
                     }
                 }
 
@@ -609,11 +1187,9 @@ int AcesRender::configureSettings( int argc, char *argv[] )
 
                     if ( !isValidCT( string( _opts.illumType ) ) )
                     {
-                        fprintf(
-                            stderr,
+                        optionError(
                             "\nError: white balance method 1 requires a valid "
                             "illuminant (e.g., D60, 3200K) to be specified\n" );
-                        exit( -1 );
                     }
                 }
                 // 3
@@ -623,13 +1199,11 @@ int AcesRender::configureSettings( int argc, char *argv[] )
                     {
                         if ( !isdigit( argv[arg][0] ) )
                         {
-                            fprintf(
-                                stderr,
+                            optionError(
                                 "\nError: Non-numeric argument to "
                                 "\"%s %i\" \n",
                                 key.c_str(),
                                 _opts.wb_method );
-                            exit( -1 );
                         }
                         OUT.greybox[i] =
                             static_cast<float>( atof( argv[arg++] ) );
@@ -643,13 +1217,11 @@ int AcesRender::configureSettings( int argc, char *argv[] )
                     {
                         if ( !isdigit( argv[arg][0] ) )
                         {
-                            fprintf(
-                                stderr,
+                            optionError(
                                 "\nError: Non-numeric argument to "
                                 "\"%s %i\" \n",
                                 key.c_str(),
                                 _opts.wb_method );
-                            exit( -1 );
                         }
                         OUT.user_mul[i] =
                             static_cast<float>( atof( argv[arg++] ) );
@@ -657,11 +1229,8 @@ int AcesRender::configureSettings( int argc, char *argv[] )
                 }
                 else if ( _opts.wb_method > 4 || _opts.wb_method < 0 )
                 {
-                    fprintf(
-                        stderr,
-                        "\nError: Invalid argument to \"%s\" \n",
-                        key.c_str() );
-                    exit( -1 );
+                    optionError(
+                        "\nError: Invalid argument to \"%s\" \n", key.c_str() );
                 }
                 break;
             }
@@ -669,29 +1238,120 @@ int AcesRender::configureSettings( int argc, char *argv[] )
             case 'E': _opts.use_mmap = 1; break;
 #endif
             default:
-                fprintf(
-                    stderr, "\nError: Unknown option \"%s\".\n", key.c_str() );
-                exit( -1 );
+                optionError( "\nError: Unknown option \"%s\".\n", key.c_str() );
+        }
+    }
+
+    if ( !_opts.serve.empty() + !_opts.watchDirs.empty() +
+             !_opts.manifestPath.empty() >
+         1 )
+    {
+        optionError(
+            "\nError: Only one of --serve, --watch and --manifest can be "
+            "given.\n" );
+    }
+
+    // The daemons and manifests convert through the job queue of the
+    // server, which neither shares, shards nor journals the files
+    if ( ( !_opts.serve.empty() || !_opts.watchDirs.empty() ||
+           !_opts.manifestPath.empty() ) &&
+         ( !_opts.journalPath.empty() || !_opts.claimPath.empty() ||
+           _opts.shard[1] > 0 || _opts.shardBySize || _opts.pipeline > 0 ||
+           _opts.writeBehind > 0 ) )
+    {
+        optionError(
+            "\nError: --claim, --shard, --shard-by-size, --pipeline, "
+            "--write-behind, --journal and --resume are only for batches of "
+            "files, not with --serve, --watch or --manifest.\n" );
+    }
+
+    // OpenEXR writes the files if any of its settings is given
+    if ( _opts.exrThreads >= 0 && _opts.exrCompression == exrContainer )
+        _opts.exrCompression = exrNone;
+
+    if ( _opts.exrCompression != exrContainer )
+    {
+        if ( !exrWriterAvailable() )
+        {
+            optionError(
+                "\nError: rawtoaces was built without OpenEXR, so files "
+                "can only be written uncompressed.\n" );
         }
+
+        if ( _opts.exrThreads >= 0 )
+            setExrThreads( _opts.exrThreads );
     }
 
     return arg;
 }
 
+//	=====================================================================
+//	Apply the options of a single file on top of the current settings,
+//  with the same syntax as on the command line, e.g. per job of a server
+//  (--serve) or per line of a manifest (--manifest). Only the options
+//  that change how a file is converted are accepted (see fileKeys);
+//  those of the whole run, like --jobs, --trace or --help, are errors.
+//
+//	inputs:
+//      const vector < string > & : the options, e.g. { "--wb-method",
+//                                  "1", "D60" }
+//
+//	outputs:
+//      N/A : _opts and _rawProcessor (imgdata.params) are updated; an
+//            exception is thrown for invalid options
+
+void AcesRender::configureOptions( const vector<string> &options )
+{
+    if ( options.empty() )
+        return;
+
+    // kept until the next call, as the settings may point into them
+    _options.clear();
+    _options.push_back( vector<char>( 10 ) );
+    strcpy( &_options[0][0], "rawtoaces" );
+    FORI( options.size() )
+        _options.push_back( vector<char>(
+            options[i].c_str(), options[i].c_str() + options[i].size() + 1 ) );
+
+    vector<char *> argv;
+    FORI( _options.size() ) argv.push_back( &_options[i][0] );
+    argv.push_back( nullptr );
+
+    int argc = static_cast<int>( _options.size() );
+    int arg  = 0;
+    try
+    {
+        _fileOptions = true;
+        arg          = configureSettings( argc, &argv[0] );
+        _fileOptions = false;
+    }
+    catch ( ... )
+    {
+        _fileOptions = false;
+        throw;
+    }
+
+    if ( arg < argc )
+        throw std::invalid_argument(
+            string( "Unexpected argument \"" ) + argv[arg] + "\"" );
+}
+
 //	=====================================================================
 //	Set processed image buffer from libraw
 //
 //	inputs:
 //      libraw_processed_image_t     : processed RAW through libraw
+//                                     (from dcraw_make_mem_image())
 //
 //	outputs:
-//      N/A        : _image will point to the address of image
+//      N/A        : _image will point to the address of image; the
+//                   renderer releases it
 
 void AcesRender::setPixels( libraw_processed_image_t *image )
 {
     assert( image );
-    if ( _image != nullptr )
-        delete _image;
+    if ( _image != nullptr && _image != image )
+        LibRaw::dcraw_clear_mem( _image );
     _image = image;
 
     ////    Strange because memcpying on libraw_processed_image_t
@@ -814,6 +1474,7 @@ void AcesRender::gatherSupportedCameras()
 int AcesRender::openRawPath( const char *pathToRaw )
 {
     assert( pathToRaw != nullptr );
+    StageTimer timer( _stats, stageOpen );
 
 #ifndef WIN32
     //    void *iobuffer=0;
@@ -908,6 +1569,7 @@ int AcesRender::openRawPath( const char *pathToRaw )
 int AcesRender::unpack( const char *pathToRaw )
 {
     assert( _opts.ret == LIBRAW_SUCCESS && pathToRaw != nullptr );
+    StageTimer timer( _stats, stageUnpack );
 
     if ( ( _opts.ret = _rawProcessor->unpack() ) != LIBRAW_SUCCESS )
     {
@@ -963,25 +1625,22 @@ int AcesRender::fetchCameraSenPath( const libraw_iparams_t &P )
 }
 
 //	=====================================================================
-//	Fetch light source data to calcuate white balance coefficients
+//	List the light source data files in the data directories
 //
 //	inputs:
-//      const char *  : type of light source ("unknown" if not specified)
-//                      (in the environment variable of "AMPAS_ILLUMINANT_PATH"
-//                       such as "/usr/local/include/rawtoaces/data/Illuminant")
+//      const vector<string> & : the data directories
 //
 //	outputs:
-//		int : "1" means loading/injecting light source datasets successfully,
-//            "0" means error / no illumiant data has been loaded
+//		vector<string> : paths to the JSON files of their "illuminant"
+//                       subdirectories
 
-int AcesRender::fetchIlluminant( const char *illumType )
+static vector<string> illuminantFiles( const vector<string> &envPaths )
 {
     vector<string> paths;
 
-    FORI( _opts.envPaths.size() )
+    FORI( envPaths.size() )
     {
-        vector<string> iFiles =
-            openDir( ( _opts.envPaths )[i] + "/illuminant" );
+        vector<string> iFiles = openDir( envPaths[i] + "/illuminant" );
         for ( vector<string>::iterator file = iFiles.begin();
               file != iFiles.end();
               ++file )
@@ -993,7 +1652,60 @@ int AcesRender::fetchIlluminant( const char *illumType )
         }
     }
 
-    return _idt->loadIlluminant( paths, static_cast<string>( illumType ) );
+    return paths;
+}
+
+//	=====================================================================
+//	Fetch light source data to calcuate white balance coefficients
+//
+//	inputs:
+//      const char *  : type of light source ("unknown" if not specified)
+//                      (in the environment variable of "AMPAS_ILLUMINANT_PATH"
+//                       such as "/usr/local/include/rawtoaces/data/Illuminant")
+//
+//	outputs:
+//		int : "1" means loading/injecting light source datasets successfully,
+//            "0" means error / no illumiant data has been loaded
+
+int AcesRender::fetchIlluminant( const char *illumType )
+{
+    return _idt->loadIlluminant(
+        illuminantFiles( _opts.envPaths ), static_cast<string>( illumType ) );
+}
+
+//	=====================================================================
+//	Find the light source of --wb-method 1 by its name, the way
+//  fetchIlluminant() loads it for a renderer of its own. It is not
+//  looked up in the illuminants of the run, which a job of a server
+//  must not change, and in which e.g. "d55" is 5500K rather than the
+//  5500K * 1.4388 / 1.438 of a daylight named on the command line.
+//
+//	inputs:
+//      const char *  : type of light source
+//
+//	outputs:
+//		const Illum & : the light source, loaded once per renderer;
+//                      std::runtime_error is thrown if there is none by
+//                      this name
+
+const Illum &AcesRender::namedIlluminant( const char *illumType )
+{
+    unordered_map<string, Illum>::const_iterator found =
+        _namedIllums.find( illumType );
+    if ( found != _namedIllums.end() )
+        return found->second;
+
+    Idt named;
+    if ( !named.loadIlluminant(
+             illuminantFiles( _opts.envPaths ),
+             static_cast<string>( illumType ) ) )
+    {
+        throw std::runtime_error(
+            "No matching light source. Please find available options by "
+            "\"rawtoaces --valid-illum\"." );
+    }
+
+    return _namedIllums[illumType] = named.getIlluminants()[0];
 }
 
 vector<string> findFiles( string filePath, vector<string> searchPaths )
@@ -1026,17 +1738,47 @@ vector<string> findFiles( string filePath, vector<string> searchPaths )
 
 int AcesRender::prepareIDT( const libraw_iparams_t &P, float *M )
 {
+    StageTimer    timer( _stats, stageIdt );
+    string        key;
+    IdtCacheEntry entry;
+
+    if ( _idtCache )
+    {
+        // the as-shot multipliers only matter if the light source
+        // has to be chosen
+        key = idtCacheKey(
+            "idt",
+            P.make,
+            P.model,
+            _opts.illumType ? nullptr : M,
+            _opts.highlight,
+            _opts.illumType );
+
+        if ( _idtCache->fetch( key, entry ) )
+        {
+            if ( _opts.verbosity > 1 )
+                printf(
+                    "Reusing the IDT matrix calculated for %s ...\n",
+                    entry.illum.c_str() );
+
+            _idtm = entry.idt;
+            _wbv  = entry.wb;
+
+            return 1;
+        }
+    }
+
+    // other threads wait for the key until this returns or throws
+    IdtCacheMiss miss( _idtCache, key );
+
     // _rawProcessor->imgdata.idata
     int read = fetchCameraSenPath( P );
 
     if ( !read )
     {
-        fprintf(
-            stderr,
-            "\nError: No matching cameras found. "
-            "Please use other options for "
-            "\"--mat-method\" and/or \"--wb-method\".\n" );
-        exit( -1 );
+        throw std::runtime_error(
+            "No matching cameras found. Please use other options for "
+            "\"--mat-method\" and/or \"--wb-method\"." );
     }
 
     vector<string> foundFiles =
@@ -1054,8 +1796,10 @@ int AcesRender::prepareIDT( const libraw_iparams_t &P, float *M )
     }
 
     _idt->setVerbosity( _opts.verbosity );
+    _idt->setCachePath( _opts.idtCachePath );
     if ( _opts.illumType )
-        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
+        _idt->chooseIllum(
+            namedIlluminant( _opts.illumType ), _opts.highlight );
     else
     {
         vector<double> mulV( M, M + 3 );
@@ -1070,8 +1814,16 @@ int AcesRender::prepareIDT( const libraw_iparams_t &P, float *M )
         _idtm = _idt->getIDT();
         _wbv  = _idt->getWB();
 
-        return 1;
-    }
+        if ( _idtCache )
+        {
+            entry.idt   = _idtm;
+            entry.wb    = _wbv;
+            entry.illum = _idt->getBestIllum().getIllumType();
+            miss.store( entry );
+        }
+
+        return 1;
+    }
 
     return 0;
 }
@@ -1092,66 +1844,74 @@ int AcesRender::prepareIDT( const libraw_iparams_t &P, float *M )
 
 int AcesRender::prepareWB( const libraw_iparams_t &P )
 {
+    StageTimer    timer( _stats, stageIdt );
+    string        key;
+    IdtCacheEntry entry;
+
+    if ( _idtCache )
+    {
+        key = idtCacheKey(
+            "wb", P.make, P.model, nullptr, _opts.highlight, _opts.illumType );
+
+        if ( _idtCache->fetch( key, entry ) )
+        {
+            _wbv = entry.wb;
+
+            return 1;
+        }
+    }
+
+    // other threads wait for the key until this returns or throws
+    IdtCacheMiss miss( _idtCache, key );
+
     int read = fetchCameraSenPath( P );
 
     if ( !read )
     {
-        fprintf(
-            stderr,
-            "\nError: No matching cameras found. "
-            "Please use other options for "
-            "\"--wb-method\".\n" );
-        exit( -1 );
+        throw std::runtime_error(
+            "No matching cameras found. Please use other options for "
+            "\"--wb-method\"." );
     }
 
     assert( _opts.illumType );
-    read = fetchIlluminant( _opts.illumType );
+    const Illum &illum = namedIlluminant( _opts.illumType );
 
-    if ( !read )
+    vector<string> foundFiles =
+        findFiles( "training/training_spectral.json", _opts.envPaths );
+    if ( foundFiles.size() )
     {
-        fprintf(
-            stderr,
-            "\nError: No matching light source. "
-            "Please find available options by "
-            "\"rawtoaces --valid-illum\".\n" );
-        exit( -1 );
+        // loading training data (190 patches)
+        _idt->loadTrainingData( foundFiles[0] );
     }
-    else
-    {
-        vector<string> foundFiles =
-            findFiles( "training/training_spectral.json", _opts.envPaths );
-        if ( foundFiles.size() )
-        {
-            // loading training data (190 patches)
-            _idt->loadTrainingData( foundFiles[0] );
-        }
 
-        foundFiles = findFiles( "cmf/cmf_1931.json", _opts.envPaths );
-        if ( foundFiles.size() )
-        {
-            _idt->loadCMF( foundFiles[0] );
-        }
+    foundFiles = findFiles( "cmf/cmf_1931.json", _opts.envPaths );
+    if ( foundFiles.size() )
+    {
+        _idt->loadCMF( foundFiles[0] );
+    }
 
-        // choose the best light source based on
-        // as-shot white balance coefficients
-        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
+    _idt->chooseIllum( illum, _opts.highlight );
 
-        if ( _opts.verbosity > 1 )
-        {
-            printf(
-                "Calculating White Balance Coefficients "
-                "from Spectral Sensitivity ...\n" );
-            printf(
-                "Applying Calculated White Balance "
-                "Coefficients ...\n" );
-        }
+    if ( _opts.verbosity > 1 )
+    {
+        printf(
+            "Calculating White Balance Coefficients "
+            "from Spectral Sensitivity ...\n" );
+        printf(
+            "Applying Calculated White Balance "
+            "Coefficients ...\n" );
+    }
 
-        _wbv = _idt->getWB();
+    _wbv = _idt->getWB();
 
-        return 1;
+    if ( _idtCache )
+    {
+        entry.wb    = _wbv;
+        entry.illum = _opts.illumType;
+        miss.store( entry );
     }
 
-    return 0;
+    return 1;
 }
 
 //  =====================================================================
@@ -1167,22 +1927,487 @@ int AcesRender::prepareWB( const libraw_iparams_t &P )
 int AcesRender::dcraw()
 {
     assert( _opts.ret == LIBRAW_SUCCESS );
+    StageTimer timer( _stats, stageProcess );
 
     if ( LIBRAW_SUCCESS != ( _opts.ret = _rawProcessor->dcraw_process() ) )
     {
-        fprintf(
-            stderr,
-            "Error: Cannot do postpocessing: %s\n\n",
-            libraw_strerror( _opts.ret ) );
+        string error = string( "Cannot do postpocessing: " ) +
+                       libraw_strerror( _opts.ret );
         _opts.ret = errno;
 
         if ( LIBRAW_FATAL_ERROR( _opts.ret ) )
-            exit( 1 );
+            throw std::runtime_error( error );
+        fprintf( stderr, "Error: %s\n\n", error.c_str() );
     }
 
     return _opts.ret;
 }
 
+//  =====================================================================
+//  Bin the raw data into a quarter-size image instead of going through
+//  dcraw_process(): the samples of each CFA quad are black-subtracted,
+//  white balanced the way LibRaw's scale_colors() would do it and
+//  averaged into one pixel, which transformRows() then reads in place of
+//  imgdata.image. Demosaicing and LibRaw's other processing are skipped.
+//
+//  inputs:
+//      N/A
+//
+//  outputs:
+//      int                : LIBRAW_SUCCESS, or the result of dcraw() for
+//                           raw data that cannot be binned this way
+//                           (anything but a 3-color Bayer sensor)
+
+int AcesRender::previewRaw()
+{
+#ifdef OUT
+#    undef OUT
+#endif
+#ifdef P
+#    undef P
+#endif
+#ifdef C
+#    undef C
+#endif
+
+#define OUT _rawProcessor->imgdata.params
+#define P _rawProcessor->imgdata.idata
+#define C _rawProcessor->imgdata.color
+
+    StageTimer                  timer( _stats, stageProcess );
+    const libraw_image_sizes_t &S   = _rawProcessor->imgdata.sizes;
+    const uint16_t             *raw = _rawProcessor->imgdata.rawdata.raw_image;
+
+    if ( !raw || P.filters < 1000 || P.colors != 3 )
+    {
+        if ( _opts.verbosity > 1 )
+            printf( "Cannot bin the raw data, processing it in full ...\n" );
+        return dcraw();
+    }
+
+    int   dark  = OUT.user_black >= 0 ? OUT.user_black : C.black;
+    int   white = OUT.user_sat > 0 ? OUT.user_sat : C.maximum;
+    float black[4];
+    FORI( 4 ) black[i] = static_cast<float>( dark + C.cblack[i] );
+
+    uint8_t cfa[8][2];
+    FORIJ( 8, 2 ) cfa[i][j] = uint8_t( _rawProcessor->COLOR( i, j ) );
+
+    _previewWidth  = S.width / 2;
+    _previewHeight = S.height / 2;
+    _previewFlip   = OUT.user_flip >= 0 ? OUT.user_flip : S.flip;
+
+    size_t total = size_t( _previewWidth ) * _previewHeight;
+    _preview =
+        (uint16_t( * )[4])_bufferPool->acquire( total * sizeof( *_preview ) );
+    if ( !_preview )
+        throw std::bad_alloc();
+
+    if ( _opts.verbosity > 1 )
+        printf(
+            "Binning the raw data into %ix%i pixels ...\n",
+            _previewWidth,
+            _previewHeight );
+
+    size_t          pitch  = S.raw_pitch / sizeof( uint16_t );
+    const uint16_t *origin = raw + S.top_margin * pitch + S.left_margin;
+    auto            bin    = [&]( const float mul[4] ) {
+        forEachTile(
+            _previewHeight,
+            size_t( _previewWidth ) * 4 * sizeof( uint16_t ) * 2,
+            pixelThreads(),
+            [&]( size_t first, size_t last ) {
+                binQuads(
+                    origin,
+                    pitch,
+                    cfa,
+                    black,
+                    mul,
+                    _previewWidth,
+                    first,
+                    last,
+                    _preview + first * _previewWidth );
+            } );
+    };
+
+    // Choose the white balance multipliers in the order of scale_colors()
+    double preMul[4];
+    FORI( 4 ) preMul[i] = C.pre_mul[i];
+    if ( OUT.user_mul[0] )
+        FORI( 4 ) preMul[i] = OUT.user_mul[i];
+
+    float ones[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    if ( OUT.use_auto_wb )
+    {
+        // average the unsaturated pixels of the grey box (the whole image
+        // by default), binned before white balancing
+        bin( ones );
+
+        size_t left   = OUT.greybox[0] / 2;
+        size_t top    = OUT.greybox[1] / 2;
+        size_t right  = std::min(
+            size_t( _previewWidth ), left + OUT.greybox[2] / 2 );
+        size_t bottom = std::min(
+            size_t( _previewHeight ), top + OUT.greybox[3] / 2 );
+
+        double sum[3] = { 0.0, 0.0, 0.0 }, count = 0.0;
+        for ( size_t row = top; row < bottom; row++ )
+            for ( size_t col = left; col < right; col++ )
+            {
+                const uint16_t *pixel = _preview[row * _previewWidth + col];
+                if ( *std::max_element( pixel, pixel + 3 ) > white - dark - 25 )
+                    continue;
+
+                FORI( 3 ) sum[i] += pixel[i];
+                count++;
+            }
+
+        FORI( 3 )
+        if ( sum[i] )
+            preMul[i] = count / sum[i];
+        preMul[3] = 0.0;
+    }
+    else if (
+        OUT.use_camera_wb && C.cam_mul[0] != -1 && C.cam_mul[0] &&
+        C.cam_mul[2] )
+        FORI( 4 ) preMul[i] = C.cam_mul[i];
+
+    if ( !preMul[1] )
+        preMul[1] = 1.0;
+    if ( !preMul[3] )
+        preMul[3] = preMul[1];
+
+    double norm = _opts.highlight
+                      ? *std::max_element( preMul, preMul + 4 )
+                      : *std::min_element( preMul, preMul + 4 );
+
+    float mul[4];
+    FORI( 4 )
+    {
+        C.pre_mul[i] = static_cast<float>( preMul[i] / norm );
+        mul[i] =
+            static_cast<float>( C.pre_mul[i] * 65535.0 / ( white - dark ) );
+    }
+
+    if ( !OUT.use_auto_wb )
+        bin( mul );
+    else
+        forEachTile(
+            total,
+            4 * sizeof( uint16_t ),
+            pixelThreads(),
+            [&]( size_t first, size_t last ) {
+                for ( size_t i = first; i < last; i++ )
+                    for ( int c = 0; c < 3; c++ )
+                    {
+                        float v        = _preview[i][c] * mul[c];
+                        _preview[i][c] = v < 65535.0f ? uint16_t( v ) : 65535;
+                    }
+            } );
+
+    return LIBRAW_SUCCESS;
+}
+
+//  =====================================================================
+//  Clip a rectangle to an image
+//
+//  inputs:
+//      const int[4]       : x, y, width and height of the rectangle
+//      int                : width of the image
+//      int                : height of the image
+//      int[4]             : the clipped rectangle
+//
+//  outputs:
+//      bool               : false if nothing is left of the rectangle
+
+static bool clipRect( const int rect[4], int width, int height, int out[4] )
+{
+    int left   = std::max( rect[0], 0 );
+    int top    = std::max( rect[1], 0 );
+    int right  = std::min( rect[0] + rect[2], width );
+    int bottom = std::min( rect[1] + rect[3], height );
+
+    out[0] = left;
+    out[1] = top;
+    out[2] = right - left;
+    out[3] = bottom - top;
+
+    return out[2] > 0 && out[3] > 0;
+}
+
+//  =====================================================================
+//  Map a rectangle of a flipped image to the same pixels in the image
+//  before the flip, or the other way round. The flip is LibRaw's (and
+//  gatherRows()'s): 4 transposes the image, then 2 mirrors its rows and
+//  1 its columns.
+//
+//  inputs:
+//      const int[4]       : x, y, width and height of the rectangle
+//      int                : width of the image before the flip
+//      int                : height of the image before the flip
+//      int                : the flip
+//      bool               : true to map from the flipped image back to
+//                           the image before the flip
+//      int[4]             : the mapped rectangle
+//
+//  outputs:
+//      N/A                : out holds the mapped rectangle
+
+static void flipRect(
+    const int rect[4],
+    int       width,
+    int       height,
+    int       flip,
+    bool      unflip,
+    int       out[4] )
+{
+    int x[2] = { rect[0], rect[0] + rect[2] - 1 };
+    int y[2] = { rect[1], rect[1] + rect[3] - 1 };
+
+    FORI( 2 )
+    {
+        if ( unflip && ( flip & 4 ) )
+            swap( x[i], y[i] );
+        if ( flip & 2 )
+            y[i] = height - 1 - y[i];
+        if ( flip & 1 )
+            x[i] = width - 1 - x[i];
+        if ( !unflip && ( flip & 4 ) )
+            swap( x[i], y[i] );
+    }
+
+    out[0] = std::min( x[0], x[1] );
+    out[1] = std::min( y[0], y[1] );
+    out[2] = abs( x[1] - x[0] ) + 1;
+    out[3] = abs( y[1] - y[0] ) + 1;
+}
+
+//  =====================================================================
+//  Limit dcraw_process() to the part of the sensor under the region of
+//  interest (--roi) through LibRaw's cropbox, keeping a margin around it
+//  for the demosaic. Anything that looks at the whole frame (automatic
+//  white balance or brightness, dark frames, bad pixels, denoising,
+//  aberration correction, highlight rebuilding, non-square or Fuji
+//  pixels) needs the whole sensor. The white level LibRaw picks from the
+//  brightest sample (adjust_maximum_thr) is found over the whole frame
+//  here and pinned through user_sat, so the region comes out the same as
+//  it would in the full image.
+//
+//  inputs:
+//      int[4]             : the sensor rectangle (x, y, width and height)
+//
+//  outputs:
+//      bool               : true if cropbox, user_sat and
+//                           adjust_maximum_thr were set for the crop (the
+//                           caller restores them after processing)
+
+bool AcesRender::cropRaw( int crop[4] )
+{
+    StageTimer                  timer( _stats, stageProcess );
+    const libraw_image_sizes_t &S   = _rawProcessor->imgdata.sizes;
+    const uint16_t             *raw = _rawProcessor->imgdata.rawdata.raw_image;
+
+    if ( !raw || P.filters < 1000 || OUT.cropbox[2] != UINT_MAX ||
+         OUT.cropbox[3] != UINT_MAX || OUT.use_auto_wb ||
+         !OUT.no_auto_bright || OUT.dark_frame || OUT.bad_pixels ||
+         OUT.threshold || OUT.highlight > 2 || OUT.aber[0] != 1.0 ||
+         OUT.aber[2] != 1.0 || S.pixel_aspect != 1.0 ||
+         _rawProcessor->imgdata.rawdata.ioparams.fuji_width )
+        return false;
+
+    // the whole frame, processed but not flipped yet
+    int shrink = OUT.half_size ? 1 : 0;
+    int width  = ( S.width + shrink ) >> shrink;
+    int height = ( S.height + shrink ) >> shrink;
+    int flip   = OUT.user_flip >= 0 ? OUT.user_flip : S.flip;
+
+    _window[2] = ( flip & 4 ) ? height : width;
+    _window[3] = ( flip & 4 ) ? width : height;
+
+    int roi[4], region[4];
+    if ( !clipRect( _opts.roi, _window[2], _window[3], roi ) )
+        return false;
+    flipRect( roi, width, height, flip, true, region );
+
+    // grow it by the margin and align it to the CFA on the sensor
+    const int margin = 8;
+
+    int left   = ( std::max( region[0] - margin, 0 ) << shrink ) & ~1;
+    int top    = ( std::max( region[1] - margin, 0 ) << shrink ) & ~1;
+    int right  = ( ( region[0] + region[2] + margin ) << shrink ) + 1;
+    int bottom = ( ( region[1] + region[3] + margin ) << shrink ) + 1;
+    right      = std::min( right & ~1, int( S.width ) );
+    bottom     = std::min( bottom & ~1, int( S.height ) );
+
+    if ( left == 0 && top == 0 && right == S.width && bottom == S.height )
+        return false;
+
+    crop[0] = left;
+    crop[1] = top;
+    crop[2] = right - left;
+    crop[3] = bottom - top;
+
+    // the brightest sample above black, the way LibRaw finds it while
+    // copying the raw data of the whole frame
+    int dark  = OUT.user_black >= 0 ? OUT.user_black : C.black;
+    int white = OUT.user_sat > 0 ? OUT.user_sat : C.maximum;
+    int black[4];
+    FORI( 4 ) black[i] = dark + C.cblack[i];
+
+    uint8_t cfa[8][2];
+    FORIJ( 8, 2 ) cfa[i][j] = uint8_t( _rawProcessor->COLOR( i, j ) );
+
+    size_t          pitch  = S.raw_pitch / sizeof( uint16_t );
+    const uint16_t *origin = raw + S.top_margin * pitch + S.left_margin;
+    int             brightest = 0;
+    mutex           lock;
+    forEachTile(
+        S.height,
+        size_t( S.width ) * sizeof( uint16_t ),
+        pixelThreads(),
+        [&]( size_t first, size_t last ) {
+            int tileMax = 0;
+            for ( size_t row = first; row < last; row++ )
+            {
+                const uint16_t *pixel = origin + row * pitch;
+                const uint8_t  *color = cfa[row & 7];
+                for ( size_t col = 0; col < S.width; col++ )
+                    tileMax =
+                        std::max( tileMax, pixel[col] - black[color[col & 1]] );
+            }
+
+            lock_guard<mutex> guard( lock );
+            brightest = std::max( brightest, tileMax );
+        } );
+
+    // what adjust_maximum() would make of it (thresholds of 1 or more
+    // mean LibRaw's default of 0.75)
+    float threshold = OUT.adjust_maximum_thr;
+    if ( threshold > 0.99999f )
+        threshold = 0.75f;
+
+    int maximum = white - dark;
+    if ( OUT.adjust_maximum_thr > 0.00001f && brightest > 0 &&
+         brightest < maximum && brightest > maximum * threshold )
+        maximum = brightest;
+
+    FORI( 4 ) OUT.cropbox[i] = unsigned( crop[i] );
+    OUT.user_sat           = maximum + dark;
+    OUT.adjust_maximum_thr = 0.0f;
+
+    return true;
+}
+
+//  =====================================================================
+//  Find the region of interest (--roi) in the processed image, which is
+//  either the whole frame or the crop made by cropRaw(), and keep where
+//  it sits in the whole frame for the data window of the output
+//
+//  inputs:
+//      const int[4]       : the sensor rectangle from cropRaw() (a width
+//                           of 0 if the whole sensor was processed)
+//
+//  outputs:
+//      int                : LIBRAW_SUCCESS, or LIBRAW_UNSPECIFIED_ERROR
+//                           if the region is not in the image
+
+int AcesRender::locateROI( const int crop[4] )
+{
+    const libraw_image_sizes_t &S = _rawProcessor->imgdata.sizes;
+
+    int frameWidth  = _window[2];
+    int frameHeight = _window[3];
+    FORI( 4 ) _roi[i] = _window[i] = 0;
+
+    if ( !_opts.roi[2] )
+        return LIBRAW_SUCCESS;
+
+    int width, height, colors, bits;
+    imageFormat( width, height, colors, bits );
+    if ( !crop[2] )
+    {
+        frameWidth  = width;
+        frameHeight = height;
+    }
+
+    int roi[4];
+    if ( !clipRect( _opts.roi, frameWidth, frameHeight, roi ) )
+    {
+        fprintf(
+            stderr,
+            "\nError: The region of interest is outside the %ix%i "
+            "image.\n",
+            frameWidth,
+            frameHeight );
+        return LIBRAW_UNSPECIFIED_ERROR;
+    }
+
+    FORI( 4 ) _roi[i] = roi[i];
+    _window[0] = roi[0];
+    _window[1] = roi[1];
+    _window[2] = frameWidth;
+    _window[3] = frameHeight;
+
+    // a crop LibRaw ignored leaves the whole frame
+    if ( !crop[2] || ( width == frameWidth && height == frameHeight ) )
+        return LIBRAW_SUCCESS;
+
+    int  shrink     = OUT.half_size ? 1 : 0;
+    int  flip       = OUT.user_flip >= 0 ? OUT.user_flip : S.flip;
+    bool transposed = flip & 4;
+    int  cropWidth  = ( crop[2] + shrink ) >> shrink;
+    int  cropHeight = ( crop[3] + shrink ) >> shrink;
+
+    if ( ( transposed ? height : width ) != cropWidth ||
+         ( transposed ? width : height ) != cropHeight )
+    {
+        fprintf(
+            stderr,
+            "\nError: The %ix%i image does not match the crop of the "
+            "region of interest.\n",
+            width,
+            height );
+        return LIBRAW_UNSPECIFIED_ERROR;
+    }
+
+    int region[4];
+    flipRect(
+        roi,
+        transposed ? frameHeight : frameWidth,
+        transposed ? frameWidth : frameHeight,
+        flip,
+        true,
+        region );
+    region[0] -= crop[0] >> shrink;
+    region[1] -= crop[1] >> shrink;
+    flipRect( region, cropWidth, cropHeight, flip, false, _roi );
+
+    return LIBRAW_SUCCESS;
+}
+
+//  =====================================================================
+//  Get the part of the processed image that is converted: the region of
+//  interest (--roi) or the whole image
+//
+//  inputs:
+//      int[4]             : x, y, width and height to be filled
+//
+//  outputs:
+//      N/A                : roi holds the rectangle
+
+void AcesRender::regionOfInterest( int roi[4] ) const
+{
+    if ( _roi[2] )
+    {
+        FORI( 4 ) roi[i] = _roi[i];
+        return;
+    }
+
+    int colors, bits;
+    roi[0] = roi[1] = 0;
+    imageFormat( roi[2], roi[3], colors, bits );
+}
+
 //  =====================================================================
 //  Preprocess the RAW file based on the path to the file
 //
@@ -1198,6 +2423,8 @@ int AcesRender::preprocessRaw( const char *path )
     assert( path != nullptr );
 
     size_t len = strlen( path );
+    if ( _pathToRaw )
+        free( _pathToRaw );
     _pathToRaw = (char *)malloc( len + 1 );
     memset( _pathToRaw, 0x0, len );
     memcpy( _pathToRaw, path, len );
@@ -1352,12 +2579,8 @@ int AcesRender::postprocessRaw()
             break;
         }
         default: {
-            fprintf(
-                stderr,
-                "White Balance method is must be 0, 1, 2, 3, "
-                "or 4 \n" );
-            exit( -1 );
-            break;
+            throw std::runtime_error(
+                "White Balance method is must be 0, 1, 2, 3, or 4" );
         }
     }
 
@@ -1419,11 +2642,8 @@ int AcesRender::postprocessRaw()
 
             break;
         default:
-            fprintf(
-                stderr,
-                "IDT matrix calculation method is must be 0, 1, 2, 3\n" );
-            exit( -1 );
-            break;
+            throw std::runtime_error(
+                "IDT matrix calculation method is must be 0, 1, 2, 3" );
     }
 
     // Set four_color_rgb to 0 when half_size is set to 1
@@ -1436,14 +2656,46 @@ int AcesRender::postprocessRaw()
         OUT.use_camera_wb     = 1;
     }
 
-    _opts.ret = dcraw();
-    if ( _opts.mat_method == matMethod0 )
-        if ( !prepareIDT( P, C.pre_mul ) )
-            _opts.ret = errno;
+    // With a region of interest, only the sensor area under it is
+    // processed if nothing else needs the whole frame
+    unsigned cropbox[4];
+    int      userSat   = OUT.user_sat;
+    float    threshold = OUT.adjust_maximum_thr;
+    FORI( 4 ) cropbox[i] = OUT.cropbox[i];
+
+    int crop[4] = { 0, 0, 0, 0 };
+    if ( _opts.roi[2] && !_opts.preview && cropRaw( crop ) &&
+         _opts.verbosity > 1 )
+        printf(
+            "Processing %ix%i pixels of the sensor at %i,%i ...\n",
+            crop[2],
+            crop[3],
+            crop[0],
+            crop[1] );
+
+    int ret = _opts.preview ? previewRaw() : dcraw();
+
+    FORI( 4 ) OUT.cropbox[i] = cropbox[i];
+    OUT.user_sat           = userSat;
+    OUT.adjust_maximum_thr = threshold;
+
+    // without the IDT matrix of this file, the one of the previous file
+    // would be applied, so the file must fail
+    if ( _opts.mat_method == matMethod0 && !prepareIDT( P, C.pre_mul ) )
+    {
+        fprintf( stderr, "\nError: Cannot calculate the IDT matrix\n" );
+        if ( ret == LIBRAW_SUCCESS )
+            ret = LIBRAW_UNSPECIFIED_ERROR;
+    }
 
-    libraw_processed_image_t *image =
-        _rawProcessor->dcraw_make_mem_image( &( _opts.ret ) );
-    setPixels( image );
+    // The processed image is read in place when it is converted (see
+    // transformRows()); like dcraw_make_mem_image() did, report the
+    // processing errors and whether there is an image at all
+    if ( ret == LIBRAW_SUCCESS && !_rawProcessor->imgdata.image && !_preview )
+        ret = LIBRAW_OUT_OF_ORDER_CALL;
+    if ( ret == LIBRAW_SUCCESS )
+        ret = locateROI( crop );
+    _opts.ret = ret;
 
     return _opts.ret;
 }
@@ -1466,105 +2718,383 @@ float *AcesRender::renderACES()
 
 #define P _rawProcessor->imgdata.idata
     if ( !_rawProcessor->imgdata.params.output_color )
-    {
-        cout << "rendering IDT" << endl;
         return renderIDT();
-    }
+    else if ( P.dng_version )
+        return renderDNG();
     else
-    {
-        if ( P.dng_version )
-        {
-            cout << "rendering DNG" << endl;
-            return renderDNG();
-        }
-        else
-        {
-            cout << "rendering NonDNG" << endl;
-            return renderNonDNG();
-        }
-    }
+        return renderNonDNG();
 }
 //	=====================================================================
-//	Write rendered ACES Buffer into an OpenEXR Image File
+//	Write rendered ACES Buffer into an OpenEXR Image File. The pixels are
+//  converted a band of rows at a time right before they are written, so
+//  no full-frame copy of the image is made.
 //
 //	inputs:
-//      N/A
+//      const char * : the name of output file
 //
 //	outputs:
 //      N/A        : An ACES file will be generated
 
 void AcesRender::outputACES( const char *path )
 {
-#ifdef C
-#    undef C
-#endif
-
-#define C _rawProcessor->imgdata.color
-
     assert( _pathToRaw != nullptr );
 
-    float *aces = renderACES();
-    if ( _opts.verbosity > 1 )
-    {
-        if ( _opts.mat_method && !P.dng_version )
-        {
-            vector<vector<double>> camXYZ( 3, vector<double>( 3, 1.0 ) );
-            FORIJ( 3, 3 ) camXYZ[i][j]    = C.cam_xyz[i][j];
-            vector<vector<double>> camcat = mulVector( camXYZ, _catm );
+    float m[4][4];
+    prepareTransform( m );
 
-            printf( "The Approximate IDT matrix is ...\n" );
-            FORI( 3 )
-            printf(
-                "   %f, %f, %f\n", camcat[i][0], camcat[i][1], camcat[i][2] );
-        }
-        // printing white balance coefficients
-        printf( "The final white balance coefficients are ...\n" );
-        printf( "   %f   %f   %f\n", C.pre_mul[0], C.pre_mul[1], C.pre_mul[2] );
-        printf( "Writing ACES file to %s ...\n", path );
-    }
+    int width, height, colors, bits, roi[4];
+    imageFormat( width, height, colors, bits );
+    regionOfInterest( roi );
 
-    if ( _opts.highlight > 0 )
-    {
-        float ratio =
-            ( *( std::max_element( C.pre_mul, C.pre_mul + 3 ) ) /
-              *( std::min_element( C.pre_mul, C.pre_mul + 3 ) ) );
-        acesWrite( path, aces, ratio );
-    }
-    else
-        acesWrite( path, aces );
+    AcesImage image;
+    image.width    = roi[2];
+    image.height   = roi[3];
+    image.channels = colors;
+    fillMetadata( image );
 
-#ifndef WIN32
-    if ( _opts.use_mmap && _opts.iobuffer )
-    {
-        munmap( _opts.iobuffer, size_t( _opts.msize ) );
-        _opts.iobuffer = 0;
-    }
-#endif
+    if ( _opts.verbosity > 1 )
+        printf( "Writing ACES file to %s ...\n", path );
 
-    _rawProcessor->recycle();
+    // rows are converted band by band as the file is written
+    writeACES(
+        path,
+        image,
+        [&]( uint16_t *aces, size_t first, size_t last ) {
+            transformRows( aces, first, last, m );
+        },
+        _bufferPool );
+    recycle();
 
     if ( _opts.verbosity )
         printf( "Finished\n\n" );
 }
 
 //	=====================================================================
-//  Apply white balance values to each pixel
-//  ( We actually do not need it here because white-balancing
-//  happens before demosaicing )
+//	Render the ACES buffer of the current RAW file and convert it into
+//  half floats along with the metadata that goes to the OpenEXR header.
+//  The result does not refer to _rawProcessor, so it can still be written
+//  after the renderer has been recycled for the next file.
 //
 //	inputs:
-//      float *          : pixels (R/G/B)
-//      uint8_t          : number of channels
-//      uint32_t         : the size of pixels
+//      N/A
 //
 //	outputs:
-//		N/A              : pixel values modified by multiplying
-//                         white balance coefficients
+//      AcesImage * : the rendered image (to be deleted by the caller)
 
-void AcesRender::applyWB( float *pixels, int bits, uint32_t total )
+AcesImage *AcesRender::prepareACES()
 {
-    double min_wb = *min_element( _wbv.begin(), _wbv.end() );
-    double target = 1.0;
+    assert( _pathToRaw != nullptr );
+
+    float m[4][4];
+    prepareTransform( m );
+
+    int width, height, colors, bits, roi[4];
+    imageFormat( width, height, colors, bits );
+    regionOfInterest( roi );
+
+    std::unique_ptr<AcesImage> image( new AcesImage() );
+    image->width    = roi[2];
+    image->height   = roi[3];
+    image->channels = colors;
+    image->allocate( _bufferPool );
+
+    transformRows( image->pixels, 0, image->height, m );
+    fillMetadata( *image );
+
+    return image.release();
+}
+
+//	=====================================================================
+//	Downscale a rendered image for a smaller output (--proxy). The linear
+//  ACES values are averaged over the area each new pixel covers; images
+//  are never enlarged.
+//
+//	inputs:
+//      const AcesImage &  : the full size image
+//      const OutputSize & : the size of the new image
+//      int                : the number of threads
+//      BufferPool *       : the pool to take the pixels from (nullptr to
+//                           use the heap)
+//
+//	outputs:
+//      AcesImage * : the new image with the same metadata (to be deleted
+//                    by the caller)
+
+AcesImage *AcesRender::resizeACES(
+    const AcesImage  &image,
+    const OutputSize &size,
+    int               threads,
+    BufferPool       *pool )
+{
+    assert( image.pixels );
+
+    int width  = image.width;
+    int height = image.height;
+    if ( size.divisor > 1 )
+    {
+        width  = std::max( 1, width / size.divisor );
+        height = std::max( 1, height / size.divisor );
+    }
+    else if ( size.width > 0 && size.width < width )
+    {
+        width  = size.width;
+        height = std::max(
+            1, int( double( image.height ) * size.width / image.width + 0.5 ) );
+    }
+
+    std::unique_ptr<AcesImage> resized( new AcesImage() );
+    resized->width    = width;
+    resized->height   = height;
+    resized->channels = image.channels;
+    resized->allocate( pool );
+
+    resampleHalf(
+        image.pixels,
+        image.width,
+        image.height,
+        image.channels,
+        resized->pixels,
+        width,
+        height,
+        threads );
+
+    resized->cameraMake       = image.cameraMake;
+    resized->cameraModel      = image.cameraModel;
+    resized->lensMake         = image.lensMake;
+    resized->lensModel        = image.lensModel;
+    resized->lensSerialNumber = image.lensSerialNumber;
+    resized->comments         = image.comments;
+    resized->artist           = image.artist;
+    resized->isoSpeed         = image.isoSpeed;
+    resized->expTime          = image.expTime;
+    resized->aperture         = image.aperture;
+    resized->focalLength      = image.focalLength;
+    resized->compression      = image.compression;
+    resized->durable          = image.durable;
+    resized->settingsHash     = image.settingsHash;
+
+    // the region of interest keeps its place in the smaller frame
+    if ( image.displayWidth )
+    {
+        double scaleX = double( width ) / image.width;
+        double scaleY = double( height ) / image.height;
+
+        resized->originX      = int( image.originX * scaleX + 0.5 );
+        resized->originY      = int( image.originY * scaleY + 0.5 );
+        resized->displayWidth = uint16_t(
+            std::max( 1, int( image.displayWidth * scaleX + 0.5 ) ) );
+        resized->displayHeight = uint16_t(
+            std::max( 1, int( image.displayHeight * scaleY + 0.5 ) ) );
+    }
+
+    return resized.release();
+}
+
+//	=====================================================================
+//	Prepare the conversion of the current RAW file into ACES: the color
+//  matrices, the normalization to [0, 1], the headroom scale and the
+//  highlight ratio are folded into one matrix
+//
+//	inputs:
+//      float[4][4] : the matrix to be filled
+//
+//	outputs:
+//      N/A         : m holds the matrix for transformRows()
+
+void AcesRender::prepareTransform( float m[4][4] )
+{
+#ifdef C
+#    undef C
+#endif
+
+#define C _rawProcessor->imgdata.color
+
+    StageTimer timer( _stats, stageTransform );
+
+    // the image can only be read in place as long as LibRaw would output
+    // the samples as they are, or scaled by a linear curve
+    if ( !directImage() && !memImage() )
+        throw std::runtime_error( "There is no processed image." );
+
+    int width, height, colors, bits;
+    imageFormat( width, height, colors, bits );
+
+    vector<vector<double>> matrix = renderMatrix();
+
+    // The preview holds camera RGB, which dcraw_process() would have
+    // converted to XYZ (rgb_cam, then sRGB to XYZ) for these methods
+    if ( _preview && OUT.output_color == 5 )
+    {
+        double camXYZ[3][3];
+        FORIJ( 3, 3 )
+        {
+            camXYZ[i][j] = 0.0;
+            for ( int k = 0; k < 3; k++ )
+                camXYZ[i][j] += srgb_XYZ_3[i][k] * C.rgb_cam[k][j];
+        }
+
+        vector<vector<double>> XYZ_aces = matrix;
+        FORIJ( 3, 3 )
+        {
+            matrix[i][j] = 0.0;
+            for ( int k = 0; k < 3; k++ )
+                matrix[i][j] += XYZ_aces[i][k] * camXYZ[k][j];
+        }
+    }
+
+    if ( _opts.verbosity > 1 )
+    {
+        if ( _opts.mat_method && !P.dng_version )
+        {
+            vector<vector<double>> camXYZ( 3, vector<double>( 3, 1.0 ) );
+            FORIJ( 3, 3 ) camXYZ[i][j]    = C.cam_xyz[i][j];
+            vector<vector<double>> camcat = mulVector( camXYZ, _catm );
+
+            printf( "The Approximate IDT matrix is ...\n" );
+            FORI( 3 )
+            printf(
+                "   %f, %f, %f\n", camcat[i][0], camcat[i][1], camcat[i][2] );
+        }
+        // printing white balance coefficients
+        printf( "The final white balance coefficients are ...\n" );
+        printf( "   %f   %f   %f\n", C.pre_mul[0], C.pre_mul[1], C.pre_mul[2] );
+    }
+
+    float ratio = 1.0;
+    if ( _opts.highlight > 0 )
+        ratio =
+            ( *( std::max_element( C.pre_mul, C.pre_mul + 3 ) ) /
+              *( std::min_element( C.pre_mul, C.pre_mul + 3 ) ) );
+
+    double scale = 1.0;
+    if ( bits == 8 )
+        scale = INV_255 * ( _opts.scale ) * ratio;
+    else if ( bits == 16 )
+        scale = INV_65535 * ( _opts.scale ) * ratio;
+
+    FORIJ( colors, colors )
+    m[i][j] = static_cast<float>( matrix[i][j] * scale );
+
+    selectLut( m, bits == 16 ? colors : 0 );
+
+    // dcraw_make_mem_image() maps the samples through a linear curve
+    // that scales them by the brightness (-b) and clips them at 65535
+    _curve.clear();
+    if ( directImage() && OUT.bright != 1.0f )
+    {
+        int white = static_cast<int>( 0x10000 / OUT.bright );
+
+        _curve.resize( 0x10000 );
+        FORI( 0x10000 )
+        _curve[i] = i < white ? static_cast<uint16_t>(
+                                    0x10000 * ( double( i ) / white ) )
+                              : 0xffff;
+    }
+
+    if ( _opts.verbosity > 1 )
+        printf(
+            "Converting pixels to ACES (%s%s) ...\n",
+            getSimdName( getSimdLevel() ),
+            _useLut ? ", lookup tables" : "" );
+}
+
+//	=====================================================================
+//  Decide whether the 16-bit pixels of the current file are converted
+//  with lookup tables (--lut). The tables of the last matrix are kept,
+//  so files sharing a matrix (the same camera, white balance and
+//  settings) only build them once. In automatic mode they are used from
+//  the second file with the same matrix on, if colorLutFaster() finds
+//  them faster than the arithmetic kernel on this machine.
+//
+//	inputs:
+//      const float[4][4] : the matrix from prepareTransform()
+//      int               : channels of the 16-bit input (0 for 8-bit
+//                          input, which is never looked up)
+//
+//	outputs:
+//      N/A               : _useLut is set and _lut is built if needed
+
+void AcesRender::selectLut( const float m[4][4], int channels )
+{
+    _useLut = false;
+    if ( !channels || !_opts.lut )
+        return;
+
+    bool same = channels == _lut.channels;
+    FORIJ( channels, channels )
+    same = same && m[i][j] == _lutMatrix[i][j];
+
+    if ( !same )
+    {
+        FORIJ( channels, channels ) _lutMatrix[i][j] = m[i][j];
+        _lut.channels = channels;
+        _lut.table.clear();
+        _lutUses = 0;
+    }
+    _lutUses++;
+
+    _useLut = _opts.lut == 1 || ( _lutUses > 1 && colorLutFaster() );
+    if ( _useLut && _lut.table.empty() )
+        buildColorLut( m, channels, _lut );
+}
+
+//	=====================================================================
+//	Release the resources held by LibRaw for the current RAW file so that
+//  the renderer can be reused for the next one
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A        : the mmap-ed buffer (if any) is unmapped, the
+//                   processed image is freed and
+//                   _rawProcessor is recycled
+
+void AcesRender::recycle()
+{
+#ifndef WIN32
+    if ( _opts.use_mmap && _opts.iobuffer )
+    {
+        munmap( _opts.iobuffer, size_t( _opts.msize ) );
+        _opts.iobuffer = 0;
+    }
+#endif
+
+    if ( _image )
+    {
+        LibRaw::dcraw_clear_mem( _image );
+        _image = nullptr;
+    }
+
+    if ( _preview )
+    {
+        _bufferPool->release( _preview );
+        _preview = nullptr;
+    }
+
+    FORI( 4 ) _roi[i] = _window[i] = 0;
+
+    _rawProcessor->recycle();
+}
+
+//	=====================================================================
+//  Apply white balance values to each pixel
+//  ( We actually do not need it here because white-balancing
+//  happens before demosaicing )
+//
+//	inputs:
+//      float *          : pixels (R/G/B)
+//      uint8_t          : number of channels
+//      uint32_t         : the size of pixels
+//
+//	outputs:
+//		N/A              : pixel values modified by multiplying
+//                         white balance coefficients
+
+void AcesRender::applyWB( float *pixels, int bits, uint32_t total )
+{
+    double min_wb = *min_element( _wbv.begin(), _wbv.end() );
+    double target = 1.0;
 
     if ( bits == 8 )
         target /= INV_255;
@@ -1572,10 +3102,7 @@ void AcesRender::applyWB( float *pixels, int bits, uint32_t total )
         target /= INV_65535;
 
     if ( !pixels )
-    {
-        fprintf( stderr, "\nThe pixels cannot be found. \n" );
-        exit( 1 );
-    }
+        throw std::runtime_error( "The pixels cannot be found." );
     else
     {
         for ( uint32_t i = 0; i < total; i += 3 )
@@ -1587,6 +3114,43 @@ void AcesRender::applyWB( float *pixels, int bits, uint32_t total )
     }
 }
 
+//	=====================================================================
+//  Multiply float pixels by a color matrix in place (see transformPixels())
+//
+//	inputs:
+//      float *                    : pixels (R/G/B)
+//      uint32_t                   : the size of pixels
+//      int                        : number of channels (3 or 4)
+//      vector < vector <double> > : channels x channels matrix
+//      int                        : number of threads
+//
+//	outputs:
+//		N/A                        : pixel values modified by the matrix
+
+static void mulPixels(
+    float                        *pixels,
+    uint32_t                      total,
+    int                           channel,
+    const vector<vector<double>> &matrix,
+    int                           threads )
+{
+    assert( matrix.size() == channel && isSquare( matrix ) );
+
+    float m[4][4];
+    FORIJ( channel, channel )
+    m[i][j] = static_cast<float>( matrix[i][j] );
+
+    forEachTile(
+        total / channel,
+        channel * 2 * sizeof( float ),
+        threads,
+        [&]( size_t first, size_t last ) {
+            float *tile = pixels + first * channel;
+            transformPixels(
+                tile, tile, ( last - first ) * channel, channel, m );
+        } );
+}
+
 //	=====================================================================
 //  Apply IDT matrix to each pixel
 //
@@ -1602,7 +3166,6 @@ void AcesRender::applyWB( float *pixels, int bits, uint32_t total )
 void AcesRender::applyIDT( float *pixels, int channel, uint32_t total )
 {
     assert( pixels );
-    cout << "applying IDT" << endl;
 
     if ( _opts.mat_method != matMethod3 )
     {
@@ -1623,33 +3186,22 @@ void AcesRender::applyIDT( float *pixels, int channel, uint32_t total )
 
         if ( channel != 3 && channel != 4 )
         {
-            fprintf(
-                stderr,
-                "\nError: Currently support 3 channels "
-                "and 4 channels. \n" );
-            exit( 1 );
+            throw std::runtime_error(
+                "Currently support 3 channels and 4 channels." );
         }
 
-        pixels = mulVectorArray( pixels, total, channel, _idtm );
-
-        FORI( 3 )
-        {
-
-            cout << _idtm[i][0] << " " << _idtm[i][1] << " " << _idtm[i][2]
-                 << endl;
-        }
+        mulPixels( pixels, total, channel, _idtm, pixelThreads() );
     }
     else if ( _opts.mat_method == matMethod3 )
     {
-        cout << "Using custom defined matrix for IDT" << endl;
-        custom_idtm.resize( 3 );
+        vector<vector<double>> custom_idtm( 3 );
 
         FORI( 3 )
         {
             custom_idtm[i].resize( 3 );
 
             FORJ( 3 )
-            custom_idtm[i][j] = static_cast<double>( custom_Matrix[i][j] );
+            custom_idtm[i][j] = static_cast<double>( _customMatrix[i][j] );
         }
 
         if ( channel == 4 )
@@ -1668,21 +3220,11 @@ void AcesRender::applyIDT( float *pixels, int channel, uint32_t total )
 
         if ( channel != 3 && channel != 4 )
         {
-            fprintf(
-                stderr,
-                "\nError: Currently support 3 channels "
-                "and 4 channels. \n" );
-            exit( 1 );
+            throw std::runtime_error(
+                "Currently support 3 channels and 4 channels." );
         }
 
-        pixels = mulVectorArray( pixels, total, channel, custom_idtm );
-
-        FORI( 3 )
-        {
-
-            cout << custom_idtm[i][0] << " " << custom_idtm[i][1] << " "
-                 << custom_idtm[i][2] << endl;
-        }
+        mulPixels( pixels, total, channel, custom_idtm, pixelThreads() );
     }
 }
 
@@ -1704,11 +3246,8 @@ void AcesRender::applyCAT( float *pixels, int channel, uint32_t total )
 
     if ( channel != 3 && channel != 4 )
     {
-        fprintf(
-            stderr,
-            "\nError: Currenly support 3 channels "
-            "and 4 channels. \n" );
-        exit( 1 );
+        throw std::runtime_error(
+            "Currently support 3 channels and 4 channels." );
     }
 
     // will use calCAT() inside rawtoaces
@@ -1716,7 +3255,7 @@ void AcesRender::applyCAT( float *pixels, int channel, uint32_t total )
     vector<double> dOV( d60, d60 + 3 );
     _catm = getCAT( dIV, dOV );
 
-    pixels = mulVectorArray( pixels, total, channel, _catm );
+    mulPixels( pixels, total, channel, _catm, pixelThreads() );
 }
 
 //	=====================================================================
@@ -1736,11 +3275,12 @@ float *AcesRender::renderDNG()
 
 #define P _rawProcessor->imgdata.idata
 
+    memImage();
     assert( _image && P.dng_version );
 
-    DNGIdt *dng = new DNGIdt( _rawProcessor->imgdata.rawdata );
-    _catm       = dng->getDNGCATMatrix();
-    _idtm       = dng->getDNGIDTMatrix();
+    std::unique_ptr<DNGIdt> dng( new DNGIdt( _rawProcessor->imgdata.rawdata ) );
+    _catm = dng->getDNGCATMatrix();
+    _idtm = dng->getDNGIDTMatrix();
 
     if ( _opts.verbosity > 1 )
     {
@@ -1752,6 +3292,9 @@ float *AcesRender::renderDNG()
     ushort  *pixels = (ushort *)_image->data;
     uint32_t total  = _image->width * _image->height * _image->colors;
     float   *aces   = new ( std::nothrow ) float[total];
+    if ( !aces )
+        throw std::bad_alloc();
+
     FORI( total )
     aces[i] = static_cast<float>( pixels[i] );
 
@@ -1759,7 +3302,6 @@ float *AcesRender::renderDNG()
         printf( "Applying IDT Matrix ...\n" );
 
     applyIDT( aces, _image->colors, total );
-    delete dng;
 
     return aces;
 }
@@ -1774,12 +3316,15 @@ float *AcesRender::renderDNG()
 
 float *AcesRender::renderNonDNG()
 {
+    memImage();
     assert( _image );
 
     ushort  *pixels = (ushort *)_image->data; //Getting the image data
     uint32_t total  = _image->width * _image->height *
                      _image->colors; //Total number of data pixels
     float *aces = new ( std::nothrow ) float[total];
+    if ( !aces )
+        throw std::bad_alloc();
 
     FORI( total ) aces[i] = static_cast<float>( pixels[i] );
 
@@ -1798,20 +3343,17 @@ float *AcesRender::renderNonDNG()
         FORIJ( 3, 3 )
         XYZ_acesrgb[i][j] = XYZ_acesrgb_3
             [i][j]; //Populating a new vector with a pre-defined array.
-        aces = mulVectorArray( aces, total, 3, XYZ_acesrgb );
+        mulPixels( aces, total, 3, XYZ_acesrgb, pixelThreads() );
     }
     else if ( _image->colors == 4 )
     {
         FORIJ( 4, 4 ) XYZ_acesrgb[i][j] = XYZ_acesrgb_4[i][j];
-        aces = mulVectorArray( aces, total, 4, XYZ_acesrgb );
+        mulPixels( aces, total, 4, XYZ_acesrgb, pixelThreads() );
     }
     else
     {
-        fprintf(
-            stderr,
-            "\nError: Currenly support 3 channels "
-            "and 4 channels. \n" );
-        exit( 1 );
+        throw std::runtime_error(
+            "Currently support 3 channels and 4 channels." );
     }
 
     return aces;
@@ -1827,10 +3369,13 @@ float *AcesRender::renderNonDNG()
 
 float *AcesRender::renderIDT()
 {
+    memImage();
     assert( _image );
     ushort  *pixels = (ushort *)_image->data;
     uint32_t total  = _image->width * _image->height * _image->colors;
     float   *aces   = new ( std::nothrow ) float[total];
+    if ( !aces )
+        throw std::bad_alloc();
 
     FORI( total )
     {
@@ -1845,12 +3390,379 @@ float *AcesRender::renderIDT()
     return aces;
 };
 
+//	=====================================================================
+//  Compose the matrix that takes the camera values straight to
+//  ACES, i.e. the product of the matrices renderIDT(), renderDNG() or
+//  renderNonDNG() would apply one after another
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		vector < vector <double> > : channels x channels matrix (the 4th
+//                                   channel, if any, is passed through)
+
+vector<vector<double>> AcesRender::renderMatrix()
+{
+#ifdef P
+#    undef P
+#endif
+
+#define P _rawProcessor->imgdata.idata
+
+    int width, height, channels, bits;
+    imageFormat( width, height, channels, bits );
+    if ( channels != 3 && channels != 4 )
+    {
+        throw std::runtime_error(
+            "Currently support 3 channels and 4 channels." );
+    }
+
+    vector<vector<double>> matrix( 3, vector<double>( 3 ) );
+    if ( !_rawProcessor->imgdata.params.output_color )
+    {
+        if ( _opts.verbosity > 1 )
+            printf( "Applying IDT Matrix ...\n" );
+
+        if ( _opts.mat_method == matMethod3 )
+        {
+            FORIJ( 3, 3 )
+            matrix[i][j] = static_cast<double>( _customMatrix[i][j] );
+        }
+        else
+        {
+            FORIJ( 3, 3 ) matrix[i][j] = _idtm[i][j];
+        }
+    }
+    else if ( P.dng_version )
+    {
+        DNGIdt *dng = new DNGIdt( _rawProcessor->imgdata.rawdata );
+        _catm       = dng->getDNGCATMatrix();
+        _idtm       = dng->getDNGIDTMatrix();
+        delete dng;
+
+        if ( _opts.verbosity > 1 )
+        {
+            printf( "The Approximate IDT matrix is ...\n" );
+            FORI( 3 )
+            printf( "   %f, %f, %f\n", _idtm[i][0], _idtm[i][1], _idtm[i][2] );
+            printf( "Applying IDT Matrix ...\n" );
+        }
+
+        FORIJ( 3, 3 ) matrix[i][j] = _idtm[i][j];
+    }
+    else
+    {
+        FORIJ( 3, 3 ) matrix[i][j] = XYZ_acesrgb_3[i][j];
+
+        if ( _opts.mat_method > 0 )
+        {
+            vector<double> dIV( d65, d65 + 3 );
+            vector<double> dOV( d60, d60 + 3 );
+            _catm = getCAT( dIV, dOV );
+
+            vector<vector<double>> XYZ_acesrgb = matrix;
+            FORIJ( 3, 3 )
+            {
+                matrix[i][j] = 0.0;
+                for ( int k = 0; k < 3; k++ )
+                    matrix[i][j] += XYZ_acesrgb[i][k] * _catm[k][j];
+            }
+        }
+    }
+
+    if ( channels == 4 )
+    {
+        FORI( 3 ) matrix[i].push_back( 0.0 );
+        matrix.push_back( vector<double>( 4, 0.0 ) );
+        matrix[3][3] = 1.0;
+    }
+
+    return matrix;
+}
+
+//	=====================================================================
+//  Run the tiles of a step through forEachTile() and add the CPU time
+//  the other threads spent on them to the timer of the step, which only
+//  measures the calling thread
+//
+//	inputs:
+//      StageTimer &               : the timer of the step
+//      size_t                     : the number of items
+//      size_t                     : the bytes of memory touched per item
+//      int                        : the number of threads
+//      function                   : the work on the items [begin, end)
+//
+//	outputs:
+//		N/A                        : work has been done on every item
+
+static void forEachTimedTile(
+    StageTimer                            &timer,
+    size_t                                 count,
+    size_t                                 itemBytes,
+    int                                    threads,
+    const function<void( size_t, size_t )> &work )
+{
+    if ( !timer.active() )
+    {
+        forEachTile( count, itemBytes, threads, work );
+        return;
+    }
+
+    thread::id caller = this_thread::get_id();
+    mutex      cpuMutex;
+    double     cpu = 0.0;
+
+    forEachTile(
+        count, itemBytes, threads, [&]( size_t begin, size_t end ) {
+            double start = threadCpuTime();
+            work( begin, end );
+
+            if ( this_thread::get_id() != caller )
+            {
+                lock_guard<mutex> lock( cpuMutex );
+                cpu += threadCpuTime() - start;
+            }
+        } );
+
+    timer.addCpu( cpu );
+}
+
+//	=====================================================================
+//  Convert rows of the processed image into half float ACES values. The
+//  rows are split into tiles converted in parallel; unless LibRaw's
+//  processed image had to be made (see directImage()), each tile is
+//  gathered from imgdata.image in place, so the samples go from LibRaw's
+//  buffer to the SIMD kernel without a full-frame copy. Only the region
+//  of interest (see regionOfInterest()) is converted.
+//
+//	inputs:
+//      uint16_t *                 : the output (rows [first, last) only)
+//      size_t                     : the first row of the region
+//      size_t                     : the row after the last one
+//      const float[4][4]          : the matrix from prepareTransform()
+//
+//	outputs:
+//		N/A                        : aces holds the half floats
+
+void AcesRender::transformRows(
+    uint16_t *aces, size_t first, size_t last, const float m[4][4] ) const
+{
+    int width, height, channels, bits, roi[4];
+    imageFormat( width, height, channels, bits );
+    regionOfInterest( roi );
+    assert( aces && last <= size_t( roi[3] ) );
+    StageTimer timer( _stats, stageTransform );
+
+    size_t rowSize = size_t( channels ) * roi[2];
+
+    if ( _image )
+    {
+        size_t pitch = size_t( channels ) * width;
+
+        forEachTimedTile(
+            timer,
+            last - first,
+            rowSize * ( bits / 8 + sizeof( halfBytes ) ),
+            pixelThreads(),
+            [&]( size_t begin, size_t end ) {
+                for ( size_t row = begin; row < end; row++ )
+                {
+                    size_t offset = ( roi[1] + first + row ) * pitch +
+                                    size_t( roi[0] ) * channels;
+
+                    if ( bits == 8 )
+                        transformHalf(
+                            (const uint8_t *)_image->data + offset,
+                            aces + row * rowSize,
+                            rowSize,
+                            channels,
+                            m );
+                    else if ( _useLut )
+                        transformHalf(
+                            (const uint16_t *)_image->data + offset,
+                            aces + row * rowSize,
+                            rowSize,
+                            _lut );
+                    else
+                        transformHalf(
+                            (const uint16_t *)_image->data + offset,
+                            aces + row * rowSize,
+                            rowSize,
+                            channels,
+                            m );
+                }
+            } );
+
+        return;
+    }
+
+    const libraw_image_sizes_t &S = _rawProcessor->imgdata.sizes;
+    const uint16_t *curve = _curve.empty() ? nullptr : &_curve[0];
+
+    const uint16_t( *image )[4] = _rawProcessor->imgdata.image;
+    int imageWidth              = S.width;
+    int imageHeight             = S.height;
+    int imageFlip               = S.flip;
+    if ( _preview )
+    {
+        image       = _preview;
+        imageWidth  = _previewWidth;
+        imageHeight = _previewHeight;
+        imageFlip   = _previewFlip;
+    }
+
+    // 4 samples per pixel are read, gathered and converted
+    forEachTimedTile(
+        timer,
+        last - first,
+        rowSize * ( 2 * sizeof( uint16_t ) + sizeof( halfBytes ) ) +
+            size_t( roi[2] ) * 4 * sizeof( uint16_t ),
+        pixelThreads(),
+        [&]( size_t begin, size_t end ) {
+            size_t size = ( end - begin ) * rowSize;
+
+            // the tile fits in the cache, so the gathered samples are
+            // still there when the kernel reads them
+            AcesImage tile;
+            tile.width    = uint16_t( roi[2] );
+            tile.height   = uint16_t( end - begin );
+            tile.channels = uint8_t( channels );
+            tile.allocate( _bufferPool );
+            gatherRows(
+                image,
+                imageWidth,
+                imageHeight,
+                imageFlip,
+                channels,
+                curve,
+                roi[0],
+                roi[0] + roi[2],
+                roi[1] + first + begin,
+                roi[1] + first + end,
+                tile.pixels );
+            if ( _useLut )
+                transformHalf(
+                    tile.pixels, aces + begin * rowSize, size, _lut );
+            else
+                transformHalf(
+                    tile.pixels, aces + begin * rowSize, size, channels, m );
+        } );
+}
+
+//	=====================================================================
+//  Get the size of the processed image: the one made by
+//  dcraw_make_mem_image() if any, the preview or the one
+//  dcraw_make_mem_image() would make
+//
+//	inputs:
+//      int &                      : width
+//      int &                      : height
+//      int &                      : colors (channels)
+//      int &                      : bits per sample
+//
+//	outputs:
+//		N/A                        : the arguments are filled
+
+void AcesRender::imageFormat(
+    int &width, int &height, int &colors, int &bits ) const
+{
+    if ( _image )
+    {
+        width  = _image->width;
+        height = _image->height;
+        colors = _image->colors;
+        bits   = _image->bits;
+    }
+    else if ( _preview )
+    {
+        bool transposed = _previewFlip & 4;
+
+        width  = transposed ? _previewHeight : _previewWidth;
+        height = transposed ? _previewWidth : _previewHeight;
+        colors = 3;
+        bits   = 16;
+    }
+    else
+        _rawProcessor->get_mem_image_format( &width, &height, &colors, &bits );
+}
+
+//	=====================================================================
+//  Check whether the pixels can be read straight from imgdata.image, i.e.
+//  LibRaw has not made its processed image yet and would only copy the
+//  samples (rotated) through a linear curve: 16 bits, gamma 1.0 and no
+//  automatic brightening. The preview is always read in place.
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		bool : true if transformRows() can read imgdata.image in place
+
+bool AcesRender::directImage() const
+{
+    const libraw_output_params_t &params = _rawProcessor->imgdata.params;
+
+    if ( _image )
+        return false;
+
+    return _preview || ( _rawProcessor->imgdata.image &&
+                         params.output_bps == 16 && params.no_auto_bright &&
+                         params.gamm[0] == 1.0 && params.gamm[1] == 1.0 );
+}
+
+//	=====================================================================
+//  Get LibRaw's processed image, calling dcraw_make_mem_image() the first
+//  time it is needed. This copy is only made for the float API
+//  (renderACES() etc.) or when the image cannot be read in place.
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		libraw_processed_image_t * : _image (nullptr if the file has not
+//                                   been processed, or has been recycled)
+
+libraw_processed_image_t *AcesRender::memImage() const
+{
+    if ( !_image && _rawProcessor->imgdata.image )
+    {
+        StageTimer timer( _stats, stageMemImage );
+        int        ret = LIBRAW_SUCCESS;
+        _image         = _rawProcessor->dcraw_make_mem_image( &ret );
+        if ( !_image )
+            fprintf(
+                stderr,
+                "\nError: Cannot make the processed image: %s\n\n",
+                libraw_strerror( ret ) );
+    }
+
+    return _image;
+}
+
+//	=====================================================================
+//  Get the number of threads converting the pixels of a file
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		int : --threads, or by default the available cores shared among
+//            the files processed in parallel
+
+int AcesRender::pixelThreads() const
+{
+    if ( _opts.threads > 0 )
+        return _opts.threads;
+
+    int cores = static_cast<int>( thread::hardware_concurrency() );
+
+    return std::max( 1, cores / std::max( 1, _opts.jobs ) );
+}
+
 //	=====================================================================
 //  Write processed image file to an aces-compliant openexr file
 //
 //	inputs:
 //      const char *               : the name of output file
 //      float *                    : an array of converted aces values
+//      float                      : highlight ratio
 //
 //	outputs:
 //		N/A                        : an aces file should be generated in
@@ -1860,24 +3772,329 @@ void AcesRender::acesWrite( const char *name, float *aces, float ratio ) const
 {
     assert( aces );
 
+    AcesImage image;
+    fillACES( image, aces, ratio );
+    writeACES( name, image );
+}
+
+//	=====================================================================
+//  Scale the converted aces values, convert them into half floats and
+//  gather the metadata of the current RAW file
+//
+//	inputs:
+//      AcesImage &                : the image to be filled
+//      float *                    : an array of converted aces values
+//      float                      : highlight ratio
+//
+//	outputs:
+//		N/A                        : image holds the half pixels and
+//                                   the header information
+
+void AcesRender::fillACES( AcesImage &image, float *aces, float ratio ) const
+{
+    memImage();
+    assert( aces && _image );
+
     uint16_t width    = _image->width;
     uint16_t height   = _image->height;
     uint8_t  channels = _image->colors;
     uint8_t  bits     = _image->bits;
 
-    halfBytes *halfIn = new ( std::nothrow )
-        halfBytes[channels * width * height];
+    image.width    = width;
+    image.height   = height;
+    image.channels = channels;
+    image.allocate( _bufferPool );
 
-    FORI( channels * width * height )
+    halfBytes *halfIn = (halfBytes *)image.pixels;
+
+    size_t rowSize = size_t( channels ) * width;
+    forEachTile(
+        height,
+        rowSize * ( sizeof( float ) + sizeof( halfBytes ) ),
+        pixelThreads(),
+        [&]( size_t first, size_t last ) {
+            for ( size_t i = first * rowSize; i < last * rowSize; i++ )
+            {
+                float aces_i = aces[i];
+                if ( bits == 8 )
+                    aces_i =
+                        (double)aces[i] * INV_255 * ( _opts.scale ) * ratio;
+                else if ( bits == 16 )
+                    aces_i =
+                        (double)aces[i] * INV_65535 * ( _opts.scale ) * ratio;
+
+                Imath::half tmpV( aces_i );
+                halfIn[i] = tmpV.bits();
+            }
+        } );
+
+    fillMetadata( image );
+}
+
+//	=====================================================================
+//  Gather the metadata of the current RAW file that goes to the OpenEXR
+//  header
+//
+//	inputs:
+//      AcesImage &                : the image to be filled
+//
+//	outputs:
+//		N/A                        : image holds the header information
+
+void AcesRender::fillMetadata( AcesImage &image ) const
+{
+    libraw_iparams_t *iparams = &_rawProcessor->imgdata.idata;
+    image.cameraMake          = string( iparams->make );
+    image.cameraModel         = string( iparams->model );
+
+    libraw_lensinfo_t *lens = &_rawProcessor->imgdata.lens;
+    image.lensMake          = string( lens->LensMake );
+    image.lensModel         = string( lens->Lens );
+    image.lensSerialNumber  = string( lens->LensSerial );
+
+    libraw_imgother_t *other = &_rawProcessor->imgdata.other;
+    image.isoSpeed           = other->iso_speed;
+    image.expTime            = other->shutter;
+    image.aperture           = other->aperture;
+    image.focalLength        = other->focal_len;
+    image.comments           = string( other->desc );
+    image.artist             = string( other->artist );
+
+    image.compression = _opts.exrCompression;
+    image.durable     = !_opts.journalPath.empty();
+
+    image.settingsHash = settingsHash();
+
+    if ( _roi[2] )
     {
-        if ( bits == 8 )
-            aces[i] = (double)aces[i] * INV_255 * ( _opts.scale ) * ratio;
-        else if ( bits == 16 )
-            aces[i] = (double)aces[i] * INV_65535 * ( _opts.scale ) * ratio;
+        image.originX       = _window[0];
+        image.originY       = _window[1];
+        image.displayWidth  = uint16_t( _window[2] );
+        image.displayHeight = uint16_t( _window[3] );
+    }
+}
+
+//	=====================================================================
+//  Name the file an output is written to before it is complete: hidden,
+//  in the same directory (so that renaming it is atomic) and unique to
+//  the process and the write, e.g. "dir/.name_aces.4242-7.tmp.exr". Left
+//  over when the process is killed, such files are never taken for
+//  outputs (or for raw files, by --watch).
+//
+//	inputs:
+//      const string & : path to the output
+//
+//	outputs:
+//      string : path to write it to first
+
+string acesTempPath( const string &path )
+{
+    static atomic<unsigned> writes( 0 );
+
+    size_t slash = path.find_last_of( "/\\" );
+    size_t start = slash == string::npos ? 0 : slash + 1;
+    size_t dot   = path.rfind( '.' );
+    if ( dot == string::npos || dot <= start )
+        dot = path.size();
+
+    return path.substr( 0, start ) + "." + path.substr( start, dot - start ) +
+           "." + to_string( getpid() ) + "-" + to_string( writes++ ) + ".tmp" +
+           path.substr( dot );
+}
+
+//	=====================================================================
+//	Record the hash of the settings an output was written with, in
+//  "<output>.params" (see writeACES() and outputsUpToDate())
+//
+//	inputs:
+//      const string & : path to the output
+//      const string & : hash of the settings
+//
+//	outputs:
+//      bool : false if it cannot be written
+
+bool writeSettingsHash( const string &output, const string &hash )
+{
+    FILE *out = fopen( ( output + ".params" ).c_str(), "w" );
+    if ( !out )
+        return false;
 
-        Imath::half tmpV( aces[i] );
-        halfIn[i] = tmpV.bits();
+    bool written = fprintf( out, "%s\n", hash.c_str() ) > 0;
+    return fclose( out ) == 0 && written;
+}
+
+//	=====================================================================
+//  Convert an image band by band into one small buffer and hand each band
+//  to a writer, so that the whole frame is never held as half floats on
+//  this side of the writer (see writeACES())
+//
+//	inputs:
+//      const AcesRowSource & : converts rows [first, last) into the band
+//      int                   : width of the image
+//      int                   : height of the image
+//      int                   : number of channels
+//      size_t                : rows per band (the last one may be shorter)
+//      BufferPool *          : where the band buffer comes from (optional)
+//      const AcesRowSink &   : takes each band once it is converted
+//
+//	outputs:
+//      N/A : the sink has been given every row, in order
+
+void streamBands(
+    const AcesRowSource &source,
+    int                  width,
+    int                  height,
+    int                  channels,
+    size_t               bandRows,
+    BufferPool          *pool,
+    const AcesRowSink   &sink )
+{
+    AcesImage band;
+    band.width    = uint16_t( width );
+    band.height   = uint16_t(
+        min( max( size_t( 1 ), bandRows ), size_t( max( height, 1 ) ) ) );
+    band.channels = uint8_t( channels );
+    band.allocate( pool );
+
+    for ( size_t first = 0; first < size_t( height ); first += band.height )
+    {
+        size_t last = min( first + band.height, size_t( height ) );
+        source( band.pixels, first, last );
+        sink( band.pixels, first, last );
     }
+}
+
+#ifndef WIN32
+//	=====================================================================
+//  Flush a file (or a directory, to keep the names renamed in it) from
+//  the page cache to the disk
+//
+//	inputs:
+//      const string & : path to the file
+//
+//	outputs:
+//      bool : false if it cannot be flushed
+
+static bool syncPath( const string &path )
+{
+    int fd = open( path.c_str(), O_RDONLY );
+    if ( fd < 0 )
+        return false;
+
+    bool synced = fsync( fd ) == 0;
+    close( fd );
+    return synced;
+}
+#endif
+
+//	=====================================================================
+//  Write a rendered image to an aces-compliant openexr file. It does not
+//  touch any renderer state, so it can run on any thread. The file is
+//  written under a temporary name (see acesTempPath()) and renamed once
+//  complete, so a file by the name of the output is always whole, even
+//  if the process dies (--journal relies on that). With "durable", it
+//  is also flushed to the disk before it is renamed, and the rename
+//  after, to survive a crash of the host. The hash of the settings in
+//  "<name>.params" is removed before the rename and written after it,
+//  so that it never stands next to a file written with other settings,
+//  whether or not this run is --incremental.
+//
+//	inputs:
+//      const char *               : the name of output file
+//      const AcesImage &          : the rendered image (or only its size
+//                                   and metadata if a source is given)
+//      const AcesRowSource &      : converts bands of rows on demand into
+//                                   a small buffer (optional)
+//      BufferPool *               : where the band buffer comes from
+//                                   (optional)
+//
+//	outputs:
+//		N/A                        : an aces file should be generated
+
+void AcesRender::writeACES(
+    const char          *name,
+    const AcesImage     &image,
+    const AcesRowSource &source,
+    BufferPool          *pool )
+{
+    string temp = acesTempPath( name );
+    try
+    {
+        writeACESFile( temp.c_str(), image, source, pool );
+
+#ifndef WIN32
+        if ( image.durable && !syncPath( temp ) )
+            throw std::runtime_error(
+                "Cannot flush \"" + temp + "\" - " + strerror( errno ) );
+#else
+        remove( name );
+#endif
+
+        string params = string( name ) + ".params";
+        if ( remove( params.c_str() ) != 0 && errno != ENOENT )
+            throw std::runtime_error(
+                "Cannot remove \"" + params + "\" - " + strerror( errno ) );
+
+        if ( rename( temp.c_str(), name ) != 0 )
+            throw std::runtime_error(
+                "Cannot rename \"" + temp + "\" to \"" + name + "\" - " +
+                strerror( errno ) );
+    }
+    catch ( ... )
+    {
+        remove( temp.c_str() );
+        throw;
+    }
+
+    if ( image.settingsHash.size() &&
+         !writeSettingsHash( name, image.settingsHash ) )
+        fprintf(
+            stderr,
+            "\nWarning: Cannot record the settings of \"%s\"\n",
+            name );
+
+#ifndef WIN32
+    if ( image.durable )
+    {
+        string path( name );
+        size_t slash = path.rfind( '/' );
+        syncPath( slash == string::npos ? "." : path.substr( 0, slash + 1 ) );
+    }
+#endif
+}
+
+//	=====================================================================
+//  Write a rendered image to the given file, as is (see writeACES())
+//
+//	inputs:
+//      const char *               : the name of the file
+//      const AcesImage &          : the rendered image (or only its size
+//                                   and metadata if a source is given)
+//      const AcesRowSource &      : converts bands of rows on demand into
+//                                   a small buffer (optional)
+//      BufferPool *               : where the band buffer comes from
+//                                   (optional)
+//
+//	outputs:
+//		N/A                        : an aces file should be generated
+
+void AcesRender::writeACESFile(
+    const char          *name,
+    const AcesImage     &image,
+    const AcesRowSource &source,
+    BufferPool          *pool )
+{
+    assert( image.pixels || source );
+
+    if ( image.compression != exrContainer )
+    {
+        writeExr( name, image, source, pool );
+        return;
+    }
+
+    uint16_t width    = image.width;
+    uint16_t height   = image.height;
+    uint8_t  channels = image.channels;
 
     vector<std::string> filenames;
     filenames.push_back( name );
@@ -1893,28 +4110,39 @@ void AcesRender::acesWrite( const char *name, float *aces, float ratio ) const
     writeParams.outputCols = width;
 
     writeParams.hi                   = x.getDefaultHeaderInfo();
-    libraw_iparams_t *iparams        = &_rawProcessor->imgdata.idata;
     writeParams.hi.originalImageFlag = 1;
     writeParams.hi.software          = "rawtoaces v0.1";
-    writeParams.hi.cameraMake        = string( iparams->make );
-    writeParams.hi.cameraModel       = string( iparams->model );
+    writeParams.hi.cameraMake        = image.cameraMake;
+    writeParams.hi.cameraModel       = image.cameraModel;
     writeParams.hi.cameraLabel =
         writeParams.hi.cameraMake + " " + writeParams.hi.cameraModel;
 
-    libraw_lensinfo_t *lens         = &_rawProcessor->imgdata.lens;
-    writeParams.hi.lensMake         = string( lens->LensMake );
-    writeParams.hi.lensModel        = string( lens->Lens );
-    writeParams.hi.lensSerialNumber = string( lens->LensSerial );
-
-    libraw_imgother_t *other   = &_rawProcessor->imgdata.other;
-    writeParams.hi.isoSpeed    = other->iso_speed;
-    writeParams.hi.expTime     = other->shutter;
-    writeParams.hi.aperture    = other->aperture;
-    writeParams.hi.focalLength = other->focal_len;
-    writeParams.hi.comments    = string( other->desc );
-    writeParams.hi.artist      = string( other->artist );
+    writeParams.hi.lensMake         = image.lensMake;
+    writeParams.hi.lensModel        = image.lensModel;
+    writeParams.hi.lensSerialNumber = image.lensSerialNumber;
+
+    writeParams.hi.isoSpeed    = image.isoSpeed;
+    writeParams.hi.expTime     = image.expTime;
+    writeParams.hi.aperture    = image.aperture;
+    writeParams.hi.focalLength = image.focalLength;
+    writeParams.hi.comments    = image.comments;
+    writeParams.hi.artist      = image.artist;
     writeParams.hi.channels.clear();
 
+    // a region of interest is written as the data window inside the
+    // display window of the whole frame
+    if ( image.displayWidth && image.displayHeight )
+    {
+        writeParams.hi.displayWindow.xMin = 0;
+        writeParams.hi.displayWindow.yMin = 0;
+        writeParams.hi.displayWindow.xMax = image.displayWidth - 1;
+        writeParams.hi.displayWindow.yMax = image.displayHeight - 1;
+        writeParams.hi.dataWindow.xMin    = image.originX;
+        writeParams.hi.dataWindow.yMin    = image.originY;
+        writeParams.hi.dataWindow.xMax    = image.originX + width - 1;
+        writeParams.hi.dataWindow.yMax    = image.originY + height - 1;
+    }
+
     switch ( channels )
     {
         case 3:
@@ -1950,30 +4178,30 @@ void AcesRender::acesWrite( const char *name, float *aces, float ratio ) const
     x.configure( writeParams );
     x.newImageObject( dynamicMeta );
 
-    FORI( height )
-    {
-        halfBytes *rgbData = halfIn + width * channels * i;
-        x.storeHalfRow( rgbData, i );
-    }
-
-#if 0
-    std::cout << "saving aces file" << std::endl;
-    std::cout << "size " << width << "x" << height << "x"
-              << channels << std::endl;
-    std::cout << "size " << writeParams.outputCols << "x"
-              << writeParams.outputRows << std::endl;
-    std::cout << "duration " << writeParams.duration << std::endl;
-    std::cout << writeParams.hi;
-    std::cout << "\ndynamic meta" << std::endl;
-    std::cout << "imageIndex " << dynamicMeta.imageIndex << std::endl;
-    std::cout << "imageCounter " << dynamicMeta.imageCounter << std::endl;
-    std::cout << "timeCode " << dynamicMeta.timeCode << std::endl;
-    std::cout << "keyCode " << dynamicMeta.keyCode << std::endl;
-    std::cout << "capDate " << dynamicMeta.capDate << std::endl;
-    std::cout << "uuid " << dynamicMeta.uuid << std::endl;
-#endif
-
-    delete[] halfIn;
+    size_t rowSize = size_t( width ) * channels;
+    if ( image.pixels )
+    {
+        FORI( height )
+        {
+            halfBytes *rgbData = (halfBytes *)image.pixels + rowSize * i;
+            x.storeHalfRow( rgbData, i );
+        }
+    }
+    else
+    {
+        streamBands(
+            source,
+            width,
+            height,
+            channels,
+            bandBytes / ( rowSize * 2 ),
+            pool,
+            [&]( const uint16_t *pixels, size_t first, size_t last ) {
+                for ( size_t row = first; row < last; row++ )
+                    x.storeHalfRow(
+                        (halfBytes *)pixels + rowSize * ( row - first ), row );
+            } );
+    }
 
     x.saveImageObject();
 }
@@ -2072,13 +4300,13 @@ const vector<double> AcesRender::getWB() const
 //      N/A
 //
 //	outputs:
-//      libraw_processed_image_t : _image
+//      libraw_processed_image_t : LibRaw's processed image (made on the
+//                                 first call; nullptr once the renderer
+//                                 has been recycled)
 
 const libraw_processed_image_t *AcesRender::getImageBuffer() const
 {
-    assert( _image );
-
-    return _image;
+    return memImage();
 }
 
 //	=====================================================================
@@ -0,0 +1,1272 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/batch.h>
+#include <rawtoaces/trace.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <sys/stat.h>
+
+using namespace std;
+
+//	=====================================================================
+//	Derive the name of the ACES file from the name of the RAW file
+//
+//	inputs:
+//      const string & : path to the raw file
+//      const string & : suffix of a smaller output (e.g., "_half")
+//
+//	outputs:
+//      string : path to the output file (e.g., "A001.CR2" -> "A001_aces.exr"
+//               or "A001_half_aces.exr")
+
+string acesOutputPath( const string &raw, const string &suffix )
+{
+    string output;
+    size_t pos = raw.rfind( '.' );
+    if ( pos != std::string::npos )
+    {
+        output = raw.substr( 0, pos );
+    }
+    output += suffix + "_aces.exr";
+
+    return output;
+}
+
+//	=====================================================================
+//	Check whether the files written for a raw file are up to date
+//  (--incremental): they all exist, none is older than the raw file, and
+//  the hash of the settings each was written with, kept next to it in
+//  "<output>.params" (see AcesRender::writeACES()), is the current one
+//
+//	inputs:
+//      const string &            : path to the raw file
+//      const vector < string > & : the outputs, the main one first
+//      const string &            : hash of the current settings (see
+//                                  AcesRender::settingsHash())
+//
+//	outputs:
+//      bool : true if the file does not need converting again
+
+bool outputsUpToDate(
+    const string &input, const vector<string> &outputs, const string &hash )
+{
+    struct stat raw, st;
+    if ( outputs.empty() || stat( input.c_str(), &raw ) != 0 )
+        return false;
+
+    FORI( outputs.size() )
+    {
+        if ( stat( outputs[i].c_str(), &st ) != 0 ||
+             st.st_mtime < raw.st_mtime )
+            return false;
+
+        char  recorded[64] = "";
+        FILE *in = fopen( ( outputs[i] + ".params" ).c_str(), "r" );
+        if ( !in )
+            return false;
+        bool same = fgets( recorded, sizeof( recorded ), in ) &&
+                    hash + "\n" == recorded;
+        fclose( in );
+
+        if ( !same )
+            return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Select the share of a node (--shard) among the files of a batch. Every
+//  node gets the same list (e.g. of a shared directory) and keeps its
+//  own share of it, so the shares are disjoint and cover every file
+//  without the nodes talking to each other. The list is sorted first, as
+//  directories are not listed in the same order everywhere. Without the
+//  sizes, the files are dealt in turn, so the shares differ by one file
+//  at most; with them, the largest files go first, each to the share
+//  with the fewest bytes so far.
+//
+//	inputs:
+//      const vector < string > &   : the files (duplicates are dropped)
+//      const vector < uint64_t > & : their sizes in bytes, or empty
+//      int                         : the share of this node (0 to count-1)
+//      int                         : the number of nodes
+//
+//	outputs:
+//      vector < string > : the files of this node, sorted by name
+
+vector<string> shardFiles(
+    const vector<string>   &files,
+    const vector<uint64_t> &sizes,
+    int                     index,
+    int                     count )
+{
+    vector<pair<string, uint64_t>> sorted;
+    FORI( files.size() )
+        sorted.push_back(
+            make_pair( files[i], sizes.empty() ? 0 : sizes[i] ) );
+
+    sort( sorted.begin(), sorted.end() );
+    sorted.erase(
+        unique(
+            sorted.begin(),
+            sorted.end(),
+            []( const pair<string, uint64_t> &a,
+                const pair<string, uint64_t> &b ) {
+                return a.first == b.first;
+            } ),
+        sorted.end() );
+
+    vector<string> share;
+    if ( sizes.empty() )
+    {
+        for ( size_t i = index; i < sorted.size(); i += count )
+            share.push_back( sorted[i].first );
+        return share;
+    }
+
+    // stable, so that files of the same size stay in the order of names
+    stable_sort(
+        sorted.begin(),
+        sorted.end(),
+        []( const pair<string, uint64_t> &a, const pair<string, uint64_t> &b ) {
+            return a.second > b.second;
+        } );
+
+    vector<uint64_t> bytes( count, 0 );
+    FORI( sorted.size() )
+    {
+        int smallest = static_cast<int>(
+            min_element( bytes.begin(), bytes.end() ) - bytes.begin() );
+        bytes[smallest] += sorted[i].second;
+
+        if ( smallest == index )
+            share.push_back( sorted[i].first );
+    }
+
+    sort( share.begin(), share.end() );
+    return share;
+}
+
+//	=====================================================================
+//	The memory held by the pixels of a rendered image
+//
+//	inputs:
+//      const AcesImage & : the image
+//
+//	outputs:
+//      size_t : bytes
+
+static size_t imageBytes( const AcesImage &image )
+{
+    return size_t( image.width ) * image.height * image.channels *
+           sizeof( uint16_t );
+}
+
+//	=====================================================================
+//	Take the next item from a queue, as a "wait" event of the --trace
+//  timeline that belongs to no file
+//
+//	inputs:
+//      BoundedQueue < T > & : the queue
+//      T &                  : the item to be filled
+//      const char *         : the name of the event
+//
+//	outputs:
+//      bool : false once the queue is closed and empty
+
+template <typename T>
+static bool tracedPop( BoundedQueue<T> &queue, T &item, const char *name )
+{
+    traceFile( "" );
+    TraceScope scope( name );
+
+    return queue.pop( item );
+}
+
+//	=====================================================================
+//	Put an item into a queue, as a "wait" event of the --trace timeline
+//
+//	inputs:
+//      BoundedQueue < T > & : the queue
+//      const T &            : the item
+//      const char *         : the name of the event
+//
+//	outputs:
+//      bool : false if the queue is closed
+
+template <typename T>
+static bool
+tracedPush( BoundedQueue<T> &queue, const T &item, const char *name )
+{
+    TraceScope scope( name );
+
+    return queue.push( item );
+}
+
+//  =====================================================================
+//	Constructor
+//
+//	inputs:
+//      const AcesRender & : a fully configured renderer whose settings
+//                           will be cloned by every worker
+
+AcesBatch::AcesBatch( const AcesRender &master )
+    : _master( master )
+    , _timing( master.getSettings().use_timing )
+    , _stats( nullptr )
+    , _started( 0.0 )
+    , _next( 0 )
+    , _reported( 0 )
+    , _renders( nullptr )
+    , _decoded( nullptr )
+    , _encoded( nullptr )
+    , _budget( nullptr )
+    , _claims( nullptr )
+    , _journal( nullptr )
+    , _isolated( 0 )
+    , _abandoned( 0 )
+{}
+
+//  =====================================================================
+//	Destructor
+
+AcesBatch::~AcesBatch()
+{
+    vector<BatchJob>().swap( _jobs );
+    vector<BatchResult>().swap( _results );
+}
+
+//	=====================================================================
+//	Queue a RAW file for processing
+//
+//	inputs:
+//      const string & : path to the raw file
+//
+//	outputs:
+//      N/A : _jobs will have one more element
+
+void AcesBatch::addFile( const string &path )
+{
+    BatchJob job;
+    job.input  = path;
+    job.output = acesOutputPath( path );
+
+    const vector<OutputSize> &sizes = _master.getSettings().outputSizes;
+    FORI( sizes.size() )
+    job.proxies.push_back( acesOutputPath( path, sizes[i].suffix ) );
+
+    _jobs.push_back( job );
+}
+
+//	=====================================================================
+//	Process all the queued files. By default every worker takes a file
+//  through all the steps with its own renderer. When "depth" is given,
+//  decoding, transforming and encoding run as separate stages connected
+//  by bounded queues (see pipeline()). Either way, results are reported
+//  in the order the files are processed, which only depends on the
+//  order the files were added (see groupByCamera()). With
+//  --write-behind, the rendered images are written by a thread of their
+//  own while the workers go on with the next files, as long as the
+//  images waiting for it fit in the given memory budget. With --journal,
+//  the start and the end of every file are recorded, and with --resume
+//  the files the journal has converted are left out (see skipJournaled()).
+//
+//	inputs:
+//      int : number of workers (files decoded in parallel)
+//      int : capacity of the queues between the stages
+//            (0 = no pipeline)
+//
+//	outputs:
+//      int : the number of files that could not be converted, or -1 if
+//            the journal, the statistics or the claim directory cannot
+//            be used
+
+int AcesBatch::run( int jobs, int depth )
+{
+    Option opts = _master.getSettings();
+    _isolated   = 0;
+    _abandoned  = 0;
+    if ( !openRun( opts ) )
+        return -1;
+
+    if ( _journal && opts.resume )
+        skipJournaled();
+
+    _settingsHash.clear();
+    if ( opts.incremental )
+    {
+        _settingsHash = _master.settingsHash();
+        skipUpToDate();
+    }
+
+    _results.assign( _jobs.size(), BatchResult() );
+    _done.assign( _jobs.size(), 0 );
+    _next     = 0;
+    _reported = 0;
+    _started  = wallTime();
+
+    size_t workers = static_cast<size_t>( std::max( jobs, 1 ) );
+    workers        = std::min( workers, _jobs.size() );
+
+    // with --claim, the other nodes take most of the files, so reading
+    // the metadata of all of them on every node is not worth it
+    if ( ( opts.mat_method == matMethod0 || opts.wb_method == wbMethod1 ) &&
+         _jobs.size() > 1 && !_claims )
+        groupByCamera( static_cast<int>( workers ) );
+
+    // the files that were being converted when the batch was interrupted
+    // go first, one at a time (see claimFile())
+    if ( _journal )
+    {
+        vector<BatchJob>::iterator others = stable_partition(
+            _jobs.begin(), _jobs.end(), [this]( const BatchJob &job ) {
+                return _journal->interruptions( job.input ) > 0;
+            } );
+        _isolated = others - _jobs.begin();
+    }
+
+    if ( opts.writeBehind > 0 )
+        _budget = new ByteBudget( size_t( opts.writeBehind ) * 1024 * 1024 );
+
+    if ( depth > 0 && _jobs.size() > 0 )
+        pipeline( static_cast<int>( workers ), depth );
+    else
+    {
+        thread writer;
+        if ( _budget )
+        {
+            _encoded = new BoundedQueue<BatchItem>( _jobs.size() );
+            writer   = thread( &AcesBatch::encodeStage, this );
+        }
+
+        if ( workers <= 1 )
+            worker();
+        else
+        {
+            vector<thread> pool;
+            FORI( workers )
+            pool.push_back( thread( &AcesBatch::worker, this ) );
+            FORI( workers ) pool[i].join();
+        }
+
+        if ( _budget )
+        {
+            _encoded->close();
+            writer.join();
+            delete _encoded;
+            _encoded = nullptr;
+        }
+    }
+
+    delete _budget;
+    _budget = nullptr;
+
+    delete _claims;
+    _claims = nullptr;
+
+    delete _journal;
+    _journal = nullptr;
+
+    int failed = _abandoned;
+    FORI( _results.size() )
+    {
+        if ( _results[i].status != LIBRAW_SUCCESS )
+            failed++;
+    }
+
+    if ( _stats )
+    {
+        vector<FileStats> stats;
+        FORI( _results.size() )
+        {
+            if ( !_results[i].skipped )
+                stats.push_back( _results[i].stats );
+        }
+
+        string summary = statsSummary(
+            stats, failed, wallTime() - _started, processCpuTime() );
+        fprintf( _stats, "%s\n", summary.c_str() );
+        if ( _stats != stdout )
+            fclose( _stats );
+        else
+            fflush( _stats );
+        _stats = nullptr;
+    }
+
+    if ( _timing && ( _idtCache.getHits() || _idtCache.getMisses() ) )
+        printf(
+            "Timing: IDT cache: %d hits, %d misses\n",
+            static_cast<int>( _idtCache.getHits() ),
+            static_cast<int>( _idtCache.getMisses() ) );
+
+    if ( _timing )
+    {
+        BufferPoolStats stats = _bufferPool.getStats();
+        printf(
+            "Timing: Buffer pool: %d allocated, %d reused, "
+            "%.1f MB peak, %.1f MB idle\n",
+            static_cast<int>( stats.allocations ),
+            static_cast<int>( stats.reuses ),
+            stats.peakBytes / ( 1024.0 * 1024.0 ),
+            stats.idleBytes / ( 1024.0 * 1024.0 ) );
+    }
+
+    return failed;
+}
+
+//	=====================================================================
+//	Drop the files whose outputs are up to date (--incremental), before
+//  anything else is done with them, so that running a batch again only
+//  costs a look at the files
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : _jobs only keeps the files to convert
+
+void AcesBatch::skipUpToDate()
+{
+    vector<BatchJob> pending;
+    FORI( _jobs.size() )
+    {
+        vector<string> outputs( 1, _jobs[i].output );
+        outputs.insert(
+            outputs.end(), _jobs[i].proxies.begin(), _jobs[i].proxies.end() );
+
+        if ( !outputsUpToDate( _jobs[i].input, outputs, _settingsHash ) )
+            pending.push_back( _jobs[i] );
+    }
+
+    if ( _master.getSettings().verbosity > 0 )
+        printf(
+            "%d of %d files are up to date.\n",
+            static_cast<int>( _jobs.size() - pending.size() ),
+            static_cast<int>( _jobs.size() ) );
+
+    _jobs.swap( pending );
+}
+
+//	=====================================================================
+//	Open the files of a run: the --stats file, the claim directory
+//  (--claim) and the journal (--journal, --resume). The error is
+//  printed, and main() decides what to do about it.
+//
+//	inputs:
+//      const Option & : the settings of the batch
+//
+//	outputs:
+//      bool : false if one of them cannot be used; none is open then
+
+bool AcesBatch::openRun( const Option &opts )
+{
+    bool opened = true;
+
+    if ( !opts.statsPath.empty() )
+    {
+        _stats = opts.statsPath == "-" ? stdout
+                                       : fopen( opts.statsPath.c_str(), "w" );
+        if ( !_stats )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot write the statistics to \"%s\"\n",
+                opts.statsPath.c_str() );
+            return false;
+        }
+    }
+
+    if ( !opts.claimPath.empty() )
+    {
+        try
+        {
+            _claims = new ClaimDir(
+                opts.claimPath, opts.claimTimeout, claimOwner() );
+        }
+        catch ( std::exception const &e )
+        {
+            fprintf( stderr, "\nError: %s\n", e.what() );
+            opened = false;
+        }
+    }
+
+    if ( opened && !opts.journalPath.empty() )
+    {
+        _journal = new Journal();
+        if ( ( opts.resume && !_journal->load( opts.journalPath ) ) ||
+             !_journal->open( opts.journalPath, opts.resume ) )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot use the journal \"%s\"\n",
+                opts.journalPath.c_str() );
+            delete _journal;
+            _journal = nullptr;
+            opened   = false;
+        }
+    }
+
+    if ( opened )
+        return true;
+
+    delete _claims;
+    _claims = nullptr;
+    if ( _stats && _stats != stdout )
+        fclose( _stats );
+    _stats = nullptr;
+
+    return false;
+}
+
+//	=====================================================================
+//	Drop the files the journal of an interrupted run has converted
+//  (--resume); the files that failed are tried again. A file that was
+//  being converted when the batch was interrupted is converted again,
+//  on its own (see claimFile()); one that interrupted it twice, like a
+//  file on which LibRaw calls exit(), is given up so that the batch can
+//  go on. No "done" line is written for it, so that the next run gives
+//  it up too.
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : _jobs only keeps the files to convert; the files given up
+//            are counted in _abandoned
+
+void AcesBatch::skipJournaled()
+{
+    static const int maxInterruptions = 2;
+
+    vector<BatchJob> pending;
+    FORI( _jobs.size() )
+    {
+        const string &input = _jobs[i].input;
+        if ( _journal->isFinished( input ) )
+            continue;
+
+        if ( _journal->interruptions( input ) >= maxInterruptions )
+        {
+            fprintf(
+                stderr,
+                "\nError: Failed to convert \"%s\": the batch was "
+                "interrupted while converting it %d times\n",
+                input.c_str(),
+                _journal->interruptions( input ) );
+            _abandoned++;
+            continue;
+        }
+
+        pending.push_back( _jobs[i] );
+    }
+
+    if ( _master.getSettings().verbosity > 0 )
+        printf(
+            "%d of %d files were converted by the earlier run.\n",
+            static_cast<int>( _jobs.size() - pending.size() - _abandoned ),
+            static_cast<int>( _jobs.size() ) );
+
+    _jobs.swap( pending );
+}
+
+//	=====================================================================
+//	Order the files by camera make and model, so that files sharing an
+//  IDT matrix are processed one after another and the matrix is solved
+//  once while the rest are served from _idtCache. Only the metadata of
+//  each file is read here; the order among files of the same camera is
+//  kept. It is skipped with --claim, where the files are shared with
+//  other nodes.
+//
+//	inputs:
+//      int : number of threads reading the metadata
+//
+//	outputs:
+//      N/A : _jobs will be sorted by BatchJob::camera
+
+void AcesBatch::groupByCamera( int jobs )
+{
+    atomic<size_t> next( 0 );
+
+    auto identify = [this, &next]() {
+        std::unique_ptr<LibRaw> raw( new LibRaw() );
+
+        size_t index;
+        while ( ( index = next++ ) < _jobs.size() )
+        {
+            if ( raw->open_file( _jobs[index].input.c_str() ) ==
+                 LIBRAW_SUCCESS )
+                _jobs[index].camera = string( raw->imgdata.idata.make ) +
+                                      " " + raw->imgdata.idata.model;
+            raw->recycle();
+        }
+    };
+
+    vector<thread> pool;
+    FORI( jobs ) pool.push_back( thread( identify ) );
+    FORI( jobs ) pool[i].join();
+
+    stable_sort(
+        _jobs.begin(),
+        _jobs.end(),
+        []( const BatchJob &a, const BatchJob &b ) {
+            return a.camera < b.camera;
+        } );
+}
+
+//	=====================================================================
+//	Worker loop: keep claiming the next unprocessed file until none is left
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : _results will be filled for every claimed file
+
+void AcesBatch::worker()
+{
+    AcesRender render;
+    render.cloneSettings( _master );
+    render.setIdtCache( &_idtCache );
+    render.setBufferPool( &_bufferPool );
+    traceThreadName( "worker" );
+
+    size_t index;
+    while ( ( index = _next++ ) < _jobs.size() )
+    {
+        if ( !claimFile( index ) || processFile( render, index ) )
+            reportResult( index );
+    }
+}
+
+//	=====================================================================
+//	Run the batch as a three-stage pipeline so that reading file N+1,
+//  transforming file N and writing file N-1 overlap:
+//
+//      decode    (jobs threads) : preprocessRaw() and postprocessRaw()
+//      transform (1 thread)     : prepareACES(), then the renderer is
+//                                 recycled and handed back to decode
+//      encode    (1 thread)     : writeACES()
+//
+//  The renderers circulate through a pool of "jobs + depth + 1" and the
+//  rendered images wait in a queue of "depth", so the number of files in
+//  memory is bounded and a slow stage holds back the ones before it.
+//
+//	inputs:
+//      int : number of decoding threads
+//      int : capacity of the queues between the stages
+//
+//	outputs:
+//      N/A : _results will be filled for every file
+
+void AcesBatch::pipeline( int jobs, int depth )
+{
+    size_t count = jobs + depth + 1;
+
+    vector<AcesRender *> renders;
+    _renders = new BoundedQueue<AcesRender *>( count );
+    _decoded = new BoundedQueue<BatchItem>( depth );
+    _encoded = new BoundedQueue<BatchItem>( depth );
+
+    FORI( count )
+    {
+        AcesRender *render = new AcesRender();
+        render->cloneSettings( _master );
+        render->setIdtCache( &_idtCache );
+        render->setBufferPool( &_bufferPool );
+        renders.push_back( render );
+        _renders->push( render );
+    }
+
+    vector<thread> decoders;
+    FORI( jobs ) decoders.push_back( thread( &AcesBatch::decodeStage, this ) );
+    thread transformer( &AcesBatch::transformStage, this );
+    thread encoder( &AcesBatch::encodeStage, this );
+
+    FORI( jobs ) decoders[i].join();
+    _decoded->close();
+    transformer.join();
+    _encoded->close();
+    encoder.join();
+
+    FORI( count ) delete renders[i];
+
+    delete _renders;
+    delete _decoded;
+    delete _encoded;
+    _renders = nullptr;
+    _decoded = nullptr;
+    _encoded = nullptr;
+}
+
+//	=====================================================================
+//	Decode stage of the pipeline
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : decoded files are pushed to _decoded
+
+void AcesBatch::decodeStage()
+{
+    traceThreadName( "decode" );
+
+    size_t index;
+    while ( ( index = _next++ ) < _jobs.size() )
+    {
+        if ( !claimFile( index ) )
+        {
+            reportResult( index );
+            continue;
+        }
+
+        AcesRender *render;
+        tracedPop( *_renders, render, "wait for renderer" );
+
+        if ( !decodeFile( *render, index ) )
+        {
+            _renders->push( render );
+            reportResult( index );
+            continue;
+        }
+
+        BatchItem item = { index, render, nullptr };
+        tracedPush( *_decoded, item, "wait for transform" );
+    }
+}
+
+//	=====================================================================
+//	Transform stage of the pipeline
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : rendered images are pushed to _encoded
+
+void AcesBatch::transformStage()
+{
+    traceThreadName( "transform" );
+
+    BatchItem item;
+    while ( tracedPop( *_decoded, item, "wait for decode" ) )
+    {
+        timePoint start = chrono::steady_clock::now();
+        traceFile( _jobs[item.index].input );
+
+        try
+        {
+            item.image = item.render->prepareACES();
+            addTiming( item.index, "AcesRender::prepareACES()", start );
+        }
+        catch ( std::exception const &e )
+        {
+            setError( item.index, -1, e.what() );
+        }
+
+        item.render->recycle();
+        _renders->push( item.render );
+        item.render = nullptr;
+
+        if ( !item.image )
+            reportResult( item.index );
+        else if ( _budget )
+            writeBehind( item );
+        else
+            tracedPush( *_encoded, item, "wait for encode" );
+    }
+}
+
+//	=====================================================================
+//	Encode stage of the pipeline, which is also the write-behind thread
+//  of the workers (--write-behind). Write errors are reported per file
+//  like any other.
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : ACES files are written and results are reported
+
+void AcesBatch::encodeStage()
+{
+    traceThreadName( "encode" );
+
+    BatchItem item;
+    while ( tracedPop( *_encoded, item, "wait for image" ) )
+    {
+        size_t bytes = imageBytes( *item.image );
+        traceFile( _jobs[item.index].input );
+
+        try
+        {
+            writeOutputs( item.index, *item.image );
+        }
+        catch ( std::exception const &e )
+        {
+            setError( item.index, -1, e.what() );
+        }
+
+        delete item.image;
+        if ( _budget )
+            _budget->release( bytes );
+
+        reportResult( item.index );
+    }
+}
+
+//	=====================================================================
+//	Hand a rendered image over to the encode stage once it fits in the
+//  memory budget of the images waiting to be written (--write-behind)
+//
+//	inputs:
+//      BatchItem & : the file and its image (owned by the encode stage
+//                    from now on)
+//
+//	outputs:
+//      N/A : the image is queued in _encoded
+
+void AcesBatch::writeBehind( BatchItem &item )
+{
+    {
+        TraceScope scope( "wait for memory" );
+        _budget->acquire( imageBytes( *item.image ) );
+    }
+    tracedPush( *_encoded, item, "wait for encode" );
+}
+
+//	=====================================================================
+//	Open, unpack and process a single RAW file with LibRaw
+//
+//	inputs:
+//      AcesRender & : the renderer owned by the calling worker
+//      size_t       : index of the file in _jobs
+//
+//	outputs:
+//      bool : true if the file is ready for prepareACES() / outputACES();
+//             otherwise _results[index] holds the error and the renderer
+//             has been recycled
+
+bool AcesBatch::decodeFile( AcesRender &render, size_t index )
+{
+    const BatchJob &job   = _jobs[index];
+    timePoint       start = chrono::steady_clock::now();
+
+    _results[index].status = LIBRAW_SUCCESS;
+    render.setStats( fileStats( index ) );
+    traceFile( job.input );
+
+    if ( _stats )
+    {
+        struct stat st;
+        _results[index].stats.started = wallTime() - _started;
+        if ( stat( job.input.c_str(), &st ) == 0 )
+            _results[index].stats.bytesRead = st.st_size;
+    }
+
+    try
+    {
+        int ret;
+        if ( ( ret = render.preprocessRaw( job.input.c_str() ) ) !=
+             LIBRAW_SUCCESS )
+        {
+            setError( index, ret, "Cannot open or unpack the file" );
+            render.recycle();
+            return false;
+        }
+        addTiming( index, "AcesRender::preprocessRaw()", start );
+
+        if ( ( ret = render.postprocessRaw() ) != LIBRAW_SUCCESS )
+        {
+            setError( index, ret, "Cannot process the raw data" );
+            render.recycle();
+            return false;
+        }
+        addTiming( index, "AcesRender::postprocessRaw()", start );
+    }
+    catch ( std::exception const &e )
+    {
+        setError( index, -1, e.what() );
+        render.recycle();
+        return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Claim a file before converting it, when processes share the batch
+//  (--claim), and record that it is started (--journal). The files that
+//  were being converted when the batch was interrupted (the first
+//  _isolated ones) are converted one at a time, before the others, so
+//  that a file interrupting it again is the only one to blame.
+//
+//	inputs:
+//      size_t : index of the file in _jobs
+//
+//	outputs:
+//      bool : false if the file is left to another process;
+//             _results[index] is then marked as skipped
+
+bool AcesBatch::claimFile( size_t index )
+{
+    if ( _isolated )
+    {
+        unique_lock<mutex> lock( _mutex );
+        _isolation.wait( lock, [this, index]() {
+            return _reported >= std::min( index, _isolated );
+        } );
+    }
+
+    if ( _claims && !_claims->claim( _jobs[index].input ) )
+    {
+        _results[index].skipped = true;
+        return false;
+    }
+
+    if ( _journal )
+        _journal->started( _jobs[index].input );
+    return true;
+}
+
+//	=====================================================================
+//	Convert a single RAW file to ACES
+//
+//	inputs:
+//      AcesRender & : the renderer owned by the calling worker
+//      size_t       : index of the file in _jobs
+//
+//	outputs:
+//      bool : false if the image was handed to the write-behind thread,
+//             which reports the result; otherwise _results[index] holds
+//             the status, the timing report and the error message (if
+//             any)
+
+bool AcesBatch::processFile( AcesRender &render, size_t index )
+{
+    if ( !decodeFile( render, index ) )
+        return true;
+
+    timePoint start = chrono::steady_clock::now();
+
+    try
+    {
+        if ( _budget )
+        {
+            // the renderer is free for the next file as soon as the
+            // image is rendered
+            BatchItem item = { index, nullptr, render.prepareACES() };
+            render.recycle();
+            addTiming( index, "AcesRender::prepareACES()", start );
+
+            writeBehind( item );
+            return false;
+        }
+        else if ( _jobs[index].proxies.empty() )
+        {
+            {
+                // the rows are transformed while the file is written
+                StageTimer timer( fileStats( index ), stageWrite );
+                render.outputACES( _jobs[index].output.c_str() );
+            }
+            addTiming( index, "AcesRender::outputACES()", start );
+            addWritten( index, _jobs[index].output );
+        }
+        else
+        {
+            // the full size image is kept to downscale the proxies from
+            std::unique_ptr<AcesImage> image( render.prepareACES() );
+            render.recycle();
+            addTiming( index, "AcesRender::prepareACES()", start );
+
+            writeOutputs( index, *image );
+        }
+    }
+    catch ( std::exception const &e )
+    {
+        setError( index, -1, e.what() );
+        render.recycle();
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Write the ACES file of a rendered image, then downscale it into each
+//  proxy and write those
+//
+//	inputs:
+//      size_t            : index of the file in _jobs
+//      const AcesImage & : the full size image
+//
+//	outputs:
+//      N/A : the files have been written (or an exception is thrown)
+
+void AcesBatch::writeOutputs( size_t index, const AcesImage &image )
+{
+    const BatchJob           &job   = _jobs[index];
+    const vector<OutputSize> &sizes = _master.getSettings().outputSizes;
+    timePoint                 start = chrono::steady_clock::now();
+
+    FileStats                *stats = fileStats( index );
+
+    {
+        StageTimer timer( stats, stageWrite );
+        AcesRender::writeACES( job.output.c_str(), image );
+    }
+    addTiming( index, "AcesRender::writeACES()", start );
+    addWritten( index, job.output );
+
+    FORI( job.proxies.size() )
+    {
+        std::unique_ptr<AcesImage> proxy;
+        {
+            StageTimer timer( stats, stageResize );
+            proxy.reset( AcesRender::resizeACES(
+                image, sizes[i], _master.pixelThreads(), &_bufferPool ) );
+        }
+        addTiming( index, "AcesRender::resizeACES()", start );
+
+        {
+            StageTimer timer( stats, stageWrite );
+            AcesRender::writeACES( job.proxies[i].c_str(), *proxy );
+        }
+        addTiming( index, "AcesRender::writeACES()", start );
+        addWritten( index, job.proxies[i] );
+    }
+}
+
+//	=====================================================================
+//	Append a timing line to the report of a file (with "-d")
+//
+//	inputs:
+//      size_t      : index of the file in _jobs
+//      const char *: name of the step
+//      timePoint & : when the step started; reset to now
+//
+//	outputs:
+//      N/A : _results[index].timing has one more line
+
+void AcesBatch::addTiming( size_t index, const char *msg, timePoint &start )
+{
+    timePoint end = chrono::steady_clock::now();
+
+    if ( _timing )
+    {
+        char  line[1024];
+        float msec = chrono::duration<float, milli>( end - start ).count();
+
+        snprintf(
+            line,
+            sizeof( line ),
+            "Timing: %s/%s: %6.3f msec\n",
+            _jobs[index].input.c_str(),
+            msg,
+            msec );
+        _results[index].timing += line;
+    }
+
+    start = end;
+}
+
+//	=====================================================================
+//	Add the size of a file that has been written to the bytes written
+//  for a file (with --stats)
+//
+//	inputs:
+//      size_t         : index of the file in _jobs
+//      const string & : path to the file written
+//
+//	outputs:
+//      N/A : _results[index].stats.bytesWritten is updated
+
+void AcesBatch::addWritten( size_t index, const string &path )
+{
+    struct stat st;
+    if ( _stats && stat( path.c_str(), &st ) == 0 )
+        _results[index].stats.bytesWritten += st.st_size;
+}
+
+//	=====================================================================
+//	Get where the times of a file go
+//
+//	inputs:
+//      size_t : index of the file in _jobs
+//
+//	outputs:
+//      FileStats * : the stats of the file, or nullptr without --stats
+
+FileStats *AcesBatch::fileStats( size_t index )
+{
+    return _stats ? &_results[index].stats : nullptr;
+}
+
+//	=====================================================================
+//	Record the failure of a file
+//
+//	inputs:
+//      size_t         : index of the file in _jobs
+//      int            : status (anything but LIBRAW_SUCCESS)
+//      const string & : error message
+//
+//	outputs:
+//      N/A : _results[index] holds the status and the message
+
+void AcesBatch::setError( size_t index, int status, const string &error )
+{
+    _results[index].status = status != LIBRAW_SUCCESS ? status : -1;
+    _results[index].error  = error;
+}
+
+//	=====================================================================
+//	Mark a file as done and print the reports of all the files that are
+//  complete and in sequence, so the output does not depend on the
+//  number of workers
+//
+//	inputs:
+//      size_t : index of the file in _jobs
+//
+//	outputs:
+//      N/A : timing reports go to stdout, errors go to stderr and the
+//            --stats records to their file
+
+void AcesBatch::reportResult( size_t index )
+{
+    const BatchJob &job = _jobs[index];
+
+    // the outputs are in place (see AcesRender::writeACES())
+    if ( _journal && !_results[index].skipped )
+        _journal->finished( job.input, _results[index].status );
+
+    // other processes may take the next file, ahead of the report
+    if ( _claims && !_results[index].skipped )
+        _claims->release(
+            _jobs[index].input, _results[index].status == LIBRAW_SUCCESS );
+
+    lock_guard<mutex> lock( _mutex );
+
+    _done[index] = 1;
+    _results[index].stats.finished = wallTime() - _started;
+
+    while ( _reported < _jobs.size() && _done[_reported] )
+    {
+        const BatchResult &result = _results[_reported];
+        if ( result.skipped )
+        {
+            _reported++;
+            continue;
+        }
+
+        if ( !result.timing.empty() )
+        {
+            fputs( result.timing.c_str(), stdout );
+            fflush( stdout );
+        }
+
+        if ( result.status != LIBRAW_SUCCESS )
+            fprintf(
+                stderr,
+                "\nError: Failed to convert \"%s\": %s\n",
+                _jobs[_reported].input.c_str(),
+                result.error.c_str() );
+
+        if ( _stats )
+            fprintf(
+                _stats,
+                "%s\n",
+                statsRecord(
+                    _jobs[_reported].input,
+                    _jobs[_reported].output,
+                    result.status,
+                    result.stats )
+                    .c_str() );
+
+        _reported++;
+    }
+
+    if ( _isolated )
+        _isolation.notify_all();
+}
+
+//	=====================================================================
+//	Get the list of queued files
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      vector < BatchJob > : _jobs
+
+const vector<BatchJob> AcesBatch::getJobs() const
+{
+    return _jobs;
+}
+
+//	=====================================================================
+//	Get the results of the last run
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      vector < BatchResult > : _results
+
+const vector<BatchResult> AcesBatch::getResults() const
+{
+    return _results;
+}
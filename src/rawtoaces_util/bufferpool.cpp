@@ -0,0 +1,313 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/bufferpool.h>
+
+#include <stdlib.h>
+
+using namespace std;
+
+// Buffers are aligned for any SIMD load and never share a cache line
+static const size_t bufferAlignment = 64;
+
+// The smallest size class; tiny buffers are not worth pooling anyway
+static const size_t minClassBytes = 4096;
+
+//	=====================================================================
+//	Allocate / free an aligned buffer from the system
+
+static void *alignedAlloc( size_t bytes )
+{
+#ifdef WIN32
+    return _aligned_malloc( bytes, bufferAlignment );
+#else
+    void *buffer = nullptr;
+    if ( posix_memalign( &buffer, bufferAlignment, bytes ) )
+        return nullptr;
+
+    return buffer;
+#endif
+}
+
+static void alignedFree( void *buffer )
+{
+#ifdef WIN32
+    _aligned_free( buffer );
+#else
+    free( buffer );
+#endif
+}
+
+//  =====================================================================
+//	Constructor
+//
+//	inputs:
+//      size_t : the most bytes kept in idle buffers, or 0 for the most
+//               bytes that were in use at once so far (the working set
+//               of the jobs); the memory held never exceeds what is in
+//               use plus this limit
+
+BufferPool::BufferPool( size_t maxIdleBytes )
+    : _maxIdleBytes( maxIdleBytes ), _peakInUse( 0 ), _uses( 0 )
+{
+    memset( &_stats, 0, sizeof( _stats ) );
+}
+
+//  =====================================================================
+//	Destructor. Buffers still in use are the caller's leak; they are
+//  freed as well so that nothing outlives the pool.
+
+BufferPool::~BufferPool()
+{
+    clear();
+
+    for ( map<void *, size_t>::iterator it = _inUse.begin();
+          it != _inUse.end();
+          ++it )
+        alignedFree( it->first );
+    _inUse.clear();
+}
+
+//	=====================================================================
+//	Round a size up to its size class. There are 8 classes between two
+//  powers of two, so at most 1/8 of a buffer is wasted, while buffers
+//  of slightly different sizes (e.g., images of the same camera with a
+//  different crop) still share a class.
+//
+//	inputs:
+//      size_t : the requested number of bytes
+//
+//	outputs:
+//      size_t : the size of the buffer that is handed out
+
+size_t BufferPool::sizeClass( size_t bytes )
+{
+    if ( bytes <= minClassBytes )
+        return minClassBytes;
+
+    size_t power = minClassBytes;
+    while ( power * 2 <= bytes )
+        power *= 2;
+
+    size_t step = power / 8;
+
+    return ( bytes + step - 1 ) / step * step;
+}
+
+//	=====================================================================
+//	Get a 64-byte aligned buffer of at least the given size, recycling
+//  a released buffer of the same size class if there is one
+//
+//	inputs:
+//      size_t : the number of bytes
+//
+//	outputs:
+//      void * : the buffer (nullptr if it cannot be allocated); to be
+//               given back with release()
+
+void *BufferPool::acquire( size_t bytes )
+{
+    size_t size = sizeClass( bytes );
+
+    {
+        lock_guard<mutex> lock( _mutex );
+
+        _lastUse[size]       = ++_uses;
+        vector<void *> &idle = _idle[size];
+        if ( idle.size() )
+        {
+            void *buffer = idle.back();
+            idle.pop_back();
+
+            _inUse[buffer] = size;
+            _stats.idleBytes -= size;
+            _stats.inUseBytes += size;
+            _stats.reuses++;
+
+            return buffer;
+        }
+    }
+
+    void *buffer = alignedAlloc( size );
+    if ( !buffer )
+        return nullptr;
+
+    lock_guard<mutex> lock( _mutex );
+
+    _inUse[buffer] = size;
+    _stats.inUseBytes += size;
+    _stats.allocations++;
+    _stats.peakBytes =
+        max( _stats.peakBytes, _stats.inUseBytes + _stats.idleBytes );
+    _peakInUse = max( _peakInUse, _stats.inUseBytes );
+
+    return buffer;
+}
+
+//	=====================================================================
+//	Give a buffer back to the pool. It is kept for reuse, after freeing
+//  the idle buffers of the size classes used least recently if the idle
+//  buffers would hold more than the limit (see the constructor), so that
+//  the sizes of earlier files (e.g., of another camera) do not stay.
+//
+//	inputs:
+//      void * : a buffer from acquire() (nullptr is ignored)
+//
+//	outputs:
+//      N/A : the buffer is kept or freed
+
+void BufferPool::release( void *buffer )
+{
+    if ( !buffer )
+        return;
+
+    vector<void *> freed;
+    {
+        lock_guard<mutex> lock( _mutex );
+
+        map<void *, size_t>::iterator it = _inUse.find( buffer );
+        assert( it != _inUse.end() );
+
+        size_t size = it->second;
+        _inUse.erase( it );
+        _stats.inUseBytes -= size;
+        _lastUse[size] = ++_uses;
+
+        size_t limit = idleLimit();
+        if ( size <= limit )
+        {
+            while ( _stats.idleBytes + size > limit )
+            {
+                // the idle buffers of the least recently used class
+                map<size_t, vector<void *>>::iterator oldest = _idle.end();
+                for ( map<size_t, vector<void *>>::iterator idle =
+                          _idle.begin();
+                      idle != _idle.end();
+                      ++idle )
+                {
+                    if ( idle->second.size() &&
+                         ( oldest == _idle.end() ||
+                           _lastUse[idle->first] < _lastUse[oldest->first] ) )
+                        oldest = idle;
+                }
+
+                freed.push_back( oldest->second.back() );
+                oldest->second.pop_back();
+                _stats.idleBytes -= oldest->first;
+            }
+
+            _idle[size].push_back( buffer );
+            _stats.idleBytes += size;
+        }
+        else
+            freed.push_back( buffer );
+    }
+
+    FORI( freed.size() ) alignedFree( freed[i] );
+}
+
+//	=====================================================================
+//	Get the most bytes the idle buffers may hold
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      size_t : the limit given to the constructor, or the most bytes
+//               in use at once so far
+
+size_t BufferPool::idleLimit() const
+{
+    return _maxIdleBytes ? _maxIdleBytes : _peakInUse;
+}
+
+//	=====================================================================
+//	Return all the idle buffers to the system
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A : the pool only holds the buffers in use
+
+void BufferPool::clear()
+{
+    lock_guard<mutex> lock( _mutex );
+
+    for ( map<size_t, vector<void *>>::iterator it = _idle.begin();
+          it != _idle.end();
+          ++it )
+    {
+        FORI( it->second.size() ) alignedFree( it->second[i] );
+    }
+
+    _idle.clear();
+    _stats.idleBytes = 0;
+}
+
+//	=====================================================================
+//	Get the statistics of the pool
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      BufferPoolStats : allocations, reuses and memory held
+
+BufferPoolStats BufferPool::getStats() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _stats;
+}
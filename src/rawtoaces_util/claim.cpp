@@ -0,0 +1,331 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/claim.h>
+
+#include <boost/filesystem.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#    include <unistd.h>
+#    include <utime.h>
+#else
+#    include <io.h>
+#    include <process.h>
+#    include <sys/utime.h>
+#endif
+
+using namespace std;
+
+//	=====================================================================
+//	Name the calling process among all those sharing the claims
+//
+//	inputs:  N/A
+//
+//	outputs:
+//      string : host name and process id (e.g., "node07-4242")
+
+string claimOwner()
+{
+    char host[256] = "localhost";
+#ifndef WIN32
+    gethostname( host, sizeof( host ) - 1 );
+    host[sizeof( host ) - 1] = '\0';
+#endif
+
+    return string( host ) + "-" + to_string( getpid() );
+}
+
+//  =====================================================================
+//	Constructor
+//
+//	inputs:
+//      const string & : the shared directory of the claims (created if
+//                       needed)
+//      int            : seconds after which a claim that has not been
+//                       touched is taken over
+//      const string & : name of this process (see claimOwner())
+
+ClaimDir::ClaimDir( const string &dir, int timeout, const string &owner )
+    : _dir( dir )
+    , _timeout( std::max( timeout, 1 ) )
+    , _owner( owner )
+    , _stopping( false )
+{
+    boost::system::error_code ec;
+    boost::filesystem::create_directories( _dir, ec );
+    if ( ec )
+        throw std::runtime_error(
+            "Cannot create the claim directory \"" + _dir +
+            "\" - " + ec.message() );
+
+    _thread = thread( &ClaimDir::heartbeat, this );
+}
+
+//  =====================================================================
+//	Destructor: the claims still held (e.g. when interrupted) are given
+//  up, so that other processes do not have to wait for them to time out
+
+ClaimDir::~ClaimDir()
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+        _stopping = true;
+    }
+    _wake.notify_all();
+    _thread.join();
+
+    for ( auto &claim: _held )
+        remove( claim.c_str() );
+}
+
+//	=====================================================================
+//	Get the path of the claim of a file in a given state. The name keeps
+//  the name of the file, for people looking at the directory, followed by
+//  a 64-bit FNV-1a hash of its path, as files with the same name may come
+//  from different directories.
+//
+//	inputs:
+//      const string & : path to the file, the same in every process
+//      const char *   : "claim", "done" or "failed"
+//
+//	outputs:
+//      string : e.g. "<dir>/A001.CR2.1f0c66a2b4d3e987.claim"
+
+string ClaimDir::path( const string &file, const char *state ) const
+{
+    uint64_t hash = 14695981039346656037ULL;
+    FORI( file.size() )
+    {
+        hash ^= static_cast<unsigned char>( file[i] );
+        hash *= 1099511628211ULL;
+    }
+
+    char hex[17];
+    snprintf( hex, sizeof( hex ), "%016llx", (unsigned long long)hash );
+
+    string name = boost::filesystem::path( file ).filename().string();
+    return _dir + "/" + name + "." + hex + "." + state;
+}
+
+//	=====================================================================
+//	Claim a file to convert it. Creating the claim file exclusively is
+//  atomic, on NFS too (v3 and later), so only one process succeeds.
+//  A stale claim is first moved out of the way under a name of this
+//  process: again, only one process succeeds, and it checks that what
+//  it moved is the claim it found stale rather than one just made.
+//
+//	inputs:
+//      const string & : path to the file
+//
+//	outputs:
+//      bool : true if this process is to convert the file; false if it
+//             is done, failed or being converted elsewhere
+
+bool ClaimDir::claim( const string &file )
+{
+    string claim = path( file, "claim" );
+
+    auto over = [&]() {
+        struct stat st;
+        return stat( path( file, "done" ).c_str(), &st ) == 0 ||
+               stat( path( file, "failed" ).c_str(), &st ) == 0;
+    };
+
+    FORI( 3 )
+    {
+        if ( over() )
+            return false;
+
+        int fd = open( claim.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644 );
+        if ( fd >= 0 )
+        {
+            // the claim may have become the .done file since the check
+            if ( over() )
+            {
+                close( fd );
+                remove( claim.c_str() );
+                return false;
+            }
+
+            string text = _owner + "\n";
+            if ( write( fd, text.c_str(), text.size() ) < 0 )
+                fprintf(
+                    stderr,
+                    "\nWarning: Cannot write the claim \"%s\"\n",
+                    claim.c_str() );
+            close( fd );
+
+            lock_guard<mutex> lock( _mutex );
+            _held.insert( claim );
+            return true;
+        }
+
+        if ( errno != EEXIST )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot claim \"%s\" - %s\n",
+                file.c_str(),
+                strerror( errno ) );
+            return false;
+        }
+
+        // released in the meantime: look again
+        struct stat st;
+        if ( stat( claim.c_str(), &st ) != 0 )
+            continue;
+
+        // held by a live process
+        if ( difftime( time( nullptr ), st.st_mtime ) < _timeout )
+            return false;
+
+        string stale = claim + "." + _owner;
+        if ( rename( claim.c_str(), stale.c_str() ) != 0 )
+            continue;
+
+        struct stat moved;
+        if ( stat( stale.c_str(), &moved ) == 0 && moved.st_ino != st.st_ino )
+        {
+            // another process took it over first: put its claim back,
+            // unless yet another one made a claim since
+#ifndef WIN32
+            if ( link( stale.c_str(), claim.c_str() ) != 0 )
+#else
+            if ( rename( stale.c_str(), claim.c_str() ) != 0 )
+#endif
+                fprintf(
+                    stderr,
+                    "\nWarning: Cannot restore the claim \"%s\"\n",
+                    claim.c_str() );
+            remove( stale.c_str() );
+            return false;
+        }
+
+        fprintf(
+            stderr,
+            "\nWarning: Taking over the stale claim on \"%s\"\n",
+            file.c_str() );
+        remove( stale.c_str() );
+    }
+
+    return false;
+}
+
+//	=====================================================================
+//	Give up the claim on a file once its conversion is over
+//
+//	inputs:
+//      const string & : path to the file
+//      bool           : true if it was converted, false if it failed
+//                       (it is not tried again until the .failed file is
+//                       removed)
+//
+//	outputs:
+//      N/A : the claim becomes the .done or .failed file
+
+void ClaimDir::release( const string &file, bool converted )
+{
+    string claim = path( file, "claim" );
+
+    {
+        lock_guard<mutex> lock( _mutex );
+        if ( !_held.erase( claim ) )
+            return;
+    }
+
+    // if this process was thought dead and the claim taken over, the
+    // new owner reports the file instead
+    char  owner[512] = "";
+    FILE *in         = fopen( claim.c_str(), "r" );
+    if ( !in )
+        return;
+    bool mine = fgets( owner, sizeof( owner ), in ) && _owner + "\n" == owner;
+    fclose( in );
+
+    if ( mine )
+    {
+        string state = path( file, converted ? "done" : "failed" );
+        rename( claim.c_str(), state.c_str() );
+    }
+}
+
+//	=====================================================================
+//	Touch the claims held, four times per timeout, so that they are not
+//  taken for stale ones
+//
+//	inputs:  N/A
+//
+//	outputs:
+//      N/A : the modification times of the claim files are updated
+
+void ClaimDir::heartbeat()
+{
+    unique_lock<mutex> lock( _mutex );
+    int period = std::max( _timeout * 1000 / 4, 100 );
+
+    while ( !_stopping )
+    {
+        _wake.wait_for( lock, chrono::milliseconds( period ) );
+
+        for ( auto &claim: _held )
+            utime( claim.c_str(), nullptr );
+    }
+}
@@ -0,0 +1,300 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/exrwriter.h>
+
+#ifdef RTA_OPENEXR
+#    include <OpenEXR/ImfChannelList.h>
+#    include <OpenEXR/ImfFloatAttribute.h>
+#    include <OpenEXR/ImfFrameBuffer.h>
+#    include <OpenEXR/ImfHeader.h>
+#    include <OpenEXR/ImfIntAttribute.h>
+#    include <OpenEXR/ImfOutputFile.h>
+#    include <OpenEXR/ImfStandardAttributes.h>
+#    include <OpenEXR/ImfStringAttribute.h>
+#    include <OpenEXR/ImfThreading.h>
+#    include <Imath/ImathBox.h>
+#endif
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+// Bands of rows converted for the file are about this size
+static const size_t exrBandBytes = 4 * 1024 * 1024;
+
+// The names (on the command line) and the scanlines per block of the
+// compressions, in the order of exrCompression_t
+static const char *compressionNames[] = { "none", "zip", "piz", "dwaa",
+                                          "dwab" };
+static const int   compressionLines[] = { 1, 16, 32, 32, 256 };
+
+//	=====================================================================
+//	Check whether rawtoaces was built with OpenEXR, i.e. whether files can
+//  be written without aces_container (--exr-compression, --exr-threads)
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		bool : true if writeExr() is available
+
+bool exrWriterAvailable()
+{
+#ifdef RTA_OPENEXR
+    return true;
+#else
+    return false;
+#endif
+}
+
+//	=====================================================================
+//	Set the number of threads OpenEXR compresses the blocks of scanlines
+//  of a file on (the global thread pool, shared by all files written at
+//  the same time)
+//
+//	inputs:
+//      int : the number of threads (0 to compress on the writing thread)
+//
+//	outputs:
+//		N/A : OpenEXR's global thread count is set
+
+void setExrThreads( int threads )
+{
+#ifdef RTA_OPENEXR
+    Imf::setGlobalThreadCount( threads );
+#else
+    (void)threads;
+#endif
+}
+
+//	=====================================================================
+//	Look a compression up by its name on the command line
+//
+//	inputs:
+//      const char * : none, zip, piz, dwaa or dwab
+//
+//	outputs:
+//		int          : the exrCompression_t, or -1 for an unknown name
+
+int exrCompression( const char *name )
+{
+    FORI( countSize( compressionNames ) )
+    if ( strcmp( name, compressionNames[i] ) == 0 )
+        return i;
+
+    return -1;
+}
+
+//	=====================================================================
+//	Write a rendered image to an OpenEXR file with OpenEXR itself rather
+//  than aces_container, with the same ACES header attributes. The
+//  framebuffer slices point straight at the half floats (or at a band
+//  of rows converted on demand), and OpenEXR compresses the blocks of
+//  scanlines of each writePixels() call on its thread pool.
+//
+//	inputs:
+//      const char *               : the name of output file
+//      const AcesImage &          : the rendered image (or only its size
+//                                   and metadata if a source is given)
+//      const AcesRowSource &      : converts bands of rows on demand into
+//                                   a small buffer (optional)
+//      BufferPool *               : where the band buffer comes from
+//                                   (optional)
+//
+//	outputs:
+//		N/A                        : an OpenEXR file should be generated
+
+void writeExr(
+    const char          *name,
+    const AcesImage     &image,
+    const AcesRowSource &source,
+    BufferPool          *pool )
+{
+#ifdef RTA_OPENEXR
+    assert( image.pixels || source );
+
+    int    width    = image.width;
+    int    height   = image.height;
+    int    channels = image.channels;
+    size_t rowSize  = size_t( width ) * channels;
+
+    if ( channels != 3 && channels != 4 )
+        throw std::invalid_argument( "Only RGB or RGBA files supported" );
+
+    Imath::Box2i dataWindow(
+        Imath::V2i( image.originX, image.originY ),
+        Imath::V2i(
+            image.originX + width - 1, image.originY + height - 1 ) );
+    Imath::Box2i displayWindow = dataWindow;
+    if ( image.displayWidth && image.displayHeight )
+        displayWindow = Imath::Box2i(
+            Imath::V2i( 0, 0 ),
+            Imath::V2i( image.displayWidth - 1, image.displayHeight - 1 ) );
+
+    static const Imf::Compression compressions[] = {
+        Imf::NO_COMPRESSION,
+        Imf::ZIP_COMPRESSION,
+        Imf::PIZ_COMPRESSION,
+        Imf::DWAA_COMPRESSION,
+        Imf::DWAB_COMPRESSION
+    };
+    int compression = image.compression >= 0 ? image.compression : exrNone;
+
+    Imf::Header header(
+        displayWindow,
+        dataWindow,
+        1.0f,
+        Imath::V2f( 0.0f, 0.0f ),
+        1.0f,
+        Imf::INCREASING_Y,
+        compressions[compression] );
+
+    // the attributes aces_container writes (SMPTE ST 2065-4); only
+    // uncompressed files comply with the ACES container
+    if ( compression == exrNone )
+        header.insert( "acesImageContainerFlag", Imf::IntAttribute( 1 ) );
+
+    Imf::Chromaticities aces(
+        Imath::V2f( 0.73470f, 0.26530f ),
+        Imath::V2f( 0.00000f, 1.00000f ),
+        Imath::V2f( 0.00010f, -0.07700f ),
+        Imath::V2f( 0.32168f, 0.33767f ) );
+    Imf::addChromaticities( header, aces );
+    Imf::addAdoptedNeutral( header, aces.white );
+
+    header.insert( "originalImageFlag", Imf::IntAttribute( 1 ) );
+    header.insert( "software", Imf::StringAttribute( "rawtoaces v0.1" ) );
+
+    auto addString = [&]( const char *attribute, const string &value ) {
+        if ( !value.empty() )
+            header.insert( attribute, Imf::StringAttribute( value ) );
+    };
+    addString( "cameraMake", image.cameraMake );
+    addString( "cameraModel", image.cameraModel );
+    addString( "cameraLabel", image.cameraMake + " " + image.cameraModel );
+    addString( "lensMake", image.lensMake );
+    addString( "lensModel", image.lensModel );
+    addString( "lensSerialNumber", image.lensSerialNumber );
+    addString( "comments", image.comments );
+    addString( "owner", image.artist );
+
+    auto addFloat = [&]( const char *attribute, float value ) {
+        if ( value > 0.0f )
+            header.insert( attribute, Imf::FloatAttribute( value ) );
+    };
+    addFloat( "isoSpeed", image.isoSpeed );
+    addFloat( "expTime", image.expTime );
+    addFloat( "aperture", image.aperture );
+    addFloat( "focalLength", image.focalLength );
+
+    // the half floats are interleaved R, G, B (and A)
+    static const char *names[] = { "R", "G", "B", "A" };
+    FORI( channels )
+    header.channels().insert( names[i], Imf::Channel( Imf::HALF ) );
+
+    Imf::OutputFile file( name, header, Imf::globalThreadCount() );
+
+    // slices of the rows [first, first + rows) held by pixels
+    auto frameBuffer = [&]( const uint16_t *pixels, size_t first ) {
+        size_t xStride = channels * sizeof( uint16_t );
+        size_t yStride = rowSize * sizeof( uint16_t );
+        char  *base    = (char *)pixels -
+                     ptrdiff_t( image.originY + first ) * yStride -
+                     ptrdiff_t( image.originX ) * xStride;
+
+        Imf::FrameBuffer buffer;
+        FORI( channels )
+        buffer.insert(
+            names[i],
+            Imf::Slice(
+                Imf::HALF,
+                base + i * sizeof( uint16_t ),
+                xStride,
+                yStride ) );
+        return buffer;
+    };
+
+    if ( image.pixels )
+    {
+        file.setFrameBuffer( frameBuffer( image.pixels, 0 ) );
+        file.writePixels( height );
+        return;
+    }
+
+    // whole blocks of scanlines for every compression thread
+    int blockRows =
+        compressionLines[compression] * max( 1, Imf::globalThreadCount() );
+    size_t bandRows  = max( size_t( 1 ), exrBandBytes / ( rowSize * 2 ) );
+    bandRows = ( bandRows + blockRows - 1 ) / blockRows * blockRows;
+
+    streamBands(
+        source,
+        width,
+        height,
+        channels,
+        bandRows,
+        pool,
+        [&]( const uint16_t *pixels, size_t first, size_t last ) {
+            file.setFrameBuffer( frameBuffer( pixels, first ) );
+            file.writePixels( int( last - first ) );
+        } );
+#else
+    (void)name;
+    (void)image;
+    (void)source;
+    (void)pool;
+    throw std::runtime_error( "rawtoaces was built without OpenEXR" );
+#endif
+}
@@ -0,0 +1,275 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/idtcache.h>
+#include <rawtoaces/trace.h>
+
+using namespace std;
+
+//	=====================================================================
+//	Build the key under which an IDT matrix / white balance result is
+//  cached. Everything that changes the outcome of prepareIDT() or
+//  prepareWB() within a batch is part of the key.
+//
+//	inputs:
+//      const char *  : what is cached ("idt" or "wb")
+//      const char *  : camera make (from libraw)
+//      const char *  : camera model (from libraw)
+//      const float * : as-shot multipliers (R, G, B) or nullptr
+//      int           : highlight mode
+//      const char *  : user specified illuminant or nullptr
+//
+//	outputs:
+//      string : the key
+
+string idtCacheKey(
+    const char  *tag,
+    const char  *make,
+    const char  *model,
+    const float *mul,
+    int          highlight,
+    const char  *illumType )
+{
+    char buffer[128];
+
+    string key = string( tag ) + "|" + make + "|" + model;
+
+    if ( mul )
+    {
+        // 9 significant digits are enough to tell any two floats apart
+        snprintf(
+            buffer,
+            sizeof( buffer ),
+            "|%.9g,%.9g,%.9g",
+            mul[0],
+            mul[1],
+            mul[2] );
+        key += buffer;
+    }
+
+    snprintf( buffer, sizeof( buffer ), "|h%d|", highlight );
+    key += buffer;
+    key += illumType ? illumType : "auto";
+
+    return key;
+}
+
+//  =====================================================================
+//	Constructor / Destructor
+
+IdtCache::IdtCache() : _hits( 0 ), _misses( 0 ) {}
+
+IdtCache::~IdtCache()
+{
+    _entries.clear();
+    _pending.clear();
+}
+
+//	=====================================================================
+//	Look up a cached result. On a miss the caller becomes responsible for
+//  calculating it and must call either store() or abandon(), best
+//  through an IdtCacheMiss, which abandons the key if it throws; other
+//  threads asking for the same key wait for that instead of repeating
+//  the calculation.
+//
+//	inputs:
+//      const string &  : key (see idtCacheKey())
+//      IdtCacheEntry & : the entry to be filled
+//
+//	outputs:
+//      bool : true if entry has been filled from the cache
+
+bool IdtCache::fetch( const string &key, IdtCacheEntry &entry )
+{
+    unique_lock<mutex> lock( _mutex );
+
+    if ( _pending.count( key ) )
+    {
+        TraceScope scope( "wait for IDT cache" );
+        while ( _pending.count( key ) )
+            _ready.wait( lock );
+    }
+
+    map<string, IdtCacheEntry>::const_iterator it = _entries.find( key );
+    if ( it != _entries.end() )
+    {
+        entry = it->second;
+        _hits++;
+
+        return true;
+    }
+
+    _pending.insert( key );
+    _misses++;
+
+    return false;
+}
+
+//	=====================================================================
+//	Store a result calculated after a miss in fetch()
+//
+//	inputs:
+//      const string &        : key
+//      const IdtCacheEntry & : the calculated result
+//
+//	outputs:
+//      N/A : threads waiting for the key are woken up
+
+void IdtCache::store( const string &key, const IdtCacheEntry &entry )
+{
+    lock_guard<mutex> lock( _mutex );
+
+    _entries[key] = entry;
+    _pending.erase( key );
+    _ready.notify_all();
+}
+
+//	=====================================================================
+//	Give up on a key after a miss in fetch() (e.g., the calculation
+//  failed), so that the next thread can try again
+//
+//	inputs:
+//      const string & : key
+//
+//	outputs:
+//      N/A : threads waiting for the key are woken up
+
+void IdtCache::abandon( const string &key )
+{
+    lock_guard<mutex> lock( _mutex );
+
+    _pending.erase( key );
+    _ready.notify_all();
+}
+
+//	=====================================================================
+//	Get the number of lookups served from the cache
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      size_t : _hits
+
+size_t IdtCache::getHits() const
+{
+    lock_guard<mutex> lock( _mutex );
+    return _hits;
+}
+
+//	=====================================================================
+//	Get the number of lookups that had to be calculated
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      size_t : _misses
+
+size_t IdtCache::getMisses() const
+{
+    lock_guard<mutex> lock( _mutex );
+    return _misses;
+}
+
+//	=====================================================================
+//	Get the number of cached results
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      size_t : the number of entries
+
+size_t IdtCache::size() const
+{
+    lock_guard<mutex> lock( _mutex );
+    return _entries.size();
+}
+
+//  =====================================================================
+//	Constructor
+//
+//	inputs:
+//      IdtCache *     : the cache that missed (or nullptr for none)
+//      const string & : the key left pending
+
+IdtCacheMiss::IdtCacheMiss( IdtCache *cache, const string &key )
+    : _cache( cache ), _key( key )
+{}
+
+//  =====================================================================
+//	Destructor: the key is abandoned if no result was stored
+
+IdtCacheMiss::~IdtCacheMiss()
+{
+    if ( _cache )
+        _cache->abandon( _key );
+}
+
+//	=====================================================================
+//	Store the result calculated for the key
+//
+//	inputs:
+//      const IdtCacheEntry & : the calculated result
+//
+//	outputs:
+//      N/A : the key is no longer pending
+
+void IdtCacheMiss::store( const IdtCacheEntry &entry )
+{
+    if ( _cache )
+        _cache->store( _key, entry );
+    _cache = nullptr;
+}
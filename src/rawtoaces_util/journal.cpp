@@ -0,0 +1,314 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/journal.h>
+#include <rawtoaces/stats.h>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+
+#ifndef WIN32
+#    include <unistd.h>
+#else
+#    include <io.h>
+#endif
+
+using namespace std;
+
+// The lines are flushed to the disk once this many are waiting, or once
+// this long (in seconds) has passed since the last flush
+static const int    syncRecords = 64;
+static const double syncDelay   = 1.0;
+
+//  =====================================================================
+//	Constructor
+
+Journal::Journal() : _fd( -1 ), _unsynced( 0 ), _synced( 0.0 ) {}
+
+//  =====================================================================
+//	Destructor: the lines not on the disk yet are flushed
+
+Journal::~Journal()
+{
+    if ( _fd >= 0 )
+    {
+        sync();
+        close( _fd );
+    }
+}
+
+//	=====================================================================
+//	Read the journal of an earlier run (--resume). Lines that cannot be
+//  read, like the last one of a process that was killed while writing
+//  it, are skipped.
+//
+//	inputs:
+//      const string & : path to the journal (a missing one is empty)
+//
+//	outputs:
+//      bool : false if it exists but cannot be read; isFinished() and
+//             interruptions() then tell what became of each file
+
+bool Journal::load( const string &path )
+{
+    _finished.clear();
+    _interrupted.clear();
+
+    ifstream in( path.c_str() );
+    if ( !in )
+        return errno == ENOENT;
+
+    string line;
+    while ( getline( in, line ) )
+    {
+        try
+        {
+            istringstream               record( line );
+            boost::property_tree::ptree pt;
+            boost::property_tree::read_json( record, pt );
+
+            string event = pt.get<string>( "event" );
+            string file  = pt.get<string>( "file" );
+            if ( event == "start" )
+                _interrupted[file]++;
+            else if ( event == "done" )
+            {
+                _finished[file] = pt.get<int>( "status", 0 );
+                _interrupted.erase( file );
+            }
+        }
+        catch ( std::exception const & )
+        {
+            continue;
+        }
+    }
+
+    return !in.bad();
+}
+
+//	=====================================================================
+//	Open the journal to record the files of this run
+//
+//	inputs:
+//      const string & : path to the journal
+//      bool           : true to go on after the lines already in it
+//                       (--resume), false to start it over
+//
+//	outputs:
+//      bool : false if it cannot be written
+
+bool Journal::open( const string &path, bool resume )
+{
+    int flags = O_WRONLY | O_CREAT | ( resume ? O_APPEND : O_TRUNC );
+    _fd       = ::open( path.c_str(), flags, 0644 );
+    if ( _fd < 0 )
+        return false;
+
+    // the last line of a process that was killed while writing it is
+    // ended, so that the next one is read on its own
+    if ( resume )
+    {
+        char  last = '\n';
+        FILE *in   = fopen( path.c_str(), "rb" );
+        if ( in )
+        {
+            if ( fseek( in, -1, SEEK_END ) == 0 )
+                last = static_cast<char>( fgetc( in ) );
+            fclose( in );
+        }
+
+        if ( last != '\n' )
+            append( "" );
+    }
+
+    _synced = wallTime();
+    return true;
+}
+
+//	=====================================================================
+//	Record that a file is started, before anything is done with it
+//
+//	inputs:
+//      const string & : path to the raw file
+//
+//	outputs:
+//      N/A : a "start" line is added to the journal
+
+void Journal::started( const string &file )
+{
+    append(
+        "{\"event\":\"start\",\"file\":" + jsonString( file ) +
+        ",\"time\":" + to_string( time( nullptr ) ) + "}" );
+}
+
+//	=====================================================================
+//	Record that a file is finished, once its outputs are all in place
+//
+//	inputs:
+//      const string & : path to the raw file
+//      int            : status of the conversion (0 when converted)
+//
+//	outputs:
+//      N/A : a "done" line is added to the journal
+
+void Journal::finished( const string &file, int status )
+{
+    append(
+        "{\"event\":\"done\",\"file\":" + jsonString( file ) +
+        ",\"status\":" + to_string( status ) +
+        ",\"time\":" + to_string( time( nullptr ) ) + "}" );
+}
+
+//	=====================================================================
+//	Flush the lines written so far to the disk
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A
+
+void Journal::sync()
+{
+    lock_guard<mutex> lock( _mutex );
+    if ( _fd < 0 || !_unsynced )
+        return;
+
+#ifndef WIN32
+    fsync( _fd );
+#else
+    _commit( _fd );
+#endif
+    _unsynced = 0;
+    _synced   = wallTime();
+}
+
+//	=====================================================================
+//	Tell whether the journal loaded has a file converted. A file whose
+//  last conversion failed is not, so that --resume tries it again.
+//
+//	inputs:
+//      const string & : path to the raw file
+//
+//	outputs:
+//      bool : true if it need not be converted again
+
+bool Journal::isFinished( const string &file ) const
+{
+    map<string, int>::const_iterator found = _finished.find( file );
+    return found != _finished.end() && found->second == 0;
+}
+
+//	=====================================================================
+//	Tell how many times the runs of the journal loaded were interrupted
+//  while converting a file (started and never finished)
+//
+//	inputs:
+//      const string & : path to the raw file
+//
+//	outputs:
+//      int : the number of interruptions
+
+int Journal::interruptions( const string &file ) const
+{
+    map<string, int>::const_iterator found = _interrupted.find( file );
+    return found != _interrupted.end() ? found->second : 0;
+}
+
+//	=====================================================================
+//	Write a line to the journal right away, so that it is not lost with
+//  the process, and flush the lines to the disk now and then
+//
+//	inputs:
+//      const string & : the record (empty to only end the line)
+//
+//	outputs:
+//      N/A
+
+void Journal::append( const string &record )
+{
+    string line = record + "\n";
+
+    {
+        lock_guard<mutex> lock( _mutex );
+        if ( _fd < 0 )
+            return;
+
+        size_t written = 0;
+        while ( written < line.size() )
+        {
+            int n = static_cast<int>(
+                write( _fd, line.c_str() + written, line.size() - written ) );
+            if ( n <= 0 )
+            {
+                if ( n < 0 && errno == EINTR )
+                    continue;
+                fprintf( stderr, "\nWarning: Cannot write to the journal\n" );
+                break;
+            }
+            written += n;
+        }
+
+        if ( ++_unsynced < syncRecords && wallTime() - _synced < syncDelay )
+            return;
+    }
+
+    sync();
+}
@@ -0,0 +1,1321 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/kernels.h>
+
+#include <Imath/half.h>
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+#if defined( __x86_64__ ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+#    define RTA_X86_SIMD
+#    include <cpuid.h>
+#    include <immintrin.h>
+
+#    define TARGET_SSE41 __attribute__( ( target( "sse4.1" ) ) )
+#    define TARGET_AVX2 __attribute__( ( target( "avx2,f16c" ) ) )
+#    define TARGET_AVX512 __attribute__( ( target( "avx512f,avx2,f16c" ) ) )
+#endif
+
+using namespace std;
+
+// Tiles are sized to stay in L2 while a thread works on them
+static const size_t tileBytes = 256 * 1024;
+
+// All kernels evaluate out[j] = ((m[j][0] * in[0] + m[j][1] * in[1]) +
+// m[j][2] * in[2]) + m[j][3] * in[3] with separate multiplies and adds,
+// in this order, and this file is built without floating point
+// contraction. Every kernel therefore produces the very same bits, no
+// matter which instruction set is picked or where a buffer is split.
+
+//	=====================================================================
+//	Store one result as a float or as the bits of a half float
+
+static inline void storeValue( float *out, float value )
+{
+    *out = value;
+}
+
+static inline void storeValue( uint16_t *out, float value )
+{
+    *out = Imath::half( value ).bits();
+}
+
+//	=====================================================================
+//	Multiply interleaved N-channel pixels by a matrix (scalar fallback)
+//
+//	inputs:
+//      const In *        : input values
+//      Out *             : output values (floats or half float bits)
+//      size_t            : the number of values (a multiple of N)
+//      const float[4][4] : the matrix (only the N x N part is used)
+//
+//	outputs:
+//		N/A               : out holds the transformed values
+
+template <typename In, typename Out, int N>
+static void
+transformScalar( const In *in, Out *out, size_t total, const float m[4][4] )
+{
+    for ( size_t i = 0; i < total; i += N )
+    {
+        float p[N];
+        for ( int j = 0; j < N; j++ )
+            p[j] = static_cast<float>( in[i + j] );
+
+        for ( int j = 0; j < N; j++ )
+        {
+            float value = m[j][0] * p[0];
+            for ( int k = 1; k < N; k++ )
+                value += m[j][k] * p[k];
+
+            storeValue( out + i + j, value );
+        }
+    }
+}
+
+#ifdef RTA_X86_SIMD
+
+//	=====================================================================
+//	SSE4.1: one pixel per 128-bit register, one lane per channel. The
+//  matrix is kept as N columns, so that a pixel is transformed by adding
+//  up the columns scaled by each of its channels.
+
+template <int N>
+TARGET_SSE41 static inline void loadColumns( __m128 *col, const float m[4][4] )
+{
+    for ( int k = 0; k < N; k++ )
+        col[k] = _mm_setr_ps(
+            m[0][k], m[1][k], m[2][k], N == 4 ? m[3][k] : 0.0f );
+}
+
+template <int N>
+TARGET_SSE41 static inline __m128 loadPixel( const float *in )
+{
+    if ( N == 4 )
+        return _mm_loadu_ps( in );
+
+    return _mm_setr_ps( in[0], in[1], in[2], 0.0f );
+}
+
+template <int N>
+TARGET_SSE41 static inline __m128 loadPixel( const uint16_t *in )
+{
+    if ( N == 4 )
+        return _mm_cvtepi32_ps(
+            _mm_cvtepu16_epi32( _mm_loadl_epi64( (const __m128i *)in ) ) );
+
+    return _mm_setr_ps( in[0], in[1], in[2], 0.0f );
+}
+
+template <int N>
+TARGET_SSE41 static inline __m128 loadPixel( const uint8_t *in )
+{
+    if ( N == 4 )
+    {
+        int32_t bytes;
+        memcpy( &bytes, in, sizeof( bytes ) );
+        return _mm_cvtepi32_ps(
+            _mm_cvtepu8_epi32( _mm_cvtsi32_si128( bytes ) ) );
+    }
+
+    return _mm_setr_ps( in[0], in[1], in[2], 0.0f );
+}
+
+template <int N>
+TARGET_SSE41 static inline __m128 mulPixel( const __m128 *col, __m128 p )
+{
+    __m128 v = _mm_mul_ps( col[0], _mm_shuffle_ps( p, p, 0x00 ) );
+    v = _mm_add_ps( v, _mm_mul_ps( col[1], _mm_shuffle_ps( p, p, 0x55 ) ) );
+    v = _mm_add_ps( v, _mm_mul_ps( col[2], _mm_shuffle_ps( p, p, 0xAA ) ) );
+    if ( N == 4 )
+        v = _mm_add_ps( v, _mm_mul_ps( col[3], _mm_shuffle_ps( p, p, 0xFF ) ) );
+
+    return v;
+}
+
+template <int N>
+TARGET_SSE41 static inline void storePixel( float *out, __m128 v )
+{
+    if ( N == 4 )
+        _mm_storeu_ps( out, v );
+    else
+    {
+        _mm_storel_pi( (__m64 *)out, v );
+        _mm_store_ss( out + 2, _mm_movehl_ps( v, v ) );
+    }
+}
+
+// SSE4.1 has no half float conversion, Imath rounds the same way as F16C
+template <int N>
+TARGET_SSE41 static inline void storePixel( uint16_t *out, __m128 v )
+{
+    float value[4];
+    _mm_storeu_ps( value, v );
+    for ( int j = 0; j < N; j++ )
+        out[j] = Imath::half( value[j] ).bits();
+}
+
+template <typename In, typename Out, int N>
+TARGET_SSE41 static void
+transformSSE41( const In *in, Out *out, size_t total, const float m[4][4] )
+{
+    __m128 col[N];
+    loadColumns<N>( col, m );
+
+    for ( size_t i = 0; i < total; i += N )
+        storePixel<N>( out + i, mulPixel<N>( col, loadPixel<N>( in + i ) ) );
+}
+
+//	=====================================================================
+//	AVX2: two pixels per 256-bit register, one per 128-bit lane, so the
+//  in-lane permutes broadcast the channels of each pixel separately
+
+template <int N>
+TARGET_AVX2 static inline __m256 loadPixels( const float *in )
+{
+    if ( N == 4 )
+        return _mm256_loadu_ps( in );
+
+    return _mm256_insertf128_ps(
+        _mm256_castps128_ps256( loadPixel<3>( in ) ),
+        loadPixel<3>( in + 3 ),
+        1 );
+}
+
+template <int N>
+TARGET_AVX2 static inline __m256 loadPixels( const uint16_t *in )
+{
+    if ( N == 4 )
+        return _mm256_cvtepi32_ps(
+            _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i *)in ) ) );
+
+    return _mm256_insertf128_ps(
+        _mm256_castps128_ps256( loadPixel<3>( in ) ),
+        loadPixel<3>( in + 3 ),
+        1 );
+}
+
+template <int N>
+TARGET_AVX2 static inline __m256 loadPixels( const uint8_t *in )
+{
+    if ( N == 4 )
+        return _mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *)in ) ) );
+
+    return _mm256_insertf128_ps(
+        _mm256_castps128_ps256( loadPixel<3>( in ) ),
+        loadPixel<3>( in + 3 ),
+        1 );
+}
+
+template <int N>
+TARGET_AVX2 static inline __m256 mulPixels( const __m256 *col, __m256 p )
+{
+    __m256 v = _mm256_mul_ps( col[0], _mm256_permute_ps( p, 0x00 ) );
+    v = _mm256_add_ps(
+        v, _mm256_mul_ps( col[1], _mm256_permute_ps( p, 0x55 ) ) );
+    v = _mm256_add_ps(
+        v, _mm256_mul_ps( col[2], _mm256_permute_ps( p, 0xAA ) ) );
+    if ( N == 4 )
+        v = _mm256_add_ps(
+            v, _mm256_mul_ps( col[3], _mm256_permute_ps( p, 0xFF ) ) );
+
+    return v;
+}
+
+template <int N>
+TARGET_AVX2 static inline void storePixels( float *out, __m256 v )
+{
+    if ( N == 4 )
+        _mm256_storeu_ps( out, v );
+    else
+    {
+        storePixel<3>( out, _mm256_castps256_ps128( v ) );
+        storePixel<3>( out + 3, _mm256_extractf128_ps( v, 1 ) );
+    }
+}
+
+template <int N>
+TARGET_AVX2 static inline void storePixels( uint16_t *out, __m256 v )
+{
+    __m128i h = _mm256_cvtps_ph( v, _MM_FROUND_TO_NEAREST_INT );
+    if ( N == 4 )
+        _mm_storeu_si128( (__m128i *)out, h );
+    else
+    {
+        // drop the 4th half of each pixel and store the 6 others
+        h = _mm_shuffle_epi8(
+            h,
+            _mm_setr_epi8(
+                0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1 ) );
+        _mm_storel_epi64( (__m128i *)out, h );
+
+        uint32_t last = _mm_extract_epi32( h, 2 );
+        memcpy( out + 4, &last, sizeof( last ) );
+    }
+}
+
+template <typename In, typename Out, int N>
+TARGET_AVX2 static void
+transformAVX2( const In *in, Out *out, size_t total, const float m[4][4] )
+{
+    __m128 col128[N];
+    __m256 col[N];
+    loadColumns<N>( col128, m );
+    for ( int k = 0; k < N; k++ )
+        col[k] = _mm256_insertf128_ps(
+            _mm256_castps128_ps256( col128[k] ), col128[k], 1 );
+
+    size_t i = 0;
+    for ( ; i + 2 * N <= total; i += 2 * N )
+        storePixels<N>( out + i, mulPixels<N>( col, loadPixels<N>( in + i ) ) );
+
+    if ( i < total )
+        transformSSE41<In, Out, N>( in + i, out + i, total - i, m );
+}
+
+//	=====================================================================
+//	AVX-512: four pixels per 512-bit register, one per 128-bit lane.
+//  3-channel pixels are spread over the lanes with expand loads and
+//  packed again with compress stores.
+
+template <int N>
+TARGET_AVX512 static inline __m512 loadPixels4( const float *in )
+{
+    if ( N == 4 )
+        return _mm512_loadu_ps( in );
+
+    return _mm512_maskz_expandloadu_ps( 0x7777, in );
+}
+
+template <int N>
+TARGET_AVX512 static inline __m512 loadPixels4( const uint16_t *in )
+{
+    if ( N == 4 )
+        return _mm512_cvtepi32_ps( _mm512_cvtepu16_epi32(
+            _mm256_loadu_si256( (const __m256i *)in ) ) );
+
+    // read exactly 12 values, then spread them over the 4 lanes
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i *)in ) ),
+        _mm_loadl_epi64( (const __m128i *)( in + 8 ) ),
+        1 );
+
+    return _mm512_cvtepi32_ps(
+        _mm512_maskz_expand_epi32( 0x7777, _mm512_cvtepu16_epi32( v ) ) );
+}
+
+template <int N>
+TARGET_AVX512 static inline __m512 loadPixels4( const uint8_t *in )
+{
+    if ( N == 4 )
+        return _mm512_cvtepi32_ps(
+            _mm512_cvtepu8_epi32( _mm_loadu_si128( (const __m128i *)in ) ) );
+
+    // read exactly 12 values, then spread them over the 4 lanes
+    int32_t last;
+    memcpy( &last, in + 8, sizeof( last ) );
+    __m128i v =
+        _mm_insert_epi32( _mm_loadl_epi64( (const __m128i *)in ), last, 2 );
+
+    return _mm512_cvtepi32_ps(
+        _mm512_maskz_expand_epi32( 0x7777, _mm512_cvtepu8_epi32( v ) ) );
+}
+
+template <int N>
+TARGET_AVX512 static inline __m512 mulPixels4( const __m512 *col, __m512 p )
+{
+    __m512 v = _mm512_mul_ps( col[0], _mm512_permute_ps( p, 0x00 ) );
+    v = _mm512_add_ps(
+        v, _mm512_mul_ps( col[1], _mm512_permute_ps( p, 0x55 ) ) );
+    v = _mm512_add_ps(
+        v, _mm512_mul_ps( col[2], _mm512_permute_ps( p, 0xAA ) ) );
+    if ( N == 4 )
+        v = _mm512_add_ps(
+            v, _mm512_mul_ps( col[3], _mm512_permute_ps( p, 0xFF ) ) );
+
+    return v;
+}
+
+template <int N>
+TARGET_AVX512 static inline void storePixels4( float *out, __m512 v )
+{
+    if ( N == 4 )
+        _mm512_storeu_ps( out, v );
+    else
+        _mm512_mask_compressstoreu_ps( out, 0x7777, v );
+}
+
+template <int N>
+TARGET_AVX512 static inline void storePixels4( uint16_t *out, __m512 v )
+{
+    if ( N == 3 )
+        v = _mm512_maskz_compress_ps( 0x7777, v );
+
+    __m256i h = _mm512_cvtps_ph( v, _MM_FROUND_TO_NEAREST_INT );
+    if ( N == 4 )
+        _mm256_storeu_si256( (__m256i *)out, h );
+    else
+    {
+        _mm_storeu_si128( (__m128i *)out, _mm256_castsi256_si128( h ) );
+        _mm_storel_epi64(
+            (__m128i *)( out + 8 ), _mm256_extracti128_si256( h, 1 ) );
+    }
+}
+
+template <typename In, typename Out, int N>
+TARGET_AVX512 static void
+transformAVX512( const In *in, Out *out, size_t total, const float m[4][4] )
+{
+    __m128 col128[N];
+    __m512 col[N];
+    loadColumns<N>( col128, m );
+    for ( int k = 0; k < N; k++ )
+        col[k] = _mm512_broadcast_f32x4( col128[k] );
+
+    size_t i = 0;
+    for ( ; i + 4 * N <= total; i += 4 * N )
+        storePixels4<N>(
+            out + i, mulPixels4<N>( col, loadPixels4<N>( in + i ) ) );
+
+    if ( i < total )
+        transformAVX2<In, Out, N>( in + i, out + i, total - i, m );
+}
+
+//	=====================================================================
+//	Read XCR0 to find out which register states the OS saves
+
+static uint64_t readXCR0()
+{
+    uint32_t eax, edx;
+    __asm__ __volatile__( "xgetbv" : "=a"( eax ), "=d"( edx ) : "c"( 0 ) );
+
+    return ( uint64_t( edx ) << 32 ) | eax;
+}
+
+#endif
+
+//	=====================================================================
+//	Find the highest instruction set level supported by the CPU and OS
+
+static simdLevel_t detectSimdLevel()
+{
+    simdLevel_t level = simdScalar;
+
+#ifdef RTA_X86_SIMD
+    unsigned int eax, ebx, ecx, edx;
+    if ( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+        return level;
+
+    if ( ecx & bit_SSE4_1 )
+        level = simdSSE41;
+
+    // AVX needs the OS to save the YMM (and for AVX-512 the ZMM) state
+    if ( !( ecx & bit_OSXSAVE ) || !( ecx & bit_AVX ) || !( ecx & bit_F16C ) )
+        return level;
+
+    uint64_t xcr0 = readXCR0();
+    if ( ( xcr0 & 0x06 ) != 0x06 )
+        return level;
+
+    if ( !__get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) )
+        return level;
+
+    if ( ebx & bit_AVX2 )
+        level = simdAVX2;
+
+    if ( ( ebx & bit_AVX512F ) && ( xcr0 & 0xE6 ) == 0xE6 )
+        level = simdAVX512;
+#endif
+
+    return level;
+}
+
+//	=====================================================================
+//	Get the instruction set level used by default
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      simdLevel_t : the highest level supported by this machine
+//                    (detected on the first call)
+
+simdLevel_t getSimdLevel()
+{
+    static const simdLevel_t level = detectSimdLevel();
+
+    return level;
+}
+
+//	=====================================================================
+//	Get the name of an instruction set level
+//
+//	inputs:
+//      simdLevel_t : the level
+//
+//	outputs:
+//      const char * : its name (e.g. for verbose output)
+
+const char *getSimdName( simdLevel_t level )
+{
+    switch ( level )
+    {
+        case simdSSE41: return "SSE4.1";
+        case simdAVX2: return "AVX2";
+        case simdAVX512: return "AVX-512";
+        default: return "scalar";
+    }
+}
+
+//	=====================================================================
+//	Pick the kernel of a given level for N-channel pixels. Levels above
+//  the one supported by this machine fall back to the supported one.
+//  Other channel counts throw std::invalid_argument; the renderer checks
+//  them before the pixels are split between threads.
+
+template <typename In, typename Out, int N>
+static void dispatch(
+    const In   *in,
+    Out        *out,
+    size_t      total,
+    const float m[4][4],
+    simdLevel_t level )
+{
+    if ( level > getSimdLevel() )
+        level = getSimdLevel();
+
+    switch ( level )
+    {
+#ifdef RTA_X86_SIMD
+        case simdAVX512:
+            transformAVX512<In, Out, N>( in, out, total, m );
+            break;
+        case simdAVX2: transformAVX2<In, Out, N>( in, out, total, m ); break;
+        case simdSSE41: transformSSE41<In, Out, N>( in, out, total, m ); break;
+#endif
+        default: transformScalar<In, Out, N>( in, out, total, m ); break;
+    }
+}
+
+template <typename In, typename Out>
+static void dispatch(
+    const In   *in,
+    Out        *out,
+    size_t      total,
+    int         channels,
+    const float m[4][4],
+    simdLevel_t level )
+{
+    assert( in && out && ( total % channels ) == 0 );
+
+    if ( channels == 3 )
+        dispatch<In, Out, 3>( in, out, total, m, level );
+    else if ( channels == 4 )
+        dispatch<In, Out, 4>( in, out, total, m, level );
+    else
+    {
+        throw std::invalid_argument(
+            "Currently support 3 channels and 4 channels." );
+    }
+}
+
+//	=====================================================================
+//	Multiply interleaved 3- or 4-channel pixels by a color matrix, the
+//  same as mulVectorArray() does, but with single precision coefficients
+//  and SIMD instructions. The input and output may be the same buffer.
+//
+//	inputs:
+//      const float * / const uint16_t * : input values
+//      float *                          : output values
+//      size_t                           : the number of values
+//      int                              : channels (3 or 4)
+//      const float[4][4]                : the matrix (only the
+//                                         channels x channels part is used)
+//      simdLevel_t                      : the highest level to use
+//
+//	outputs:
+//		N/A                              : out holds the transformed values
+
+void transformPixels(
+    const float *in,
+    float       *out,
+    size_t       total,
+    int          channels,
+    const float  m[4][4],
+    simdLevel_t  level )
+{
+    dispatch( in, out, total, channels, m, level );
+}
+
+void transformPixels(
+    const uint16_t *in,
+    float          *out,
+    size_t          total,
+    int             channels,
+    const float     m[4][4],
+    simdLevel_t     level )
+{
+    dispatch( in, out, total, channels, m, level );
+}
+
+//	=====================================================================
+//	Multiply interleaved 3- or 4-channel pixels by a color matrix and
+//  convert the results into half floats in the same pass
+//
+//	inputs:
+//      const uint16_t * / const uint8_t * : input values
+//      uint16_t *                         : output half float bits
+//      size_t                             : the number of values
+//      int                                : channels (3 or 4)
+//      const float[4][4]                  : the matrix
+//      simdLevel_t                        : the highest level to use
+//
+//	outputs:
+//		N/A                                : out holds the half floats
+
+void transformHalf(
+    const uint16_t *in,
+    uint16_t       *out,
+    size_t          total,
+    int             channels,
+    const float     m[4][4],
+    simdLevel_t     level )
+{
+    dispatch( in, out, total, channels, m, level );
+}
+
+void transformHalf(
+    const uint8_t *in,
+    uint16_t      *out,
+    size_t         total,
+    int            channels,
+    const float    m[4][4],
+    simdLevel_t    level )
+{
+    dispatch( in, out, total, channels, m, level );
+}
+
+//	=====================================================================
+//	Look the products of the matrix and the samples of 16-bit pixels up
+//  in a ColorLut instead of multiplying them; the products are added up
+//  in the same order as the arithmetic kernels do, so the results have
+//  the same bits (scalar fallback)
+//
+//	inputs:
+//      const uint16_t *  : input values
+//      uint16_t *        : output half float bits
+//      size_t            : the number of values (a multiple of N)
+//      const float *     : the table of the ColorLut
+//
+//	outputs:
+//		N/A               : out holds the transformed values
+
+template <int N>
+static void transformLutScalar(
+    const uint16_t *in, uint16_t *out, size_t total, const float *table )
+{
+    for ( size_t i = 0; i < total; i += N )
+    {
+        const float *entry[N];
+        for ( int k = 0; k < N; k++ )
+            entry[k] = table + ( size_t( k ) * 0x10000 + in[i + k] ) * 4;
+
+        for ( int j = 0; j < N; j++ )
+        {
+            float value = entry[0][j];
+            for ( int k = 1; k < N; k++ )
+                value += entry[k][j];
+
+            storeValue( out + i + j, value );
+        }
+    }
+}
+
+#ifdef RTA_X86_SIMD
+
+//	=====================================================================
+//	SSE4.1 and AVX2 table lookups: each entry is one 128-bit load, which
+//  replaces a broadcast and a multiply of the arithmetic kernels. AVX2
+//  converts two pixels at a time into half floats with F16C.
+
+template <int N>
+TARGET_SSE41 static inline __m128
+lookupPixel( const uint16_t *in, const float *table )
+{
+    __m128 v = _mm_loadu_ps( table + size_t( in[0] ) * 4 );
+    for ( int k = 1; k < N; k++ )
+        v = _mm_add_ps(
+            v, _mm_loadu_ps( table + ( size_t( k ) * 0x10000 + in[k] ) * 4 ) );
+
+    return v;
+}
+
+template <int N>
+TARGET_SSE41 static void transformLutSSE41(
+    const uint16_t *in, uint16_t *out, size_t total, const float *table )
+{
+    for ( size_t i = 0; i < total; i += N )
+        storePixel<N>( out + i, lookupPixel<N>( in + i, table ) );
+}
+
+template <int N>
+TARGET_AVX2 static void transformLutAVX2(
+    const uint16_t *in, uint16_t *out, size_t total, const float *table )
+{
+    size_t i = 0;
+    for ( ; i + 2 * N <= total; i += 2 * N )
+        storePixels<N>(
+            out + i,
+            _mm256_insertf128_ps(
+                _mm256_castps128_ps256( lookupPixel<N>( in + i, table ) ),
+                lookupPixel<N>( in + i + N, table ),
+                1 ) );
+
+    if ( i < total )
+        transformLutSSE41<N>( in + i, out + i, total - i, table );
+}
+
+#endif
+
+//	=====================================================================
+//	Fill a ColorLut with the products of a color matrix and every 16-bit
+//  sample. The table takes 1 MB per input channel and a few
+//  milliseconds to fill, so it is meant to be kept for all the frames
+//  sharing the matrix.
+//
+//	inputs:
+//      const float[4][4] : the matrix (only the channels x channels part
+//                          is used)
+//      int               : channels (3 or 4)
+//      ColorLut &        : the table to be filled
+//
+//	outputs:
+//		N/A               : lut holds the products
+
+void buildColorLut( const float m[4][4], int channels, ColorLut &lut )
+{
+    assert( channels == 3 || channels == 4 );
+
+    lut.channels = channels;
+    lut.table.assign( size_t( channels ) * 0x10000 * 4, 0.0f );
+
+    for ( int k = 0; k < channels; k++ )
+    {
+        float *entry = &lut.table[size_t( k ) * 0x10000 * 4];
+        for ( int v = 0; v < 0x10000; v++, entry += 4 )
+            for ( int j = 0; j < channels; j++ )
+                entry[j] = m[j][k] * static_cast<float>( v );
+    }
+}
+
+//	=====================================================================
+//	Find out whether the lookup tables beat the arithmetic kernel on this
+//  machine: both convert the same noise a few times (the table is about
+//  as large as a real one, so cache misses count) and the best times are
+//  compared. This takes a few milliseconds, only the first time.
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		bool : true if transformHalf() with a ColorLut is faster
+
+bool colorLutFaster()
+{
+    static const bool faster = []() {
+        const float m[4][4] = { { 1.0f, 0.1f, 0.1f, 0.0f },
+                                { 0.1f, 1.0f, 0.1f, 0.0f },
+                                { 0.1f, 0.1f, 1.0f, 0.0f },
+                                { 0.0f, 0.0f, 0.0f, 1.0f } };
+
+        ColorLut lut;
+        buildColorLut( m, 3, lut );
+
+        vector<uint16_t> in( 3 * 0x10000 ), out( in.size() );
+        uint32_t         seed = 12345;
+        FORI( in.size() )
+        {
+            seed  = seed * 1664525 + 1013904223;
+            in[i] = uint16_t( seed >> 16 );
+        }
+
+        auto time = [&]( const function<void()> &work ) {
+            double best = 1e30;
+            for ( int round = 0; round < 3; round++ )
+            {
+                auto start = chrono::steady_clock::now();
+                work();
+                best = min(
+                    best,
+                    chrono::duration<double>(
+                        chrono::steady_clock::now() - start )
+                        .count() );
+            }
+            return best;
+        };
+
+        double matrix = time(
+            [&]() { transformHalf( &in[0], &out[0], in.size(), 3, m ); } );
+        double table =
+            time( [&]() { transformHalf( &in[0], &out[0], in.size(), lut ); } );
+
+        return table < matrix;
+    }();
+
+    return faster;
+}
+
+//	=====================================================================
+//	Convert interleaved 3- or 4-channel 16-bit pixels into half floats
+//  with a ColorLut. The results have the same bits as transformHalf()
+//  with the matrix the table was built from.
+//
+//	inputs:
+//      const uint16_t *  : input values
+//      uint16_t *        : output half float bits
+//      size_t            : the number of values
+//      const ColorLut &  : the table from buildColorLut()
+//      simdLevel_t       : the highest level to use (AVX-512 machines use
+//                          the AVX2 kernel)
+//
+//	outputs:
+//		N/A               : out holds the half floats
+
+void transformHalf(
+    const uint16_t *in,
+    uint16_t       *out,
+    size_t          total,
+    const ColorLut &lut,
+    simdLevel_t     level )
+{
+    int channels = lut.channels;
+    assert( in && out && ( total % channels ) == 0 );
+    assert( lut.table.size() == size_t( channels ) * 0x10000 * 4 );
+
+    if ( level > getSimdLevel() )
+        level = getSimdLevel();
+
+    const float *table = &lut.table[0];
+
+#ifdef RTA_X86_SIMD
+    if ( level >= simdAVX2 )
+    {
+        if ( channels == 3 )
+            transformLutAVX2<3>( in, out, total, table );
+        else
+            transformLutAVX2<4>( in, out, total, table );
+        return;
+    }
+
+    if ( level == simdSSE41 )
+    {
+        if ( channels == 3 )
+            transformLutSSE41<3>( in, out, total, table );
+        else
+            transformLutSSE41<4>( in, out, total, table );
+        return;
+    }
+#endif
+
+    if ( channels == 3 )
+        transformLutScalar<3>( in, out, total, table );
+    else
+        transformLutScalar<4>( in, out, total, table );
+}
+
+//	=====================================================================
+//	Blend values [i, total) of rows of half floats into floats: out[i] =
+//  ((w[0] * row[0][i] + w[1] * row[1][i]) + ...), with separate
+//  multiplies and adds in this order, so every level produces the same
+//  bits (half to float conversions are exact)
+
+static void blendScalar(
+    const uint16_t *const *rows,
+    const float           *weights,
+    int                    count,
+    float                 *out,
+    size_t                 i,
+    size_t                 total )
+{
+    Imath::half value;
+    for ( ; i < total; i++ )
+    {
+        value.setBits( rows[0][i] );
+        float sum = weights[0] * float( value );
+        for ( int k = 1; k < count; k++ )
+        {
+            value.setBits( rows[k][i] );
+            sum += weights[k] * float( value );
+        }
+        out[i] = sum;
+    }
+}
+
+#ifdef RTA_X86_SIMD
+
+TARGET_AVX2 static inline __m256 loadHalf8( const uint16_t *in )
+{
+    return _mm256_cvtph_ps( _mm_loadu_si128( (const __m128i *)in ) );
+}
+
+TARGET_AVX2 static void blendAVX2(
+    const uint16_t *const *rows,
+    const float           *weights,
+    int                    count,
+    float                 *out,
+    size_t                 i,
+    size_t                 total )
+{
+    for ( ; i + 8 <= total; i += 8 )
+    {
+        __m256 sum = _mm256_mul_ps(
+            _mm256_set1_ps( weights[0] ), loadHalf8( rows[0] + i ) );
+        for ( int k = 1; k < count; k++ )
+            sum = _mm256_add_ps(
+                sum,
+                _mm256_mul_ps(
+                    _mm256_set1_ps( weights[k] ), loadHalf8( rows[k] + i ) ) );
+        _mm256_storeu_ps( out + i, sum );
+    }
+
+    blendScalar( rows, weights, count, out, i, total );
+}
+
+TARGET_AVX512 static inline __m512 loadHalf16( const uint16_t *in )
+{
+    return _mm512_cvtph_ps( _mm256_loadu_si256( (const __m256i *)in ) );
+}
+
+TARGET_AVX512 static void blendAVX512(
+    const uint16_t *const *rows,
+    const float           *weights,
+    int                    count,
+    float                 *out,
+    size_t                 i,
+    size_t                 total )
+{
+    for ( ; i + 16 <= total; i += 16 )
+    {
+        __m512 sum = _mm512_mul_ps(
+            _mm512_set1_ps( weights[0] ), loadHalf16( rows[0] + i ) );
+        for ( int k = 1; k < count; k++ )
+            sum = _mm512_add_ps(
+                sum,
+                _mm512_mul_ps(
+                    _mm512_set1_ps( weights[k] ), loadHalf16( rows[k] + i ) ) );
+        _mm512_storeu_ps( out + i, sum );
+    }
+
+    blendAVX2( rows, weights, count, out, i, total );
+}
+
+#endif
+
+static void blendRows(
+    const uint16_t *const *rows,
+    const float           *weights,
+    int                    count,
+    float                 *out,
+    size_t                 total,
+    simdLevel_t            level )
+{
+    assert( count > 0 );
+
+    if ( level > getSimdLevel() )
+        level = getSimdLevel();
+
+    switch ( level )
+    {
+#ifdef RTA_X86_SIMD
+        case simdAVX512:
+            blendAVX512( rows, weights, count, out, 0, total );
+            break;
+        case simdAVX2: blendAVX2( rows, weights, count, out, 0, total ); break;
+#endif
+        // SSE4.1 has no half float conversion
+        default: blendScalar( rows, weights, count, out, 0, total ); break;
+    }
+}
+
+//	=====================================================================
+//	Compute the taps of an area-averaging filter that resizes "size"
+//  pixels into "newSize" ones: each new pixel averages the old pixels it
+//  covers, weighted by how much of them it covers
+
+static void areaTaps(
+    size_t          size,
+    size_t          newSize,
+    vector<size_t> &first,
+    vector<int>    &count,
+    vector<float>  &weights )
+{
+    double scale = double( size ) / newSize;
+
+    first.resize( newSize );
+    count.resize( newSize );
+    weights.clear();
+
+    for ( size_t i = 0; i < newSize; i++ )
+    {
+        double start = i * scale;
+        double end   = min( double( size ), ( i + 1 ) * scale );
+
+        first[i] = min( size - 1, size_t( start ) );
+        count[i] = 0;
+        for ( size_t j = first[i]; j < size && j < end; j++ )
+        {
+            double cover = min( end, j + 1.0 ) - max( start, double( j ) );
+            weights.push_back( float( cover / ( end - start ) ) );
+            count[i]++;
+        }
+    }
+}
+
+//	=====================================================================
+//	Resize an image of interleaved half floats with an area-averaging
+//  filter, meant for downscaling linear data (e.g. ACES proxies). Rows
+//  are first blended vertically with SIMD instructions, then each row is
+//  filtered horizontally; output rows are split into tiles processed in
+//  parallel, so the result does not depend on the number of threads.
+//
+//	inputs:
+//      const uint16_t *           : input half floats
+//      int                        : input width
+//      int                        : input height
+//      int                        : channels
+//      uint16_t *                 : output half floats
+//      int                        : output width
+//      int                        : output height
+//      int                        : the number of threads
+//      simdLevel_t                : the highest level to use
+//
+//	outputs:
+//		N/A                        : out holds the resized image
+
+void resampleHalf(
+    const uint16_t *in,
+    int             width,
+    int             height,
+    int             channels,
+    uint16_t       *out,
+    int             newWidth,
+    int             newHeight,
+    int             threads,
+    simdLevel_t     level )
+{
+    assert( in && out && width > 0 && height > 0 );
+    assert( newWidth > 0 && newHeight > 0 && channels > 0 );
+
+    vector<size_t> rowFirst, colFirst;
+    vector<int>    rowCount, colCount;
+    vector<float>  rowWeights, colWeights;
+    areaTaps( height, newHeight, rowFirst, rowCount, rowWeights );
+    areaTaps( width, newWidth, colFirst, colCount, colWeights );
+
+    // where the taps of each output row start in rowWeights
+    vector<size_t> rowTaps( newHeight, 0 );
+    for ( int y = 1; y < newHeight; y++ )
+        rowTaps[y] = rowTaps[y - 1] + rowCount[y - 1];
+
+    size_t rowSize = size_t( width ) * channels;
+
+    forEachTile(
+        newHeight,
+        ( rowSize * height / newHeight ) * sizeof( uint16_t ),
+        threads,
+        [&]( size_t begin, size_t end ) {
+            vector<float>           blended( rowSize );
+            vector<const uint16_t *> rows;
+
+            for ( size_t y = begin; y < end; y++ )
+            {
+                rows.resize( rowCount[y] );
+                FORI( rowCount[y] )
+                rows[i] = in + ( rowFirst[y] + i ) * rowSize;
+                blendRows(
+                    &rows[0],
+                    &rowWeights[rowTaps[y]],
+                    rowCount[y],
+                    &blended[0],
+                    rowSize,
+                    level );
+
+                uint16_t    *pixel  = out + y * size_t( newWidth ) * channels;
+                const float *weight = &colWeights[0];
+                for ( int x = 0; x < newWidth; x++ )
+                {
+                    const float *src = &blended[colFirst[x] * channels];
+                    for ( int c = 0; c < channels; c++ )
+                    {
+                        float sum = weight[0] * src[c];
+                        for ( int k = 1; k < colCount[x]; k++ )
+                            sum += weight[k] * src[k * channels + c];
+                        *pixel++ = Imath::half( sum ).bits();
+                    }
+                    weight += colCount[x];
+                }
+            }
+        } );
+}
+
+//	=====================================================================
+//	Gather rows of the image LibRaw keeps after dcraw_process() (4 samples
+//  per pixel, width x height as decoded) in the orientation and layout of
+//  dcraw_make_mem_image(): the flip is undone by index remapping, the way
+//  LibRaw::copy_mem_image() walks the image, so no rotated copy is made.
+//
+//	inputs:
+//      const uint16_t ( * )[4]    : imgdata.image
+//      int                        : sizes.width
+//      int                        : sizes.height
+//      int                        : sizes.flip (bit 0: mirror columns,
+//                                   bit 1: mirror rows, bit 2: transpose)
+//      int                        : channels to keep (3 or 4)
+//      const uint16_t *           : curve applied to every sample (or
+//                                   nullptr to copy the samples as is)
+//      size_t                     : the first output column
+//      size_t                     : the column after the last one
+//      size_t                     : the first output row
+//      size_t                     : the row after the last output row
+//      uint16_t *                 : the output (rows [first, last) of
+//                                   columns [left, right) only)
+//
+//	outputs:
+//		N/A                        : out holds the gathered samples
+
+void gatherRows(
+    const uint16_t ( *image )[4],
+    int             width,
+    int             height,
+    int             flip,
+    int             channels,
+    const uint16_t *curve,
+    size_t          left,
+    size_t          right,
+    size_t          first,
+    size_t          last,
+    uint16_t       *out )
+{
+    assert( image && out && channels > 0 && channels <= 4 );
+    assert( left <= right && right <= size_t( ( flip & 4 ) ? height : width ) );
+
+    auto index = [&]( ptrdiff_t row, ptrdiff_t col ) {
+        if ( flip & 4 )
+            swap( row, col );
+        if ( flip & 2 )
+            row = height - 1 - row;
+        if ( flip & 1 )
+            col = width - 1 - col;
+        return row * width + col;
+    };
+
+    ptrdiff_t step = index( 0, 1 ) - index( 0, 0 );
+
+    for ( size_t row = first; row < last; row++ )
+    {
+        const uint16_t( *pixel )[4] = image + index( row, left );
+
+        if ( curve )
+        {
+            for ( size_t col = left; col < right; col++, pixel += step )
+                for ( int c = 0; c < channels; c++ )
+                    *out++ = curve[( *pixel )[c]];
+        }
+        else
+        {
+            for ( size_t col = left; col < right; col++, pixel += step )
+                for ( int c = 0; c < channels; c++ )
+                    *out++ = ( *pixel )[c];
+        }
+    }
+}
+
+//	=====================================================================
+//	Bin the 2x2 CFA quads of a Bayer raw image into one pixel each: every
+//  sample is black-subtracted (clipped at 0) and scaled by the multiplier
+//  of its color, then the samples of each color are averaged. The second
+//  green (color 3) is averaged with the first one, so the output has the
+//  layout of imgdata.image with 3 colors.
+//
+//	inputs:
+//      const uint16_t *           : the first visible raw sample
+//      size_t                     : samples per raw row
+//      const uint8_t[8][2]        : the color (0-3) of each CFA position
+//                                   (LibRaw's COLOR() for rows 0-7,
+//                                   columns 0-1)
+//      const float[4]             : black level of each color
+//      const float[4]             : multiplier of each color
+//      size_t                     : the output width (quads per row)
+//      size_t                     : the first output row
+//      size_t                     : the row after the last output row
+//      uint16_t ( * )[4]          : the output (rows [first, last) only)
+//
+//	outputs:
+//		N/A                        : out holds the binned pixels
+
+void binQuads(
+    const uint16_t *raw,
+    size_t          pitch,
+    const uint8_t   cfa[8][2],
+    const float     black[4],
+    const float     mul[4],
+    size_t          width,
+    size_t          first,
+    size_t          last,
+    uint16_t ( *out )[4] )
+{
+    assert( raw && out );
+
+    for ( size_t row = first; row < last; row++ )
+    {
+        const uint16_t *line[2]  = { raw + 2 * row * pitch,
+                                    raw + ( 2 * row + 1 ) * pitch };
+        const uint8_t  *color[2] = { cfa[( 2 * row ) & 7],
+                                     cfa[( 2 * row + 1 ) & 7] };
+
+        for ( size_t col = 0; col < width; col++ )
+        {
+            float sum[3]   = { 0.0f, 0.0f, 0.0f };
+            int   count[3] = { 0, 0, 0 };
+
+            FORIJ( 2, 2 )
+            {
+                int   c       = color[i][j];
+                int   channel = c == 3 ? 1 : c;
+                float v       = float( line[i][2 * col + j] ) - black[c];
+
+                sum[channel] += ( v > 0.0f ? v : 0.0f ) * mul[c];
+                count[channel]++;
+            }
+
+            uint16_t *pixel = out[( row - first ) * width + col];
+            FORI( 3 )
+            {
+                float v  = count[i] ? sum[i] / count[i] : 0.0f;
+                pixel[i] = v < 65535.0f ? uint16_t( v ) : 65535;
+            }
+            pixel[3] = 0;
+        }
+    }
+}
+
+//	=====================================================================
+//	Split items (e.g. image rows) into cache-sized tiles and process them
+//  on a number of threads. Each item is processed exactly once and the
+//  kernels do not depend on where a buffer is split, so the results are
+//  the same for any number of threads. If the work throws, no more tiles
+//  are started, and the exception is thrown again on the calling thread
+//  once all the threads have stopped.
+//
+//	inputs:
+//      size_t                     : the number of items
+//      size_t                     : the number of bytes read and written
+//                                   per item (to size the tiles)
+//      int                        : the number of threads
+//      function<void( size_t, size_t )> : the work on items [first, last)
+//
+//	outputs:
+//		N/A                        : work has been called for all tiles
+
+void forEachTile(
+    size_t                                count,
+    size_t                                itemBytes,
+    int                                   threads,
+    const function<void( size_t, size_t )> &work )
+{
+    size_t tile  = tileBytes / max( size_t( 1 ), itemBytes );
+    tile         = max( size_t( 1 ), tile );
+    size_t tiles = ( count + tile - 1 ) / tile;
+
+    if ( threads <= 1 || tiles <= 1 )
+    {
+        if ( count )
+            work( 0, count );
+        return;
+    }
+
+    size_t                workers = min( size_t( threads ), tiles );
+    vector<exception_ptr> errors( workers );
+    atomic<size_t>        next( 0 );
+    auto                  worker = [&]( size_t w ) {
+        try
+        {
+            for ( size_t t = next++; t < tiles; t = next++ )
+                work( t * tile, min( count, ( t + 1 ) * tile ) );
+        }
+        catch ( ... )
+        {
+            errors[w] = current_exception();
+            next      = tiles;
+        }
+    };
+
+    vector<thread> pool;
+    for ( size_t i = 1; i < workers; i++ )
+        pool.push_back( thread( worker, i ) );
+
+    worker( 0 );
+    FORI( pool.size() ) pool[i].join();
+
+    FORI( errors.size() )
+    {
+        if ( errors[i] )
+            rethrow_exception( errors[i] );
+    }
+}
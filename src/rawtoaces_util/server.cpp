@@ -0,0 +1,1524 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/server.h>
+#include <rawtoaces/batch.h>
+#include <rawtoaces/trace.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#    include <poll.h>
+#    include <sys/inotify.h>
+#    include <sys/signalfd.h>
+#endif
+
+#ifndef WIN32
+#    include <signal.h>
+#    include <sys/socket.h>
+#    include <sys/un.h>
+#    include <unistd.h>
+#endif
+
+using namespace std;
+
+//	=====================================================================
+//	Strip the new lines and spaces around a message
+//
+//	inputs:
+//      const string & : the message (e.g. from configureSettings())
+//
+//	outputs:
+//      string : the message without them
+
+static string trimmed( const string &text )
+{
+    size_t first = text.find_first_not_of( " \r\n" );
+    if ( first == string::npos )
+        return "";
+
+    return text.substr( first, text.find_last_not_of( " \r\n" ) - first + 1 );
+}
+
+//	=====================================================================
+//	Get the size of a file
+//
+//	inputs:
+//      const string & : path to the file
+//
+//	outputs:
+//      uint64_t : bytes (0 if the file cannot be found)
+
+static uint64_t fileSize( const string &path )
+{
+    struct stat st;
+    return stat( path.c_str(), &st ) == 0 ? st.st_size : 0;
+}
+
+// Settings of a file that can be given by name in a request or a
+// manifest, rather than as command line options
+static const char *overrideNames[] = { "wb-method",
+                                       "mat-method",
+                                       "illuminant",
+                                       "headroom",
+                                       "half-size" };
+
+//	=====================================================================
+//	Split a value into words
+//
+//	inputs:
+//      const string & : e.g. "1 D60"
+//
+//	outputs:
+//      vector < string > : e.g. { "1", "D60" }
+
+static vector<string> splitWords( const string &text )
+{
+    vector<string> words;
+    istringstream  stream( text );
+    string         word;
+
+    while ( stream >> word )
+        words.push_back( word );
+
+    return words;
+}
+
+//	=====================================================================
+//	Turn the settings given by name (see overrideNames) into command line
+//  options. "illuminant" is the light source of --wb-method 1, which it
+//  implies if no other method is given.
+//
+//	inputs:
+//      map < string, string > & : the settings by name (empty values are
+//                                 left out)
+//      vector < string > &      : the options, to which they are added
+//      string &                 : the error message
+//
+//	outputs:
+//      bool : false if a value is invalid
+
+static bool addOverrides(
+    map<string, string> &fields, vector<string> &options, string &error )
+{
+    vector<string> wb = splitWords( fields["wb-method"] );
+    if ( !fields["illuminant"].empty() )
+    {
+        if ( wb.empty() )
+            wb.push_back( "1" );
+        if ( wb.size() == 1 && wb[0] == "1" )
+            wb.push_back( fields["illuminant"] );
+    }
+    if ( wb.size() )
+    {
+        options.push_back( "--wb-method" );
+        options.insert( options.end(), wb.begin(), wb.end() );
+    }
+
+    vector<string> mat = splitWords( fields["mat-method"] );
+    if ( mat.size() )
+    {
+        options.push_back( "--mat-method" );
+        options.insert( options.end(), mat.begin(), mat.end() );
+    }
+
+    if ( !fields["headroom"].empty() )
+    {
+        options.push_back( "--headroom" );
+        options.push_back( fields["headroom"] );
+    }
+
+    string half = fields["half-size"];
+    FORI( half.size() ) half[i] = tolower( half[i] );
+    if ( half == "1" || half == "true" || half == "yes" )
+        options.push_back( "-h" );
+    else if ( !half.empty() && half != "0" && half != "false" && half != "no" )
+    {
+        error = "Invalid half-size \"" + fields["half-size"] + "\"";
+        return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Split a line of CSV into fields. Fields may be quoted, with "" for a
+//  quote inside them.
+//
+//	inputs:
+//      const string & : the line
+//
+//	outputs:
+//      vector < string > : the fields
+
+vector<string> splitCsv( const string &line )
+{
+    vector<string> fields( 1 );
+    bool           quoted = false;
+
+    FORI( line.size() )
+    {
+        char c = line[i];
+        if ( quoted )
+        {
+            if ( c != '"' )
+                fields.back() += c;
+            else if ( i + 1 < line.size() && line[i + 1] == '"' )
+                fields.back() += line[i++];
+            else
+                quoted = false;
+        }
+        else if ( c == '"' )
+            quoted = true;
+        else if ( c == ',' )
+            fields.push_back( "" );
+        else
+            fields.back() += c;
+    }
+
+    FORI( fields.size() ) fields[i] = trimmed( fields[i] );
+    return fields;
+}
+
+//	=====================================================================
+//	Parse the header of a CSV manifest (--manifest), e.g.
+//
+//      input,output,wb-method,illuminant,headroom,half-size,options
+//
+//	inputs:
+//      const string &      : the first line of the manifest
+//      vector < string > & : the names of the columns
+//      string &            : the error message
+//
+//	outputs:
+//      bool : false if a column is unknown or "input" is missing
+
+bool parseManifestHeader(
+    const string &line, vector<string> &columns, string &error )
+{
+    columns = splitCsv( line );
+
+    bool input = false;
+    FORI( columns.size() )
+    {
+        FORJ( columns[i].size() ) columns[i][j] = tolower( columns[i][j] );
+
+        bool known = columns[i] == "input" || columns[i] == "output" ||
+                     columns[i] == "options";
+        for ( const char *name: overrideNames )
+            known = known || columns[i] == name;
+
+        if ( !known )
+        {
+            error = "Unknown column \"" + columns[i] + "\"";
+            return false;
+        }
+        input = input || columns[i] == "input";
+    }
+
+    if ( !input )
+    {
+        error = "No input column";
+        return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Parse a row of a CSV manifest (--manifest). Empty fields keep the
+//  settings of the command line; "options" holds more command line
+//  options, separated by spaces.
+//
+//	inputs:
+//      const string &            : the line
+//      const vector < string > & : the columns (see parseManifestHeader())
+//      ServerJob &               : the job to be filled
+//      string &                  : the error message
+//
+//	outputs:
+//      bool : false if the row is invalid
+
+bool parseManifestRow(
+    const string         &line,
+    const vector<string> &columns,
+    ServerJob            &job,
+    string               &error )
+{
+    vector<string> values = splitCsv( line );
+    if ( values.size() > columns.size() )
+    {
+        error = "More fields than columns";
+        return false;
+    }
+
+    map<string, string> fields;
+    FORI( values.size() ) fields[columns[i]] = values[i];
+
+    job.input = fields["input"];
+    if ( job.input.empty() )
+    {
+        error = "No input file";
+        return false;
+    }
+
+    job.output = fields["output"];
+    if ( job.output.empty() )
+        job.output = acesOutputPath( job.input );
+
+    if ( !addOverrides( fields, job.options, error ) )
+        return false;
+
+    vector<string> options = splitWords( fields["options"] );
+    job.options.insert( job.options.end(), options.begin(), options.end() );
+
+    return true;
+}
+
+//	=====================================================================
+//	Parse a request (one line of JSON), e.g.
+//
+//      {"id": "42", "input": "A001.CR2", "output": "A001.exr",
+//       "options": ["--wb-method", "1", "3200K"]}
+//
+//  Only "input" is required; the output defaults to the name the batch
+//  would use. The settings of overrideNames may also be given by name,
+//  e.g. "illuminant": "3200K", ahead of the options. {"shutdown": true}
+//  stops the server. The lines of a JSON Lines manifest (--manifest) are
+//  read the same way.
+//
+//	inputs:
+//      const string & : the line
+//      ServerJob &    : the job to be filled
+//      bool &         : set if the server is asked to stop
+//      string &       : the error message
+//
+//	outputs:
+//      bool : false if the request is invalid (job.id is still filled
+//             if possible)
+
+bool parseServerJob(
+    const string &line, ServerJob &job, bool &shutdown, string &error )
+{
+    shutdown = false;
+
+    try
+    {
+        boost::property_tree::ptree request;
+        istringstream               stream( line );
+        boost::property_tree::read_json( stream, request );
+
+        job.id   = request.get<string>( "id", "" );
+        shutdown = request.get<bool>( "shutdown", false );
+        if ( shutdown )
+            return true;
+
+        job.input = request.get<string>( "input", "" );
+        if ( job.input.empty() )
+        {
+            error = "No input file";
+            return false;
+        }
+        job.output =
+            request.get<string>( "output", acesOutputPath( job.input ) );
+
+        map<string, string> fields;
+        for ( const char *name: overrideNames )
+            fields[name] = request.get<string>( name, "" );
+        if ( !addOverrides( fields, job.options, error ) )
+            return false;
+
+        boost::property_tree::ptree none;
+        for ( auto &option: request.get_child( "options", none ) )
+            job.options.push_back( option.second.get_value<string>() );
+    }
+    catch ( std::exception const &e )
+    {
+        error = string( "Invalid request: " ) + e.what();
+        return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Derive the name of a proxy (--proxy) from the name of the output
+//
+//	inputs:
+//      const string & : path to the full size output
+//      const string & : suffix of the proxy (e.g., "_half")
+//
+//	outputs:
+//      string : e.g. "A001_aces.exr" -> "A001_half_aces.exr" or
+//               "A001.exr" -> "A001_half.exr"
+
+string proxyOutputPath( const string &output, const string &suffix )
+{
+    static const string aces = "_aces.exr";
+
+    size_t pos = output.size();
+    if ( output.size() >= aces.size() &&
+         output.compare( pos - aces.size(), aces.size(), aces ) == 0 )
+        pos -= aces.size();
+    else
+    {
+        size_t dot = output.rfind( '.' );
+        if ( dot != string::npos &&
+             output.find_first_of( "/\\", dot ) == string::npos )
+            pos = dot;
+    }
+
+    return output.substr( 0, pos ) + suffix + output.substr( pos );
+}
+
+//	=====================================================================
+//	Check whether a file appearing in a watched directory (--watch) is to
+//  be converted: hidden and temporary files of copy tools (e.g. rsync's
+//  ".A001.CR2.Xy12ab") are skipped until renamed, and so are the files
+//  written by rawtoaces itself (the images and their .params files)
+//
+//	inputs:
+//      const string & : name of the file
+//
+//	outputs:
+//      bool : true to convert it
+
+bool isWatchedFile( const string &name )
+{
+    static const char *skipped[] = { ".exr", ".params", ".tmp", ".part",
+                                     ".crdownload", "~" };
+
+    if ( name.empty() || name[0] == '.' )
+        return false;
+
+    string lower( name );
+    FORI( lower.size() ) lower[i] = tolower( lower[i] );
+
+    for ( const char *suffix: skipped )
+    {
+        size_t length = strlen( suffix );
+        if ( lower.size() >= length &&
+             lower.compare( lower.size() - length, length, suffix ) == 0 )
+            return false;
+    }
+
+    return true;
+}
+
+//  =====================================================================
+//	Constructor
+//
+//	inputs:
+//      int : descriptor the requests are read from
+//      int : descriptor the responses are written to (may be the same)
+
+ServerClient::ServerClient( int in, int out ) : _in( in ), _out( out ) {}
+
+//  =====================================================================
+//	Destructor: close the descriptors, but for the standard input
+
+ServerClient::~ServerClient()
+{
+#ifndef WIN32
+    if ( _out != _in )
+        close( _out );
+    if ( _in > 2 )
+        close( _in );
+#endif
+}
+
+//	=====================================================================
+//	Send a response (one line of JSON) to the client
+//
+//	inputs:
+//      const string & : the response, without a new line
+//
+//	outputs:
+//      bool : false if the client has gone
+
+bool ServerClient::respond( const string &line )
+{
+#ifndef WIN32
+    lock_guard<mutex> lock( _mutex );
+
+    string      text = line + "\n";
+    const char *data = text.data();
+    size_t      left = text.size();
+
+    while ( left )
+    {
+        ssize_t sent = write( _out, data, left );
+        if ( sent < 0 && errno == EINTR )
+            continue;
+        if ( sent <= 0 )
+            return false;
+
+        data += sent;
+        left -= sent;
+    }
+
+    return true;
+#else
+    (void)line;
+    return false;
+#endif
+}
+
+//  =====================================================================
+//	Constructor
+//
+//	inputs:
+//      const AcesRender & : a fully configured renderer whose settings
+//                           every worker starts each job from
+
+AcesServer::AcesServer( const AcesRender &master )
+    : _master( master )
+    , _started( 0.0 )
+    , _stats( nullptr )
+    , _failed( 0 )
+    , _queue( nullptr )
+    , _stopping( false )
+    , _listener( -1 )
+    , _readers( 0 )
+{}
+
+//  =====================================================================
+//	Destructor
+
+AcesServer::~AcesServer() {}
+
+//	=====================================================================
+//	Serve conversion requests until told to stop. The workers, their
+//  renderers (with the illuminants loaded), the IDT matrices solved so
+//  far and the pixel buffers stay around from one request to the next.
+//  Every request gets a response with its status, error and timings, in
+//  the format of the --stats records.
+//
+//	inputs:
+//      int            : number of workers (files converted in parallel)
+//      const string & : path of the Unix domain socket to listen on, or
+//                       "-" to read requests from the standard input and
+//                       respond on the standard output
+//
+//	outputs:
+//      int : 0 once stopped, or -1 if the server could not be set up
+
+int AcesServer::run( int jobs, const string &address )
+{
+#ifndef WIN32
+    // a client going away must not take the server along
+    signal( SIGPIPE, SIG_IGN );
+
+    vector<thread> pool;
+    startWorkers( jobs, pool );
+
+    int ret = 0;
+    if ( address == "-" )
+    {
+        // the responses own the standard output; everything else
+        // printed goes to the standard error
+        fflush( stdout );
+        int out = dup( 1 );
+        dup2( 2, 1 );
+
+        readJobs( make_shared<ServerClient>( 0, out ) );
+    }
+    else
+        ret = acceptClients( address );
+
+    stopWorkers( pool );
+
+    return ret;
+#else
+    (void)jobs;
+    (void)address;
+    fprintf( stderr, "\nError: --serve is not available on Windows.\n" );
+    return -1;
+#endif
+}
+
+//	=====================================================================
+//	Listen on a Unix domain socket and read the requests of every client
+//  on a thread of its own. The threads are detached, so that a client
+//  connecting once per file costs nothing once it is gone; only their
+//  number is kept, to wait for them when stopping.
+//
+//	inputs:
+//      const string & : path of the socket (replaced if it exists)
+//
+//	outputs:
+//      int : 0 once stopped, or -1 if the socket could not be set up
+
+int AcesServer::acceptClients( const string &path )
+{
+#ifndef WIN32
+    sockaddr_un address;
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+
+    int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( listener < 0 || path.size() >= sizeof( address.sun_path ) )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot create the socket \"%s\"\n",
+            path.c_str() );
+        if ( listener >= 0 )
+            close( listener );
+        return -1;
+    }
+
+    strncpy( address.sun_path, path.c_str(), sizeof( address.sun_path ) - 1 );
+    unlink( path.c_str() );
+
+    if ( ::bind( listener, (sockaddr *)&address, sizeof( address ) ) ||
+         listen( listener, 16 ) )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot listen on the socket \"%s\" - %s\n",
+            path.c_str(),
+            strerror( errno ) );
+        close( listener );
+        return -1;
+    }
+    _listener = listener;
+
+    while ( !_stopping )
+    {
+        int fd = accept( listener, nullptr, nullptr );
+        if ( fd < 0 )
+        {
+            if ( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            break;
+        }
+
+        shared_ptr<ServerClient> client = make_shared<ServerClient>( fd, fd );
+        {
+            lock_guard<mutex> lock( _clientsMutex );
+
+            // the clients that are gone (read and answered) are forgotten
+            _clients.erase(
+                remove_if(
+                    _clients.begin(),
+                    _clients.end(),
+                    []( const weak_ptr<ServerClient> &gone ) {
+                        return gone.expired();
+                    } ),
+                _clients.end() );
+            _clients.push_back( client );
+            _readers++;
+        }
+
+        thread( [this, client]() {
+            readJobs( client );
+
+            lock_guard<mutex> lock( _clientsMutex );
+            if ( --_readers == 0 )
+                _readersDone.notify_all();
+        } ).detach();
+    }
+
+    // no more requests come in once told to stop
+    stop();
+    {
+        unique_lock<mutex> lock( _clientsMutex );
+        _readersDone.wait( lock, [this]() { return _readers == 0; } );
+    }
+
+    _listener = -1;
+    close( listener );
+    unlink( path.c_str() );
+#else
+    (void)path;
+#endif
+
+    return 0;
+}
+
+//	=====================================================================
+//	Read the requests of a client, one line of JSON each, and queue the
+//  jobs. An invalid request is answered right away.
+//
+//	inputs:
+//      shared_ptr < ServerClient > : the client
+//
+//	outputs:
+//      N/A : the jobs are pushed to _queue
+
+void AcesServer::readJobs( shared_ptr<ServerClient> client )
+{
+#ifndef WIN32
+    FILE *in = fdopen( dup( client->input() ), "r" );
+    if ( !in )
+        return;
+
+    char  *line = nullptr;
+    size_t size = 0;
+
+    while ( !_stopping && getline( &line, &size, in ) > 0 )
+    {
+        string text = trimmed( line );
+        if ( text.empty() )
+            continue;
+
+        ServerJob job;
+        bool      shutdown;
+        string    error;
+
+        if ( !parseServerJob( text, job, shutdown, error ) )
+        {
+            client->respond(
+                "{\"id\":" + jsonString( job.id ) +
+                ",\"status\":-1,\"error\":" + jsonString( error ) + "}" );
+            continue;
+        }
+
+        if ( shutdown )
+        {
+            stop();
+            break;
+        }
+
+        job.client   = client;
+        job.received = wallTime();
+        _queue->push( job );
+    }
+
+    free( line );
+    fclose( in );
+#else
+    (void)client;
+#endif
+}
+
+//	=====================================================================
+//	Stop taking requests: the socket stops accepting clients and the
+//  clients stop being read, while the jobs already queued are finished
+//
+//	inputs:  N/A
+//
+//	outputs:
+//      N/A : _stopping is set
+
+void AcesServer::stop()
+{
+#ifndef WIN32
+    _stopping = true;
+
+    int listener = _listener;
+    if ( listener >= 0 )
+        shutdown( listener, SHUT_RDWR );
+
+    lock_guard<mutex> lock( _clientsMutex );
+    FORI( _clients.size() )
+    {
+        shared_ptr<ServerClient> client = _clients[i].lock();
+        if ( client )
+            shutdown( client->input(), SHUT_RD );
+    }
+    _clients.clear();
+#endif
+}
+
+#ifdef __linux__
+// A file of a watched directory waiting for its copy to settle
+struct WatchedFile
+{
+    double   deadline;
+    off_t    size;
+    timespec modified;
+};
+
+//	=====================================================================
+//	Watch a directory and its subdirectories
+//
+//	inputs:
+//      int                 : the inotify descriptor
+//      const string &      : the directory
+//      map<int, string> &  : watched directories by watch descriptor
+//      vector < string > * : if given, the files already in the
+//                            directories are added to it
+//
+//	outputs:
+//      bool : false if the directory cannot be watched
+
+static bool watchTree(
+    int                notify,
+    const string      &dir,
+    map<int, string>  &watches,
+    vector<string>    *found )
+{
+    int wd = inotify_add_watch(
+        notify,
+        dir.c_str(),
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_CREATE | IN_DELETE |
+            IN_MOVED_FROM | IN_ONLYDIR );
+    if ( wd < 0 )
+        return false;
+    watches[wd] = dir;
+
+    boost::system::error_code ec;
+    for ( boost::filesystem::directory_iterator it( dir, ec ), end;
+          !ec && it != end;
+          it.increment( ec ) )
+    {
+        string path = it->path().string();
+        if ( boost::filesystem::is_directory( it->status() ) )
+            watchTree( notify, path, watches, found );
+        else if (
+            found && isWatchedFile( it->path().filename().string() ) )
+            found->push_back( path );
+    }
+
+    return true;
+}
+#endif
+
+//	=====================================================================
+//	Convert the raw files copied into directories as they arrive, until
+//  interrupted (SIGINT or SIGTERM). inotify tells when a file is closed
+//  after writing or renamed into a directory; the file is converted once
+//  its size and modification time have not changed for a while, so that
+//  copies made in several passes are not picked up half way. The files
+//  already there when watching starts are left alone, but those in
+//  directories created later (e.g. a card offloaded as a whole) are not.
+//  As with --serve, the workers and the data they loaded stay around
+//  from one file to the next.
+//
+//	inputs:
+//      int                       : number of workers
+//      const vector < string > & : the directories
+//      int                       : milliseconds a file must be left
+//                                  unchanged before it is converted
+//
+//	outputs:
+//      int : 0 once interrupted, or -1 if the directories cannot be
+//            watched
+
+int AcesServer::watch( int jobs, const vector<string> &dirs, int settle )
+{
+#ifdef __linux__
+    int notify = inotify_init1( IN_CLOEXEC );
+    if ( notify < 0 )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot watch directories - %s\n",
+            strerror( errno ) );
+        return -1;
+    }
+
+    map<int, string> watches;
+    vector<string>   found;
+    FORI( dirs.size() )
+    {
+        if ( !watchTree( notify, dirs[i], watches, &found ) )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot watch the directory \"%s\" - %s\n",
+                dirs[i].c_str(),
+                strerror( errno ) );
+            close( notify );
+            return -1;
+        }
+    }
+
+    if ( !openStats() )
+    {
+        close( notify );
+        return -1;
+    }
+
+    // interrupting finishes the files queued; blocked before the workers
+    // start, so that only the descriptor below receives the signals
+    sigset_t signals;
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGTERM );
+    pthread_sigmask( SIG_BLOCK, &signals, nullptr );
+    int interrupt = signalfd( -1, &signals, SFD_CLOEXEC );
+
+    vector<thread> pool;
+    startWorkers( jobs, pool );
+
+    // the files already there count as converted, should they be seen
+    // again after an overflow of the events
+    map<string, pair<off_t, timespec>> converted;
+    FORI( found.size() )
+    {
+        struct stat st;
+        if ( stat( found[i].c_str(), &st ) == 0 )
+            converted[found[i]] = make_pair( st.st_size, st.st_mtim );
+    }
+    found.clear();
+
+    // (re)starts the wait for a file to settle
+    map<string, WatchedFile> pending;
+    auto                     touch = [&]( const string &path ) {
+        struct stat st;
+        if ( stat( path.c_str(), &st ) != 0 )
+            return;
+
+        WatchedFile &file = pending[path];
+        file.deadline     = wallTime() + settle / 1000.0;
+        file.size         = st.st_size;
+        file.modified     = st.st_mtim;
+    };
+
+    // drops the files removed or moved away, so that the map only holds
+    // what is still in the directories
+    auto forget = [&]( const string &path, bool isDir ) {
+        if ( !isDir )
+        {
+            converted.erase( path );
+            pending.erase( path );
+            return;
+        }
+
+        string prefix = path + "/";
+        auto   first  = converted.lower_bound( prefix );
+        auto   last   = first;
+        while ( last != converted.end() &&
+                last->first.compare( 0, prefix.size(), prefix ) == 0 )
+            ++last;
+        converted.erase( first, last );
+
+        for ( auto file = pending.begin(); file != pending.end(); )
+        {
+            if ( file->first.compare( 0, prefix.size(), prefix ) == 0 )
+                file = pending.erase( file );
+            else
+                ++file;
+        }
+    };
+
+    alignas( inotify_event ) char buffer[64 * 1024];
+
+    while ( true )
+    {
+        int timeout = -1;
+        if ( pending.size() )
+        {
+            double next = pending.begin()->second.deadline;
+            for ( auto &file: pending )
+                next = std::min( next, file.second.deadline );
+            timeout =
+                std::max( 0, int( ceil( ( next - wallTime() ) * 1000 ) ) );
+        }
+
+        pollfd fds[2] = { { notify, POLLIN, 0 }, { interrupt, POLLIN, 0 } };
+        if ( poll( fds, 2, timeout ) < 0 && errno != EINTR )
+            break;
+        if ( fds[1].revents & POLLIN )
+            break;
+
+        ssize_t length = 0;
+        if ( fds[0].revents & POLLIN )
+            length = read( notify, buffer, sizeof( buffer ) );
+
+        for ( ssize_t offset = 0; offset < length; )
+        {
+            const inotify_event *event = (inotify_event *)( buffer + offset );
+            offset += sizeof( inotify_event ) + event->len;
+
+            if ( event->mask & IN_Q_OVERFLOW )
+            {
+                // events were lost: look at every file again, and forget
+                // those that are gone
+                for ( auto file = converted.begin();
+                      file != converted.end(); )
+                {
+                    struct stat st;
+                    if ( stat( file->first.c_str(), &st ) != 0 )
+                        file = converted.erase( file );
+                    else
+                        ++file;
+                }
+
+                map<int, string> all( watches );
+                for ( auto &dir: all )
+                    watchTree( notify, dir.second, watches, &found );
+                continue;
+            }
+
+            auto dir = watches.find( event->wd );
+            if ( dir == watches.end() )
+                continue;
+            if ( event->mask & IN_IGNORED )
+            {
+                watches.erase( dir );
+                continue;
+            }
+            if ( !event->len )
+                continue;
+
+            string name( event->name );
+            string path = dir->second + "/" + name;
+
+            if ( event->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+                forget( path, event->mask & IN_ISDIR );
+            else if ( event->mask & IN_ISDIR )
+            {
+                if ( event->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                    watchTree( notify, path, watches, &found );
+            }
+            else if ( !isWatchedFile( name ) )
+                continue;
+            else if ( event->mask & IN_MODIFY )
+            {
+                // still being written: wait for it to be closed
+                if ( pending.count( path ) )
+                    touch( path );
+            }
+            else if ( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+                touch( path );
+        }
+
+        FORI( found.size() ) touch( found[i] );
+        found.clear();
+
+        // queue the files left alone long enough
+        double now = wallTime();
+        for ( auto file = pending.begin(); file != pending.end(); )
+        {
+            struct stat st;
+            if ( file->second.deadline > now )
+                ++file;
+            else if ( stat( file->first.c_str(), &st ) != 0 )
+                file = pending.erase( file );
+            else if (
+                st.st_size != file->second.size ||
+                st.st_mtim.tv_sec != file->second.modified.tv_sec ||
+                st.st_mtim.tv_nsec != file->second.modified.tv_nsec )
+            {
+                file->second.deadline = now + settle / 1000.0;
+                file->second.size     = st.st_size;
+                file->second.modified = st.st_mtim;
+                ++file;
+            }
+            else
+            {
+                auto done = converted.find( file->first );
+                if ( done == converted.end() ||
+                     done->second.first != st.st_size ||
+                     done->second.second.tv_sec != st.st_mtim.tv_sec ||
+                     done->second.second.tv_nsec != st.st_mtim.tv_nsec )
+                {
+                    converted[file->first] =
+                        make_pair( st.st_size, st.st_mtim );
+
+                    ServerJob job;
+                    job.input    = file->first;
+                    job.output   = acesOutputPath( file->first );
+                    job.received = now;
+                    _queue->push( job );
+                }
+                file = pending.erase( file );
+            }
+        }
+    }
+
+    stopWorkers( pool );
+
+    close( interrupt );
+    close( notify );
+    pthread_sigmask( SIG_UNBLOCK, &signals, nullptr );
+
+    closeStats();
+    return 0;
+#else
+    (void)jobs;
+    (void)dirs;
+    (void)settle;
+    fprintf( stderr, "\nError: --watch is only available on Linux.\n" );
+    return -1;
+#endif
+}
+
+//	=====================================================================
+//	Convert the files listed in a manifest, as JSON Lines (see
+//  parseServerJob()) or CSV with a header (see parseManifestHeader()),
+//  each with the settings of the command line plus its own. The
+//  manifest is read as the workers go, so that a long one starts
+//  converting right away and is never held in memory as a whole. Blank
+//  lines and lines starting with "#" are skipped. Unlike a batch, the
+//  files are neither grouped by camera nor reported in order, and
+//  configureSettings() refuses the options of AcesBatch with it.
+//
+//	inputs:
+//      int            : number of workers
+//      const string & : path to the manifest, or "-" for the standard
+//                       input
+//
+//	outputs:
+//      int : the number of files (or lines) that failed, or -1 if the
+//            manifest cannot be read
+
+int AcesServer::runManifest( int jobs, const string &path )
+{
+    ifstream file;
+    if ( path != "-" )
+    {
+        file.open( path.c_str() );
+        if ( !file )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot read the manifest \"%s\"\n",
+                path.c_str() );
+            return -1;
+        }
+    }
+    istream &in = path == "-" ? cin : file;
+
+    if ( !openStats() )
+        return -1;
+
+    vector<thread> pool;
+    startWorkers( jobs, pool );
+
+    vector<string> columns;
+    string         line;
+    size_t         number  = 0;
+    size_t         invalid = 0;
+
+    while ( getline( in, line ) )
+    {
+        number++;
+
+        string text = trimmed( line );
+        if ( text.empty() || text[0] == '#' )
+            continue;
+
+        ServerJob job;
+        bool      shutdown = false;
+        string    error;
+        bool      valid;
+
+        if ( text[0] == '{' )
+            valid = parseServerJob( text, job, shutdown, error );
+        else if ( columns.empty() )
+        {
+            if ( !parseManifestHeader( text, columns, error ) )
+            {
+                fprintf(
+                    stderr,
+                    "\nError: %s, line %d: %s\n",
+                    path.c_str(),
+                    static_cast<int>( number ),
+                    error.c_str() );
+                invalid++;
+                break;
+            }
+            continue;
+        }
+        else
+            valid = parseManifestRow( text, columns, job, error );
+
+        if ( !valid )
+        {
+            fprintf(
+                stderr,
+                "\nError: %s, line %d: %s\n",
+                path.c_str(),
+                static_cast<int>( number ),
+                error.c_str() );
+            invalid++;
+            continue;
+        }
+        if ( shutdown )
+            break;
+
+        job.received = wallTime();
+        _queue->push( job );
+    }
+
+    stopWorkers( pool );
+
+    return static_cast<int>( closeStats() + invalid );
+}
+
+//	=====================================================================
+//	Open the --stats file for the files not requested by a client
+//
+//	inputs:  N/A
+//
+//	outputs:
+//      bool : false if it cannot be written
+
+bool AcesServer::openStats()
+{
+    Option opts = _master.getSettings();
+
+    _finished.clear();
+    _failed = 0;
+    if ( opts.statsPath.empty() )
+        return true;
+
+    _stats = opts.statsPath == "-" ? stdout
+                                   : fopen( opts.statsPath.c_str(), "w" );
+    if ( !_stats )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write the statistics to \"%s\"\n",
+            opts.statsPath.c_str() );
+        return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	End the --stats file with the summary of all the files reported
+//
+//	inputs:  N/A
+//
+//	outputs:
+//      size_t : the number of files that could not be converted
+
+size_t AcesServer::closeStats()
+{
+    if ( _stats )
+    {
+        string summary = statsSummary(
+            _finished, _failed, wallTime() - _started, processCpuTime() );
+        fprintf( _stats, "%s\n", summary.c_str() );
+        if ( _stats != stdout )
+            fclose( _stats );
+        else
+            fflush( _stats );
+        _stats = nullptr;
+    }
+
+    return _failed;
+}
+
+//	=====================================================================
+//	Start the workers and the queue feeding them
+//
+//	inputs:
+//      int              : number of workers
+//      vector<thread> & : the threads
+//
+//	outputs:
+//      N/A : _queue is ready for jobs
+
+void AcesServer::startWorkers( int jobs, vector<thread> &pool )
+{
+    int workers = std::max( jobs, 1 );
+
+    _started  = wallTime();
+    _stopping = false;
+    _queue    = new BoundedQueue<ServerJob>( 2 * workers );
+
+    FORI( workers ) pool.push_back( thread( &AcesServer::worker, this ) );
+}
+
+//	=====================================================================
+//	Let the workers finish the queued jobs, then stop them
+//
+//	inputs:
+//      vector<thread> & : the threads
+//
+//	outputs:
+//      N/A : _queue is gone
+
+void AcesServer::stopWorkers( vector<thread> &pool )
+{
+    _queue->close();
+    FORI( pool.size() ) pool[i].join();
+    pool.clear();
+
+    delete _queue;
+    _queue = nullptr;
+}
+
+//	=====================================================================
+//	Worker loop: convert the queued jobs with a renderer that is set up
+//  once
+//
+//	inputs:  N/A
+//
+//	outputs:
+//      N/A : every job gets its response
+
+void AcesServer::worker()
+{
+    AcesRender render;
+    render.cloneSettings( _master );
+    render.setIdtCache( &_idtCache );
+    render.setBufferPool( &_bufferPool );
+    traceThreadName( "worker" );
+
+    ServerJob job;
+    while ( _queue->pop( job ) )
+    {
+        convert( render, job );
+        job.client.reset();
+    }
+}
+
+//	=====================================================================
+//	Convert the file of a job and respond to its client. The options of
+//  the job are applied on top of the settings of the server, with the
+//  same syntax as on the command line, and undone afterwards.
+//
+//	inputs:
+//      AcesRender & : the renderer of the worker
+//      ServerJob &  : the job
+//
+//	outputs:
+//      N/A : the ACES file is written and the response is sent
+
+void AcesServer::convert( AcesRender &render, ServerJob &job )
+{
+    FileStats stats   = {};
+    stats.started     = job.received - _started;
+    int    status     = LIBRAW_SUCCESS;
+    bool   skipped    = false;
+    string error, hash;
+
+    traceFile( job.input );
+
+    try
+    {
+        render.configureOptions( job.options );
+        render.setStats( &stats );
+        stats.bytesRead = fileSize( job.input );
+
+        Option opts = render.getSettings();
+        if ( opts.incremental )
+        {
+            vector<string> outputs( 1, job.output );
+            FORI( opts.outputSizes.size() )
+                outputs.push_back( proxyOutputPath(
+                    job.output, opts.outputSizes[i].suffix ) );
+
+            hash    = render.settingsHash();
+            skipped = outputsUpToDate( job.input, outputs, hash );
+        }
+
+        int ret;
+        if ( skipped )
+        {
+            // written before with the same settings
+        }
+        else if ( ( ret = render.preprocessRaw( job.input.c_str() ) ) !=
+                  LIBRAW_SUCCESS )
+        {
+            status = ret;
+            error  = "Cannot open or unpack the file";
+        }
+        else if ( ( ret = render.postprocessRaw() ) != LIBRAW_SUCCESS )
+        {
+            status = ret;
+            error  = "Cannot process the raw data";
+        }
+        else
+        {
+            writeOutputs( render, job, stats );
+        }
+    }
+    catch ( std::exception const &e )
+    {
+        status = -1;
+        error  = e.what();
+    }
+
+    if ( status != LIBRAW_SUCCESS )
+        render.recycle();
+    render.setStats( nullptr );
+    render.resetSettings( _master );
+
+    stats.finished = wallTime() - _started;
+
+    report( job, status, error, stats, skipped );
+}
+
+//	=====================================================================
+//	Report the result of a job: to its client, or for the files found by
+//  watching directories, as a batch does (the error on the standard
+//  error, the timings to the --stats file)
+//
+//	inputs:
+//      const ServerJob & : the job
+//      int               : its status (LIBRAW_SUCCESS if converted)
+//      const string &    : the error message
+//      FileStats &       : the timings and sizes of the job
+//      bool              : true if the outputs were up to date
+//                          (--incremental)
+//
+//	outputs:
+//      N/A : the response is sent or printed
+
+void AcesServer::report(
+    const ServerJob &job,
+    int              status,
+    const string    &error,
+    FileStats       &stats,
+    bool             skipped )
+{
+    string record = statsRecord( job.input, job.output, status, stats );
+
+    if ( skipped )
+    {
+        if ( job.client )
+            job.client->respond(
+                "{\"id\":" + jsonString( job.id ) +
+                ",\"status\":0,\"skipped\":true}" );
+        return;
+    }
+
+    if ( job.client )
+    {
+        job.client->respond(
+            "{\"id\":" + jsonString( job.id ) +
+            ",\"error\":" + jsonString( trimmed( error ) ) + "," +
+            record.substr( 1 ) );
+        return;
+    }
+
+    lock_guard<mutex> lock( _reportMutex );
+
+    _finished.push_back( stats );
+    if ( status != LIBRAW_SUCCESS )
+    {
+        _failed++;
+        fprintf(
+            stderr,
+            "\nError: Failed to convert \"%s\": %s\n",
+            job.input.c_str(),
+            error.c_str() );
+    }
+
+    if ( _stats )
+    {
+        fprintf( _stats, "%s\n", record.c_str() );
+        fflush( _stats );
+    }
+}
+
+//	=====================================================================
+//	Write the ACES file of a job, and its proxies (--proxy)
+//
+//	inputs:
+//      AcesRender & : the renderer, with the file processed
+//      ServerJob &  : the job
+//      FileStats &  : the timings and sizes of the job
+//
+//	outputs:
+//      N/A : the files have been written (or an exception is thrown)
+
+void AcesServer::writeOutputs(
+    AcesRender &render, ServerJob &job, FileStats &stats )
+{
+    Option opts = render.getSettings();
+
+    if ( opts.outputSizes.empty() )
+    {
+        {
+            StageTimer timer( &stats, stageWrite );
+            render.outputACES( job.output.c_str() );
+        }
+        stats.bytesWritten += fileSize( job.output );
+        return;
+    }
+
+    // the full size image is kept to downscale the proxies from
+    std::unique_ptr<AcesImage> image( render.prepareACES() );
+    render.recycle();
+
+    {
+        StageTimer timer( &stats, stageWrite );
+        AcesRender::writeACES( job.output.c_str(), *image );
+    }
+    stats.bytesWritten += fileSize( job.output );
+
+    FORI( opts.outputSizes.size() )
+    {
+        string path = proxyOutputPath( job.output, opts.outputSizes[i].suffix );
+
+        std::unique_ptr<AcesImage> proxy;
+        {
+            StageTimer timer( &stats, stageResize );
+            proxy.reset( AcesRender::resizeACES(
+                *image,
+                opts.outputSizes[i],
+                render.pixelThreads(),
+                &_bufferPool ) );
+        }
+
+        {
+            StageTimer timer( &stats, stageWrite );
+            AcesRender::writeACES( path.c_str(), *proxy );
+        }
+        stats.bytesWritten += fileSize( path );
+    }
+}
@@ -0,0 +1,386 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/stats.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+
+#ifdef WIN32
+#    include <windows.h>
+#else
+#    include <time.h>
+#endif
+
+using namespace std;
+
+static const char *stageNames[] = { "open",      "unpack", "process",
+                                    "mem_image", "idt",    "transform",
+                                    "resize",    "write" };
+
+// the timer running on this thread, which the next one nests in
+static thread_local StageTimer *currentTimer = nullptr;
+static mutex                    statsMutex;
+
+//	=====================================================================
+//	Get the name of a stage in the --stats records
+//
+//	inputs:
+//      stage_t : the stage
+//
+//	outputs:
+//		const char * : e.g. "unpack"
+
+const char *stageName( stage_t stage )
+{
+    return stageNames[stage];
+}
+
+//	=====================================================================
+//	Get the time of a monotonic clock
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		double : seconds since an arbitrary point
+
+double wallTime()
+{
+    return chrono::duration<double>(
+               chrono::steady_clock::now().time_since_epoch() )
+        .count();
+}
+
+//	=====================================================================
+//	Get the CPU time used by the calling thread
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		double : seconds (user and system)
+
+double threadCpuTime()
+{
+#ifdef WIN32
+    FILETIME created, exited, kernel, user;
+    if ( !GetThreadTimes(
+             GetCurrentThread(), &created, &exited, &kernel, &user ) )
+        return 0.0;
+
+    ULARGE_INTEGER k, u;
+    k.LowPart  = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart  = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+
+    return ( k.QuadPart + u.QuadPart ) * 1e-7;
+#else
+    timespec ts;
+    if ( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) )
+        return 0.0;
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+//	=====================================================================
+//	Get the CPU time used by all the threads of the process
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		double : seconds (user and system)
+
+double processCpuTime()
+{
+#ifdef WIN32
+    FILETIME created, exited, kernel, user;
+    if ( !GetProcessTimes(
+             GetCurrentProcess(), &created, &exited, &kernel, &user ) )
+        return 0.0;
+
+    ULARGE_INTEGER k, u;
+    k.LowPart  = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart  = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+
+    return ( k.QuadPart + u.QuadPart ) * 1e-7;
+#else
+    timespec ts;
+    if ( clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts ) )
+        return 0.0;
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+//	=====================================================================
+//	Get a percentile of a set of values (nearest rank)
+//
+//	inputs:
+//      vector < double > : the values
+//      double            : the percentile (0 - 100)
+//
+//	outputs:
+//		double : the smallest value that is not less than p% of the
+//               values (0 if there are none)
+
+double percentile( vector<double> values, double p )
+{
+    if ( values.empty() )
+        return 0.0;
+
+    size_t rank = static_cast<size_t>( ceil( p / 100.0 * values.size() ) );
+    rank        = std::min( std::max( rank, size_t( 1 ) ), values.size() );
+
+    nth_element( values.begin(), values.begin() + rank - 1, values.end() );
+    return values[rank - 1];
+}
+
+//	=====================================================================
+//	Format the wall and CPU times of every stage as a JSON object
+//
+//	inputs:
+//      const StageTime * : the times of the stageCount stages
+//
+//	outputs:
+//		string : e.g. {"open":{"wall_ms":1.2,"cpu_ms":0.4},...}
+
+static string stageTimes( const StageTime *stages )
+{
+    string json = "{";
+    FORI( stageCount )
+    {
+        char time[128];
+        snprintf(
+            time,
+            sizeof( time ),
+            "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+            i ? "," : "",
+            stageNames[i],
+            stages[i].wall * 1000.0,
+            stages[i].cpu * 1000.0 );
+        json += time;
+    }
+
+    return json + "}";
+}
+
+//	=====================================================================
+//	Format the --stats record of a file (one line of JSON)
+//
+//	inputs:
+//      const string &    : path to the raw file
+//      const string &    : path to the ACES file
+//      int               : status (LIBRAW_SUCCESS or the error)
+//      const FileStats & : what was measured
+//
+//	outputs:
+//		string : the record, without a new line
+
+string statsRecord(
+    const string    &input,
+    const string    &output,
+    int              status,
+    const FileStats &stats )
+{
+    char numbers[256];
+    snprintf(
+        numbers,
+        sizeof( numbers ),
+        "\"status\":%d,\"latency_ms\":%.3f,"
+        "\"bytes_read\":%llu,\"bytes_written\":%llu",
+        status,
+        ( stats.finished - stats.started ) * 1000.0,
+        static_cast<unsigned long long>( stats.bytesRead ),
+        static_cast<unsigned long long>( stats.bytesWritten ) );
+
+    return "{\"file\":" + jsonString( input ) +
+           ",\"output\":" + jsonString( output ) + "," + numbers +
+           ",\"stages\":" + stageTimes( stats.stages ) + "}";
+}
+
+//	=====================================================================
+//	Format the summary of a batch for --stats (one line of JSON):
+//  throughput, percentiles of the time from the start of the decode of
+//  a file to the end of its write, and the total time of every stage
+//
+//	inputs:
+//      const vector < FileStats > & : the records of all the files
+//      size_t                       : the number of failed files
+//      double                       : seconds the batch took
+//      double                       : CPU seconds of the whole process
+//
+//	outputs:
+//		string : the summary, without a new line
+
+string statsSummary(
+    const vector<FileStats> &stats, size_t failed, double elapsed, double cpu )
+{
+    StageTime      totals[stageCount] = {};
+    vector<double> latencies;
+    double         read = 0.0, written = 0.0;
+
+    FORI( stats.size() )
+    {
+        for ( int s = 0; s < stageCount; s++ )
+        {
+            totals[s].wall += stats[i].stages[s].wall;
+            totals[s].cpu += stats[i].stages[s].cpu;
+        }
+        latencies.push_back(
+            ( stats[i].finished - stats[i].started ) * 1000.0 );
+        read += stats[i].bytesRead;
+        written += stats[i].bytesWritten;
+    }
+
+    double rate = elapsed > 0.0 ? 1.0 / elapsed : 0.0;
+    double mb   = 1.0 / ( 1024.0 * 1024.0 );
+
+    char numbers[512];
+    snprintf(
+        numbers,
+        sizeof( numbers ),
+        "\"files\":%d,\"failed\":%d,\"elapsed_s\":%.3f,\"cpu_s\":%.3f,"
+        "\"files_per_s\":%.3f,\"read_mb_per_s\":%.3f,"
+        "\"written_mb_per_s\":%.3f,\"latency_ms\":{\"p50\":%.3f,"
+        "\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+        static_cast<int>( stats.size() ),
+        static_cast<int>( failed ),
+        elapsed,
+        cpu,
+        stats.size() * rate,
+        read * mb * rate,
+        written * mb * rate,
+        percentile( latencies, 50 ),
+        percentile( latencies, 90 ),
+        percentile( latencies, 99 ),
+        percentile( latencies, 100 ) );
+
+    return string( "{\"summary\":{" ) + numbers +
+           ",\"stages\":" + stageTimes( totals ) + "}}";
+}
+
+//  =====================================================================
+//	Constructor: start timing a stage of a file
+//
+//	inputs:
+//      FileStats * : where the time goes (nullptr not to time anything)
+//      stage_t     : the stage
+
+StageTimer::StageTimer( FileStats *stats, stage_t stage )
+    : _trace( stageNames[stage] )
+    , _stats( stats )
+    , _stage( stage )
+    , _wall( 0.0 )
+    , _cpu( 0.0 )
+    , _nestedWall( 0.0 )
+    , _nestedCpu( 0.0 )
+    , _parent( nullptr )
+{
+    if ( !_stats )
+        return;
+
+    _parent      = currentTimer;
+    currentTimer = this;
+
+    _wall = wallTime();
+    _cpu  = threadCpuTime();
+}
+
+//  =====================================================================
+//	Destructor: add the time since the constructor, but for the nested
+//  timers, to the stage
+
+StageTimer::~StageTimer()
+{
+    if ( !_stats )
+        return;
+
+    double wall = wallTime() - _wall;
+    double cpu  = threadCpuTime() - _cpu;
+
+    currentTimer = _parent;
+    if ( _parent )
+    {
+        _parent->_nestedWall += wall;
+        _parent->_nestedCpu += cpu;
+    }
+
+    lock_guard<mutex> lock( statsMutex );
+    _stats->stages[_stage].wall += wall - _nestedWall;
+    _stats->stages[_stage].cpu += cpu - _nestedCpu;
+}
+
+//	=====================================================================
+//	Add the CPU time other threads spent on the stage (e.g. the pixel
+//  threads of the transform)
+//
+//	inputs:
+//      double : seconds
+//
+//	outputs:
+//		N/A    : the stage has more CPU time
+
+void StageTimer::addCpu( double cpu )
+{
+    if ( !_stats )
+        return;
+
+    lock_guard<mutex> lock( statsMutex );
+    _stats->stages[_stage].cpu += cpu;
+}
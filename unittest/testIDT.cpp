@@ -5792,3 +5792,76 @@ BOOST_AUTO_TEST_CASE( TestIDT_CalIDT )
     free( brand );
     delete idtTest;
 };
+
+BOOST_AUTO_TEST_CASE( TestIDT_IDTCache )
+{
+    boost::filesystem::path cachePath =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path();
+    boost::filesystem::create_directories( cachePath );
+
+    boost::filesystem::path pathSpst = boost::filesystem::absolute(
+        "../../data/camera/arri_d21_380_780_5.json" );
+    boost::filesystem::path pathIllum = boost::filesystem::absolute(
+        "../../data/illuminant/iso7589_stutung_380_780_5.json" );
+    boost::filesystem::path pathTS = boost::filesystem::absolute(
+        "../../data/training/training_spectral.json" );
+    boost::filesystem::path pathCMF =
+        boost::filesystem::absolute( "../../data/cmf/cmf_1931.json" );
+
+    vector<string> illumPaths;
+    illumPaths.push_back( pathIllum.string() );
+
+    Idt idtTest[3];
+    FORI( 3 )
+    {
+        idtTest[i].loadCameraSpst( pathSpst.string(), "arri", "d21" );
+        idtTest[i].loadIlluminant( illumPaths, "iso7589" );
+        idtTest[i].loadTrainingData( pathTS.string() );
+        idtTest[i].loadCMF( pathCMF.string() );
+        idtTest[i].setCachePath( cachePath.string() );
+    }
+    idtTest[0].chooseIllumType( "iso7589", 0 );
+    idtTest[1].chooseIllumType( "iso7589", 0 );
+    idtTest[2].chooseIllumType( "iso7589", 1 );
+
+    // the same inputs give the same key, a different white balance does not
+    string key = idtTest[0].calCacheKey();
+    BOOST_CHECK_EQUAL( key.size(), 16 );
+    BOOST_CHECK_EQUAL( key, idtTest[1].calCacheKey() );
+    BOOST_CHECK( key != idtTest[2].calCacheKey() );
+
+    // the first calculation fills the cache ...
+    boost::filesystem::path cacheFile = cachePath / ( key + ".json" );
+    BOOST_CHECK_EQUAL( boost::filesystem::exists( cacheFile ), false );
+    BOOST_CHECK_EQUAL( idtTest[0].calIDT(), 1 );
+    BOOST_CHECK_EQUAL( boost::filesystem::exists( cacheFile ), true );
+
+    // ... and the second one reads back exactly the same matrix
+    BOOST_CHECK_EQUAL( idtTest[1].calIDT(), 1 );
+    vector<vector<double>> IDT_calc  = idtTest[0].getIDT();
+    vector<vector<double>> IDT_cache = idtTest[1].getIDT();
+    FORIJ( 3, 3 )
+    BOOST_CHECK_EQUAL( IDT_calc[i][j], IDT_cache[i][j] );
+
+    // a damaged entry is ignored and replaced
+    FILE *file = fopen( cacheFile.string().c_str(), "w" );
+    fputs( "{ \"key\": ", file );
+    fclose( file );
+
+    Idt idtDamaged;
+    idtDamaged.loadCameraSpst( pathSpst.string(), "arri", "d21" );
+    idtDamaged.loadIlluminant( illumPaths, "iso7589" );
+    idtDamaged.loadTrainingData( pathTS.string() );
+    idtDamaged.loadCMF( pathCMF.string() );
+    idtDamaged.setCachePath( cachePath.string() );
+    idtDamaged.chooseIllumType( "iso7589", 0 );
+
+    BOOST_CHECK_EQUAL( idtDamaged.calIDT(), 1 );
+    vector<vector<double>> IDT_damaged = idtDamaged.getIDT();
+    FORIJ( 3, 3 )
+    BOOST_CHECK_EQUAL( IDT_calc[i][j], IDT_damaged[i][j] );
+    BOOST_CHECK_EQUAL( boost::filesystem::file_size( cacheFile ) > 16, true );
+
+    boost::filesystem::remove_all( cachePath );
+};
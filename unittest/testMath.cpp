@@ -63,6 +63,11 @@
 #include <boost/test/floating_point_comparison.hpp>
 
 #include <rawtoaces/mathOps.h>
+#include <rawtoaces/kernels.h>
+
+#include <Imath/half.h>
+
+#include <chrono>
 
 using namespace std;
 
@@ -959,3 +964,362 @@ BOOST_AUTO_TEST_CASE( Test_GetCalcXYZt )
     FORIJ( 190, 3 )
     BOOST_CHECK_CLOSE( XYZ_test[i][j], XYZ[i][j], 1e-5 );
 };
+
+BOOST_AUTO_TEST_CASE( Test_TransformPixels )
+{
+    double M[4][4] = { { 1.0915120600, -0.2516916464, 0.1601795864, 0.0 },
+                       { -0.0089998772, 1.2147199060, -0.2057200288, 0.0 },
+                       { -0.1312667887, -0.7361633199, 1.8674301085, 0.0 },
+                       { 0.0000000000, 0.0000000000, 0.0000000000, 1.0 } };
+
+    // an odd number of pixels, so that every kernel has a remainder
+    const int pixels = 37;
+    uint32_t  seed   = 12345;
+
+    vector<uint16_t> raw( pixels * 4 );
+    FORI( raw.size() )
+    {
+        seed   = seed * 1664525 + 1013904223;
+        raw[i] = uint16_t( seed >> 16 );
+    }
+
+    for ( int channels = 3; channels <= 4; channels++ )
+    {
+        size_t total = pixels * channels;
+
+        vector<vector<double>> MV(
+            channels, vector<double>( channels ) );
+        float m[4][4], mScaled[4][4];
+        FORIJ( channels, channels )
+        {
+            MV[i][j]      = M[i][j];
+            m[i][j]       = float( M[i][j] );
+            mScaled[i][j] = float( M[i][j] * INV_65535 * 6.0 );
+        }
+
+        vector<double> expected( raw.begin(), raw.begin() + total );
+        mulVectorArray( &expected[0], uint32_t( total ), channels, MV );
+
+        vector<float> data( raw.begin(), raw.begin() + total );
+        vector<float> reference( total ), result( total );
+        vector<uint16_t> halfReference( total ), halfResult( total );
+
+        transformPixels(
+            &data[0], &reference[0], total, channels, m, simdScalar );
+        transformHalf(
+            &raw[0], &halfReference[0], total, channels, mScaled, simdScalar );
+
+        vector<uint8_t>  bytes( total );
+        vector<uint16_t> byteReference( total );
+        FORI( total ) bytes[i] = uint8_t( raw[i] >> 8 );
+        transformHalf(
+            &bytes[0], &byteReference[0], total, channels, mScaled, simdScalar );
+
+        // the scalar kernel matches mulVectorArray() ...
+        FORI( total )
+        BOOST_CHECK_SMALL( reference[i] - expected[i], 1e-5 * 65535.0 );
+        FORI( total )
+        {
+            Imath::half value;
+            value.setBits( halfReference[i] );
+            // half floats keep 11 significant bits
+            double aces = expected[i] * INV_65535 * 6.0;
+            BOOST_CHECK_SMALL(
+                float( value ) - aces, fabs( aces ) * 1e-3 + 1e-4 );
+        }
+
+        // ... and every other kernel produces the very same bits
+        for ( int level = simdSSE41; level <= simdAVX512; level++ )
+        {
+            simdLevel_t simd = simdLevel_t( level );
+
+            transformPixels( &data[0], &result[0], total, channels, m, simd );
+            BOOST_CHECK( result == reference );
+
+            transformPixels( &raw[0], &result[0], total, channels, m, simd );
+            BOOST_CHECK( result == reference );
+
+            // in place
+            result = data;
+            transformPixels(
+                &result[0], &result[0], total, channels, m, simd );
+            BOOST_CHECK( result == reference );
+
+            transformHalf(
+                &raw[0], &halfResult[0], total, channels, mScaled, simd );
+            BOOST_CHECK( halfResult == halfReference );
+
+            transformHalf(
+                &bytes[0], &halfResult[0], total, channels, mScaled, simd );
+            BOOST_CHECK( halfResult == byteReference );
+        }
+
+        // the lookup tables give the same bits as the arithmetic
+        ColorLut lut;
+        buildColorLut( mScaled, channels, lut );
+        for ( int level = simdScalar; level <= simdAVX512; level++ )
+        {
+            transformHalf(
+                &raw[0], &halfResult[0], total, lut, simdLevel_t( level ) );
+            BOOST_CHECK( halfResult == halfReference );
+        }
+    }
+};
+
+// Compares the lookup tables with the arithmetic kernels; run it with
+// --run_test=Bench_TransformHalf
+BOOST_AUTO_TEST_CASE(
+    Bench_TransformHalf, *boost::unit_test::disabled() )
+{
+    const float m[4][4] = { { 1.09f, -0.25f, 0.16f, 0.0f },
+                            { -0.01f, 1.21f, -0.21f, 0.0f },
+                            { -0.13f, -0.74f, 1.87f, 0.0f },
+                            { 0.0f, 0.0f, 0.0f, 1.0f } };
+
+    // a 24 megapixel frame of noise, converted in cache-sized tiles the
+    // way transformRows() does it
+    const size_t total  = size_t( 6000 ) * 4000 * 3;
+    const size_t tile   = 3 * 4096;
+    const int    rounds = 5;
+
+    vector<uint16_t> raw( total ), out( total );
+    uint32_t         seed = 12345;
+    FORI( total )
+    {
+        seed   = seed * 1664525 + 1013904223;
+        raw[i] = uint16_t( seed >> 16 );
+    }
+
+    auto time = [&]( const function<void( size_t, size_t )> &work ) {
+        auto start = chrono::steady_clock::now();
+        for ( int round = 0; round < rounds; round++ )
+            for ( size_t i = 0; i < total; i += tile )
+                work( i, min( tile, total - i ) );
+        return chrono::duration<double, milli>(
+                   chrono::steady_clock::now() - start )
+                   .count() /
+               rounds;
+    };
+
+    ColorLut lut;
+    auto     start = chrono::steady_clock::now();
+    buildColorLut( m, 3, lut );
+    printf(
+        "buildColorLut(): %.2f ms\n",
+        chrono::duration<double, milli>( chrono::steady_clock::now() - start )
+            .count() );
+
+    for ( int level = simdScalar; level <= getSimdLevel(); level++ )
+    {
+        simdLevel_t simd = simdLevel_t( level );
+
+        double matrix = time( [&]( size_t i, size_t size ) {
+            transformHalf( &raw[i], &out[i], size, 3, m, simd );
+        } );
+        double table  = time( [&]( size_t i, size_t size ) {
+            transformHalf( &raw[i], &out[i], size, lut, simd );
+        } );
+
+        printf(
+            "%-8s matrix %7.2f ms, table %7.2f ms per frame\n",
+            getSimdName( simd ),
+            matrix,
+            table );
+    }
+};
+
+BOOST_AUTO_TEST_CASE( Test_ForEachTile )
+{
+    float m[4][4] = { { 1.0f, 0.1f, 0.01f, 0.0f },
+                      { 0.1f, 2.0f, 0.01f, 0.0f },
+                      { 0.1f, 0.01f, 3.0f, 0.0f },
+                      { 0.0f, 0.0f, 0.0f, 1.0f } };
+
+    // 1000 rows of 333 pixels, split into many tiles
+    size_t           rows = 1000, rowSize = 333 * 3;
+    vector<uint16_t> raw( rows * rowSize );
+    FORI( raw.size() ) raw[i] = uint16_t( i * 7919 );
+
+    vector<float> reference( raw.size() );
+    transformPixels( &raw[0], &reference[0], raw.size(), 3, m );
+
+    int threads[] = { 1, 2, 3, 8 };
+    FORI( 4 )
+    {
+        vector<float> result( raw.size() );
+        vector<int>   visits( rows, 0 );
+
+        forEachTile(
+            rows,
+            rowSize * 6,
+            threads[i],
+            [&]( size_t first, size_t last ) {
+                for ( size_t row = first; row < last; row++ )
+                    visits[row]++;
+
+                transformPixels(
+                    &raw[first * rowSize],
+                    &result[first * rowSize],
+                    ( last - first ) * rowSize,
+                    3,
+                    m );
+            } );
+
+        BOOST_CHECK( visits == vector<int>( rows, 1 ) );
+        BOOST_CHECK( result == reference );
+
+        // an error on any thread comes back to the caller
+        BOOST_CHECK_THROW(
+            forEachTile(
+                rows,
+                rowSize * 6,
+                threads[i],
+                [&]( size_t, size_t last ) {
+                    if ( last == rows )
+                        throw std::invalid_argument( "last tile" );
+                } ),
+            std::invalid_argument );
+    }
+};
+
+BOOST_AUTO_TEST_CASE( Test_GatherRows )
+{
+    // 3 x 2 pixels, numbered row by row as LibRaw decoded them
+    uint16_t image[6][4];
+    FORIJ( 6, 4 ) image[i][j] = uint16_t( i * 10 + j );
+
+    // the pixels of dcraw_make_mem_image() for flip 0, 3 (180 degrees),
+    // 5 (90 degrees CCW) and 6 (90 degrees CW)
+    int flips[]        = { 0, 3, 5, 6 };
+    int expected[4][6] = { { 0, 1, 2, 3, 4, 5 },
+                           { 5, 4, 3, 2, 1, 0 },
+                           { 2, 5, 1, 4, 0, 3 },
+                           { 3, 0, 4, 1, 5, 2 } };
+
+    FORI( 4 )
+    {
+        int rows = ( flips[i] & 4 ) ? 3 : 2;
+
+        int width = 6 / rows;
+
+        vector<uint16_t> out( 6 * 3 );
+        gatherRows(
+            image, 3, 2, flips[i], 3, nullptr, 0, width, 0, rows, &out[0] );
+        FORJ( 18 )
+        BOOST_CHECK_EQUAL( out[j], expected[i][j / 3] * 10 + j % 3 );
+
+        // the second row on its own, all 4 channels
+        vector<uint16_t> row( width * 4 );
+        gatherRows(
+            image, 3, 2, flips[i], 4, nullptr, 0, width, 1, 2, &row[0] );
+        FORJ( width * 4 )
+        BOOST_CHECK_EQUAL( row[j], expected[i][width + j / 4] * 10 + j % 4 );
+
+        // the last column of every row
+        vector<uint16_t> column( rows * 3 );
+        gatherRows(
+            image,
+            3,
+            2,
+            flips[i],
+            3,
+            nullptr,
+            width - 1,
+            width,
+            0,
+            rows,
+            &column[0] );
+        FORJ( rows * 3 )
+        BOOST_CHECK_EQUAL(
+            column[j],
+            expected[i][( j / 3 ) * width + width - 1] * 10 + j % 3 );
+    }
+
+    vector<uint16_t> curve( 0x10000 );
+    FORI( 0x10000 ) curve[i] = uint16_t( i * 2 );
+
+    vector<uint16_t> out( 6 * 3 );
+    gatherRows( image, 3, 2, 0, 3, &curve[0], 0, 3, 0, 2, &out[0] );
+    FORI( 18 ) BOOST_CHECK_EQUAL( out[i], ( i / 3 * 10 + i % 3 ) * 2 );
+};
+
+BOOST_AUTO_TEST_CASE( Test_BinQuads )
+{
+    // RGGB with the second green as color 3, 4 x 4 visible samples in
+    // rows of 6
+    uint8_t cfa[8][2];
+    FORI( 8 )
+    {
+        cfa[i][0] = ( i & 1 ) ? 3 : 0;
+        cfa[i][1] = ( i & 1 ) ? 2 : 1;
+    }
+
+    uint16_t raw[4][6] = { { 110, 60, 5, 20, 0, 0 },
+                           { 80, 130, 40000, 30000, 0, 0 },
+                           { 11, 21, 11, 21, 0, 0 },
+                           { 21, 31, 21, 31, 0, 0 } };
+
+    float black[4] = { 10.0f, 20.0f, 30.0f, 20.0f };
+    float mul[4]   = { 1.0f, 2.0f, 3.0f, 2.0f };
+
+    // clipped at 0 after black subtraction and at 65535 after scaling
+    uint16_t expected[4][4] = { { 100, 100, 300, 0 },
+                                { 0, 39980, 65535, 0 },
+                                { 1, 2, 3, 0 },
+                                { 1, 2, 3, 0 } };
+
+    uint16_t out[4][4];
+    binQuads( &raw[0][0], 6, cfa, black, mul, 2, 0, 2, out );
+    FORIJ( 4, 4 ) BOOST_CHECK_EQUAL( out[i][j], expected[i][j] );
+
+    // the second row of quads on its own
+    uint16_t row[2][4];
+    binQuads( &raw[0][0], 6, cfa, black, mul, 2, 1, 2, row );
+    FORIJ( 2, 4 ) BOOST_CHECK_EQUAL( row[i][j], expected[2 + i][j] );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ResampleHalf )
+{
+    // 4 x 2 pixels of 3 channels, halved into 2 x 1
+    float values[2][12] = { { 1.0f, 2.0f, 3.0f, 3.0f, 2.0f, 1.0f,
+                              0.5f, 0.5f, 0.5f, 8.0f, 0.0f, 4.0f },
+                            { 1.0f, 2.0f, 3.0f, 1.0f, 2.0f, 3.0f,
+                              1.5f, 0.5f, 2.5f, 0.0f, 0.0f, 0.0f } };
+    uint16_t in[24];
+    FORIJ( 2, 12 ) in[i * 12 + j] = Imath::half( values[i][j] ).bits();
+
+    float    expected[6] = { 1.5f, 2.0f, 2.5f, 2.5f, 0.25f, 1.75f };
+    uint16_t out[6];
+    resampleHalf( in, 4, 2, 3, out, 2, 1, 1 );
+    FORI( 6 ) BOOST_CHECK_EQUAL( out[i], Imath::half( expected[i] ).bits() );
+
+    // a flat image stays flat at any size, and every level and number of
+    // threads gives the same bits
+    size_t           width = 301, height = 203;
+    vector<uint16_t> flat( width * height * 4, Imath::half( 0.18f ).bits() );
+    vector<uint16_t> noise( width * height * 4 );
+    FORI( noise.size() )
+    noise[i] = Imath::half( float( ( i * 7919 ) % 1000 ) / 100.0f ).bits();
+
+    vector<uint16_t> small( 97 * 66 * 4 );
+    resampleHalf( &flat[0], width, height, 4, &small[0], 97, 66, 3 );
+    FORI( small.size() )
+    {
+        Imath::half value;
+        value.setBits( small[i] );
+        BOOST_CHECK_CLOSE( float( value ), 0.18f, 0.1 );
+    }
+
+    vector<uint16_t> reference( 97 * 66 * 4 );
+    resampleHalf(
+        &noise[0], width, height, 4, &reference[0], 97, 66, 1, simdScalar );
+
+    simdLevel_t levels[] = { simdAVX2, simdAVX512 };
+    FORI( 2 )
+    {
+        vector<uint16_t> result( reference.size() );
+        resampleHalf(
+            &noise[0], width, height, 4, &result[0], 97, 66, 4, levels[i] );
+        BOOST_CHECK( result == reference );
+    }
+};
@@ -55,8 +55,21 @@
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/property_tree/json_parser.hpp>
 
 #include <rawtoaces/define.h>
+#include <rawtoaces/batch.h>
+#include <rawtoaces/bufferpool.h>
+#include <rawtoaces/claim.h>
+#include <rawtoaces/exrwriter.h>
+#include <rawtoaces/journal.h>
+#include <rawtoaces/server.h>
+#include <rawtoaces/stats.h>
+#include <rawtoaces/trace.h>
+
+#include <chrono>
+#include <future>
+#include <thread>
 
 using namespace std;
 
@@ -155,3 +168,780 @@ BOOST_AUTO_TEST_CASE( Test_PathsFinder )
 
     BOOST_CHECK_EQUAL( first, *it );
 };
+
+BOOST_AUTO_TEST_CASE( Test_AcesOutputPath )
+{
+    BOOST_CHECK_EQUAL( acesOutputPath( "A001.CR2" ), "A001_aces.exr" );
+    BOOST_CHECK_EQUAL(
+        acesOutputPath( "/card/A001.C002.NEF" ), "/card/A001.C002_aces.exr" );
+    BOOST_CHECK_EQUAL( acesOutputPath( "raw" ), "raw_aces.exr" );
+    BOOST_CHECK_EQUAL(
+        acesOutputPath( "A001.CR2", "_half" ), "A001_half_aces.exr" );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ShardFiles )
+{
+    vector<string> files = { "e.CR2", "a.CR2", "d.CR2", "b.CR2", "c.CR2",
+                             "a.CR2" };
+
+    // every file once, whatever the order of the list
+    vector<string> all;
+    FORI( 3 )
+    {
+        vector<string> share = shardFiles( files, {}, i, 3 );
+        BOOST_CHECK( share.size() == 1 || share.size() == 2 );
+        all.insert( all.end(), share.begin(), share.end() );
+    }
+    sort( all.begin(), all.end() );
+    BOOST_CHECK_EQUAL( all.size(), 5 );
+    BOOST_CHECK( unique( all.begin(), all.end() ) == all.end() );
+
+    vector<string> reversed( files.rbegin(), files.rend() );
+    BOOST_CHECK(
+        shardFiles( files, {}, 1, 3 ) == shardFiles( reversed, {}, 1, 3 ) );
+
+    // by size: the largest file alone, the rest together
+    vector<string>   sized = { "a.CR2", "b.CR2", "c.CR2", "d.CR2" };
+    vector<uint64_t> sizes = { 90, 30, 30, 20 };
+    vector<string>   large = shardFiles( sized, sizes, 0, 2 );
+    vector<string>   small = shardFiles( sized, sizes, 1, 2 );
+    BOOST_CHECK_EQUAL( large.size(), 1 );
+    BOOST_CHECK_EQUAL( large[0], "a.CR2" );
+    BOOST_CHECK_EQUAL( small.size(), 3 );
+};
+
+BOOST_AUTO_TEST_CASE( Test_BoundedQueue )
+{
+    BoundedQueue<int> queue( 2 );
+    BOOST_CHECK_EQUAL( queue.capacity(), 2 );
+
+    // the producer has to wait for the consumer once two items are queued
+    thread producer( [&queue] {
+        FORI( 100 ) queue.push( i );
+        queue.close();
+    } );
+
+    int         item;
+    vector<int> items;
+    while ( queue.pop( item ) )
+    {
+        BOOST_CHECK( queue.size() <= 2 );
+        items.push_back( item );
+    }
+    producer.join();
+
+    BOOST_CHECK_EQUAL( items.size(), 100 );
+    FORI( items.size() ) BOOST_CHECK_EQUAL( items[i], i );
+
+    BOOST_CHECK_EQUAL( queue.push( 1 ), false );
+    BOOST_CHECK_EQUAL( queue.pop( item ), false );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ByteBudget )
+{
+    ByteBudget budget( 100 );
+    BOOST_CHECK_EQUAL( budget.limit(), 100 );
+
+    // a request larger than the limit goes through when nothing is held
+    budget.acquire( 150 );
+    BOOST_CHECK_EQUAL( budget.used(), 150 );
+    budget.release( 150 );
+
+    // the consumer has to release the bytes before more can be acquired
+    BoundedQueue<int> queue( 100 );
+    thread            producer( [&] {
+        FORI( 100 )
+        {
+            budget.acquire( 40 );
+            queue.push( i );
+        }
+        queue.close();
+    } );
+
+    int item, count = 0;
+    while ( queue.pop( item ) )
+    {
+        BOOST_CHECK( budget.used() <= 100 );
+        BOOST_CHECK_EQUAL( item, count++ );
+        budget.release( 40 );
+    }
+    producer.join();
+
+    BOOST_CHECK_EQUAL( count, 100 );
+    BOOST_CHECK_EQUAL( budget.used(), 0 );
+};
+
+BOOST_AUTO_TEST_CASE( Test_IdtCache )
+{
+    float mul1[3] = { 2.0f, 1.0f, 1.5f };
+    float mul2[3] = { 2.0f, 1.0f, 1.5000001f };
+
+    string key1 = idtCacheKey( "idt", "Canon", "EOS 5D", mul1, 0, nullptr );
+    string key2 = idtCacheKey( "idt", "Canon", "EOS 5D", mul2, 0, nullptr );
+    string key3 = idtCacheKey( "idt", "Canon", "EOS 5D", mul1, 2, nullptr );
+    string key4 = idtCacheKey( "idt", "Canon", "EOS 5D", nullptr, 0, "d60" );
+
+    BOOST_CHECK( key1 != key2 );
+    BOOST_CHECK( key1 != key3 );
+    BOOST_CHECK( key1 != key4 );
+    BOOST_CHECK_EQUAL(
+        key1, idtCacheKey( "idt", "Canon", "EOS 5D", mul1, 0, nullptr ) );
+
+    IdtCache      cache;
+    IdtCacheEntry entry;
+
+    BOOST_CHECK_EQUAL( cache.fetch( key1, entry ), false );
+
+    entry.idt = vector<vector<double>>( 3, vector<double>( 3, 0.5 ) );
+    entry.wb  = vector<double>( 3, 2.0 );
+    cache.store( key1, entry );
+
+    // a second thread asking for a key being calculated waits for it
+    BOOST_CHECK_EQUAL( cache.fetch( key2, entry ), false );
+    thread waiter( [&cache, &key2] {
+        IdtCacheEntry result;
+        BOOST_CHECK_EQUAL( cache.fetch( key2, result ), true );
+        BOOST_CHECK_CLOSE( result.wb[0], 3.0, 1e-9 );
+    } );
+    entry.wb[0] = 3.0;
+    cache.store( key2, entry );
+    waiter.join();
+
+    IdtCacheEntry result;
+    BOOST_CHECK_EQUAL( cache.fetch( key1, result ), true );
+    BOOST_CHECK_CLOSE( result.idt[1][1], 0.5, 1e-9 );
+    BOOST_CHECK_CLOSE( result.wb[0], 2.0, 1e-9 );
+
+    // an abandoned key is calculated again by the next caller
+    BOOST_CHECK_EQUAL( cache.fetch( key3, result ), false );
+    cache.abandon( key3 );
+    BOOST_CHECK_EQUAL( cache.fetch( key3, result ), false );
+
+    BOOST_CHECK_EQUAL( cache.size(), 2 );
+    BOOST_CHECK_EQUAL( cache.getHits(), 2 );
+    BOOST_CHECK_EQUAL( cache.getMisses(), 4 );
+
+    // a calculation that throws between fetch() and store() does not
+    // leave the next caller waiting for the key
+    try
+    {
+        BOOST_CHECK_EQUAL( cache.fetch( key4, result ), false );
+        IdtCacheMiss miss( &cache, key4 );
+        throw std::runtime_error( "No matching cameras found." );
+    }
+    catch ( std::runtime_error const & )
+    {}
+
+    std::promise<bool> fetched;
+    std::future<bool>  done = fetched.get_future();
+    thread( [&cache, &key4, &fetched] {
+        IdtCacheEntry result;
+        fetched.set_value( cache.fetch( key4, result ) );
+    } ).detach();
+    BOOST_REQUIRE(
+        done.wait_for( chrono::seconds( 5 ) ) == std::future_status::ready );
+    BOOST_CHECK_EQUAL( done.get(), false );
+
+    // once stored, the key is not abandoned
+    {
+        IdtCacheMiss miss( &cache, key4 );
+        miss.store( entry );
+    }
+    BOOST_CHECK_EQUAL( cache.fetch( key4, result ), true );
+};
+
+BOOST_AUTO_TEST_CASE( Test_BufferPool )
+{
+    BOOST_CHECK_EQUAL( BufferPool::sizeClass( 1 ), 4096 );
+    BOOST_CHECK_EQUAL( BufferPool::sizeClass( 4096 ), 4096 );
+    BOOST_CHECK_EQUAL( BufferPool::sizeClass( 4097 ), 4608 );
+    BOOST_CHECK_EQUAL( BufferPool::sizeClass( 1 << 20 ), 1 << 20 );
+    BOOST_CHECK_EQUAL(
+        BufferPool::sizeClass( ( 1 << 20 ) + 1 ), ( 1 << 20 ) + ( 1 << 17 ) );
+
+    BufferPool pool( 3 * 4608 );
+
+    void *a = pool.acquire( 4500 );
+    void *b = pool.acquire( 4200 );
+    BOOST_CHECK( a != b );
+    BOOST_CHECK_EQUAL( size_t( a ) % 64, 0 );
+    BOOST_CHECK_EQUAL( size_t( b ) % 64, 0 );
+
+    // released buffers are handed out again for the same size class
+    pool.release( a );
+    void *c = pool.acquire( 4400 );
+    BOOST_CHECK_EQUAL( c, a );
+
+    // a long batch of same-sized files does not allocate any more
+    FORI( 1000 )
+    {
+        void *d = pool.acquire( 4500 );
+        pool.release( d );
+    }
+
+    BufferPoolStats stats = pool.getStats();
+    BOOST_CHECK_EQUAL( stats.allocations, 3 );
+    BOOST_CHECK_EQUAL( stats.reuses, 1000 );
+    BOOST_CHECK_EQUAL( stats.inUseBytes, 2 * 4608 );
+    BOOST_CHECK_EQUAL( stats.idleBytes, 4608 );
+    BOOST_CHECK_EQUAL( stats.peakBytes, 3 * 4608 );
+
+    // idle buffers beyond the limit go back to the system
+    void *e = pool.acquire( 100000 );
+    pool.release( e );
+    pool.release( b );
+    pool.release( c );
+
+    stats = pool.getStats();
+    BOOST_CHECK_EQUAL( stats.inUseBytes, 0 );
+    BOOST_CHECK_EQUAL( stats.idleBytes, 3 * 4608 );
+
+    pool.clear();
+    BOOST_CHECK_EQUAL( pool.getStats().idleBytes, 0 );
+
+    // without a limit, the idle buffers are bounded by the working set,
+    // and the size class used least recently is freed first
+    BufferPool working;
+
+    void *f = working.acquire( 4096 );
+    void *g = working.acquire( 4096 );
+    working.release( f );
+    working.release( g );
+    BOOST_CHECK_EQUAL( working.getStats().idleBytes, 2 * 4096 );
+
+    void *h = working.acquire( 3 * 4096 );
+    void *k = working.acquire( 3 * 4096 );
+    working.release( h );
+    working.release( k );
+
+    stats = working.getStats();
+    BOOST_CHECK_EQUAL( stats.inUseBytes, 0 );
+    BOOST_CHECK_EQUAL( stats.idleBytes, 6 * 4096 );
+    BOOST_CHECK_EQUAL( stats.allocations, 4 );
+
+    // the small buffers were freed, so one is allocated again, and now
+    // a large one makes room for it
+    working.release( working.acquire( 4096 ) );
+    BOOST_CHECK_EQUAL( working.getStats().allocations, 5 );
+    BOOST_CHECK_EQUAL( working.getStats().idleBytes, 4 * 4096 );
+};
+
+BOOST_AUTO_TEST_CASE( Test_StreamBands )
+{
+    const int width = 7, height = 10, channels = 3;
+    size_t    rowSize = size_t( width ) * channels;
+
+    float m[4][4] = { { 0.7f, 0.2f, 0.1f, 0.0f },
+                      { 0.1f, 0.8f, 0.1f, 0.0f },
+                      { 0.0f, 0.3f, 0.9f, 0.0f },
+                      { 0.0f, 0.0f, 0.0f, 1.0f } };
+
+    vector<uint16_t> pixels( rowSize * height );
+    FORI( pixels.size() ) pixels[i] = uint16_t( ( i * 2654435761u ) >> 16 );
+
+    vector<uint16_t> frame( pixels.size() );
+    transformHalf( &pixels[0], &frame[0], frame.size(), channels, m );
+
+    AcesRowSource source = [&]( uint16_t *aces, size_t first, size_t last ) {
+        transformHalf(
+            &pixels[first * rowSize],
+            aces,
+            ( last - first ) * rowSize,
+            channels,
+            m );
+    };
+
+    // bands of 3 rows leave a last band of 1; 1 row and more rows than
+    // the image are the extremes
+    size_t     sizes[] = { 3, 1, 4, 64 };
+    BufferPool pool;
+    for ( size_t bandRows: sizes )
+    {
+        vector<uint16_t> streamed( frame.size(), 0 );
+        size_t           next = 0;
+
+        streamBands(
+            source,
+            width,
+            height,
+            channels,
+            bandRows,
+            &pool,
+            [&]( const uint16_t *band, size_t first, size_t last ) {
+                BOOST_CHECK_EQUAL( first, next );
+                BOOST_CHECK( last - first <= bandRows );
+                copy(
+                    band,
+                    band + ( last - first ) * rowSize,
+                    &streamed[first * rowSize] );
+                next = last;
+            } );
+
+        BOOST_CHECK_EQUAL( next, size_t( height ) );
+        BOOST_CHECK( streamed == frame );
+    }
+};
+
+BOOST_AUTO_TEST_CASE( Test_ExrCompression )
+{
+    BOOST_CHECK_EQUAL( exrCompression( "none" ), exrNone );
+    BOOST_CHECK_EQUAL( exrCompression( "zip" ), exrZip );
+    BOOST_CHECK_EQUAL( exrCompression( "piz" ), exrPiz );
+    BOOST_CHECK_EQUAL( exrCompression( "dwaa" ), exrDwaa );
+    BOOST_CHECK_EQUAL( exrCompression( "dwab" ), exrDwab );
+    BOOST_CHECK_EQUAL( exrCompression( "DWAA" ), -1 );
+    BOOST_CHECK_EQUAL( exrCompression( "b44" ), -1 );
+};
+
+BOOST_AUTO_TEST_CASE( Test_Stats )
+{
+    vector<double> values;
+    FORI( 100 ) values.push_back( 100 - i );
+    BOOST_CHECK_EQUAL( percentile( values, 50 ), 50 );
+    BOOST_CHECK_EQUAL( percentile( values, 99 ), 99 );
+    BOOST_CHECK_EQUAL( percentile( values, 100 ), 100 );
+    BOOST_CHECK_EQUAL( percentile( vector<double>(), 50 ), 0 );
+
+    BOOST_CHECK_EQUAL(
+        jsonString( "a\"b\\c\n" ), "\"a\\\"b\\\\c\\n\"" );
+
+    // the time of a nested timer only counts for its own stage
+    FileStats stats = {};
+    {
+        StageTimer write( &stats, stageWrite );
+        {
+            StageTimer transform( &stats, stageTransform );
+            transform.addCpu( 1.0 );
+            this_thread::sleep_for( chrono::milliseconds( 20 ) );
+        }
+    }
+    BOOST_CHECK( stats.stages[stageTransform].wall >= 0.02 );
+    BOOST_CHECK( stats.stages[stageTransform].cpu >= 1.0 );
+    BOOST_CHECK( stats.stages[stageWrite].wall < 0.02 );
+    BOOST_CHECK( stats.stages[stageWrite].cpu < 1.0 );
+
+    StageTimer off( nullptr, stageWrite );
+    BOOST_CHECK( !off.active() );
+
+    stats.bytesRead = 1000;
+    string record   = statsRecord( "A001.CR2", "A001_aces.exr", 0, stats );
+    BOOST_CHECK_EQUAL( record.find( "{\"file\":\"A001.CR2\"" ), 0 );
+    BOOST_CHECK( record.find( "\"bytes_read\":1000," ) != string::npos );
+    BOOST_CHECK(
+        record.find( "\"transform\":{\"wall_ms\":" ) != string::npos );
+
+    string summary =
+        statsSummary( vector<FileStats>( 4, stats ), 1, 2.0, 1.0 );
+    BOOST_CHECK(
+        summary.find( "\"files\":4,\"failed\":1," ) != string::npos );
+    BOOST_CHECK( summary.find( "\"files_per_s\":2.000," ) != string::npos );
+};
+
+BOOST_AUTO_TEST_CASE( Test_Trace )
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+                                   boost::filesystem::unique_path();
+
+    BOOST_CHECK( traceStart( path.string() ) );
+    {
+        TraceScope scope( "outer" );
+        traceFile( "A001.CR2" );
+
+        thread other( [] {
+            traceThreadName( "decode" );
+            TraceScope scope( "inner" );
+        } );
+        other.join();
+    }
+    traceStop();
+
+    // nothing is recorded once the trace is written
+    TraceScope scope( "after" );
+
+    boost::property_tree::ptree trace;
+    boost::property_tree::read_json( path.string(), trace );
+    boost::filesystem::remove( path );
+
+    vector<string> names, files;
+    for ( auto &event: trace.get_child( "traceEvents" ) )
+    {
+        if ( event.second.get<string>( "ph" ) == "M" )
+            names.push_back( event.second.get<string>( "args.name" ) );
+        else
+        {
+            BOOST_CHECK_EQUAL( event.second.get<string>( "ph" ), "X" );
+            BOOST_CHECK( event.second.get<double>( "dur" ) >= 0.0 );
+            files.push_back( event.second.get<string>( "args.file", "" ) );
+        }
+    }
+
+    BOOST_CHECK_EQUAL( names.size(), 2 );
+    BOOST_CHECK_EQUAL( names[0], "main" );
+    BOOST_CHECK_EQUAL( names[1], "decode" );
+    BOOST_CHECK_EQUAL( files.size(), 2 );
+    BOOST_CHECK_EQUAL( files[0], "A001.CR2" );
+    BOOST_CHECK_EQUAL( files[1], "" );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ServerJob )
+{
+    ServerJob job;
+    bool      shutdown;
+    string    error;
+
+    BOOST_CHECK( parseServerJob(
+        "{\"id\": \"7\", \"input\": \"A001.CR2\", "
+        "\"options\": [\"--wb-method\", \"1\", \"D60\"]}",
+        job,
+        shutdown,
+        error ) );
+    BOOST_CHECK( !shutdown );
+    BOOST_CHECK_EQUAL( job.id, "7" );
+    BOOST_CHECK_EQUAL( job.input, "A001.CR2" );
+    BOOST_CHECK_EQUAL( job.output, "A001_aces.exr" );
+    BOOST_CHECK_EQUAL( job.options.size(), 3 );
+    BOOST_CHECK_EQUAL( job.options[2], "D60" );
+
+    ServerJob named;
+    BOOST_CHECK( parseServerJob(
+        "{\"input\": \"A001.CR2\", \"output\": \"out.exr\"}",
+        named,
+        shutdown,
+        error ) );
+    BOOST_CHECK_EQUAL( named.output, "out.exr" );
+    BOOST_CHECK( named.options.empty() );
+
+    ServerJob missing;
+    BOOST_CHECK( !parseServerJob(
+        "{\"id\": \"8\"}", missing, shutdown, error ) );
+    BOOST_CHECK_EQUAL( missing.id, "8" );
+    BOOST_CHECK_EQUAL( error, "No input file" );
+
+    ServerJob invalid;
+    BOOST_CHECK( !parseServerJob( "{\"input\": ", invalid, shutdown, error ) );
+    BOOST_CHECK_EQUAL( error.find( "Invalid request" ), 0 );
+
+    ServerJob stop;
+    BOOST_CHECK(
+        parseServerJob( "{\"shutdown\": true}", stop, shutdown, error ) );
+    BOOST_CHECK( shutdown );
+
+    BOOST_CHECK_EQUAL(
+        proxyOutputPath( "A001_aces.exr", "_half" ), "A001_half_aces.exr" );
+    BOOST_CHECK_EQUAL(
+        proxyOutputPath( "/out/A001.exr", "_half" ), "/out/A001_half.exr" );
+    BOOST_CHECK_EQUAL(
+        proxyOutputPath( "/out.d/A001", "_half" ), "/out.d/A001_half" );
+};
+
+BOOST_AUTO_TEST_CASE( Test_FileOptions )
+{
+    const char *identity[] = { "1", "0", "0", "0", "1", "0", "0", "0", "1" };
+    const char *swapped[]  = { "0", "1", "0", "1", "0", "0", "0", "0", "1" };
+
+    AcesRender master;
+    master.initialize( pathsFinder() );
+    vector<string> options = { "--mat-method", "3" };
+    options.insert( options.end(), identity, identity + 9 );
+    master.configureOptions( options );
+    string hash = master.settingsHash();
+
+    // the custom matrix belongs to the renderer and is reset with it
+    AcesRender render;
+    render.initialize( pathsFinder() );
+    render.resetSettings( master );
+    options = { "--mat-method", "3" };
+    options.insert( options.end(), swapped, swapped + 9 );
+    render.configureOptions( options );
+    BOOST_CHECK( render.settingsHash() != hash );
+    BOOST_CHECK_EQUAL( master.settingsHash(), hash );
+    render.resetSettings( master );
+    BOOST_CHECK_EQUAL( render.settingsHash(), hash );
+
+    render.configureOptions( { "--wb-method", "0", "-h", "-q", "3" } );
+    BOOST_CHECK_EQUAL( render.getSettings().wb_method, wbMethod0 );
+
+    // options of the whole run, and missing values, are errors
+    const vector<vector<string>> invalid = {
+        { "--help" },       { "--jobs", "4" },      { "--trace", "t.json" },
+        { "--serve", "-" }, { "--claim", "claims" }, { "--idt-cache", "c" },
+        { "-v" },           { "-C", "1" },          { "--mat-method", "3", "1" }
+    };
+    FORI( invalid.size() )
+    BOOST_CHECK_THROW( render.configureOptions( invalid[i] ), std::exception );
+};
+
+BOOST_AUTO_TEST_CASE( Test_BatchOptions )
+{
+    AcesRender render;
+
+    // room for the "" configureSettings() puts after the last argument
+    auto configure = [&render]( vector<const char *> args ) {
+        render.initialize( pathsFinder() );
+        args.push_back( nullptr );
+        return render.configureSettings(
+            int( args.size() - 1 ), const_cast<char **>( &args[0] ) );
+    };
+
+    BOOST_CHECK_EQUAL( configure( { "rawtoaces", "--manifest", "m.csv" } ), 3 );
+    BOOST_CHECK_EQUAL(
+        configure( { "rawtoaces", "--claim", "claims", "--shard", "0/2" } ),
+        5 );
+
+    // the job queue of the server would ignore them
+    const vector<vector<const char *>> invalid = {
+        { "rawtoaces", "--manifest", "m.csv", "--claim", "claims" },
+        { "rawtoaces", "--manifest", "m.csv", "--shard", "0/2" },
+        { "rawtoaces", "--manifest", "m.csv", "--shard-by-size" },
+        { "rawtoaces", "--manifest", "m.csv", "--pipeline", "2" },
+        { "rawtoaces", "--manifest", "m.csv", "--write-behind", "64" },
+        { "rawtoaces", "--manifest", "m.csv", "--resume", "j.log" },
+        { "rawtoaces", "--watch", "in", "--claim", "claims" },
+        { "rawtoaces", "--serve", "-", "--journal", "j.log" }
+    };
+    FORI( invalid.size() )
+    BOOST_CHECK_THROW( configure( invalid[i] ), std::invalid_argument );
+};
+
+BOOST_AUTO_TEST_CASE( Test_JobIlluminant )
+{
+    const char *raw = "../../unittest/materials/BatteryPark.NEF";
+
+    AcesRender master;
+    master.initialize( pathsFinder() );
+    master.configureOptions( { "--preview" } );
+    BOOST_CHECK( master.fetchIlluminant() );
+
+    auto convert = [raw]( AcesRender &render ) {
+        BOOST_CHECK_EQUAL( render.preprocessRaw( raw ), LIBRAW_SUCCESS );
+        BOOST_CHECK_EQUAL( render.postprocessRaw(), LIBRAW_SUCCESS );
+        vector<vector<double>> idt = render.getIDTMatrix();
+        render.recycle();
+        return idt;
+    };
+
+    AcesRender fresh;
+    fresh.cloneSettings( master );
+    vector<vector<double>> expected = convert( fresh );
+
+    // a job with its own light source, then one choosing it, on the
+    // same worker of a server
+    IdtCache   cache;
+    AcesRender worker;
+    worker.cloneSettings( master );
+    worker.setIdtCache( &cache );
+    worker.configureOptions( { "--wb-method", "1", "2000k" } );
+    convert( worker );
+    worker.resetSettings( master );
+    vector<vector<double>> idt = convert( worker );
+
+    BOOST_CHECK_EQUAL( cache.size(), 3 );
+    FORIJ( 3, 3 ) BOOST_CHECK_CLOSE( idt[i][j], expected[i][j], 1e-9 );
+};
+
+BOOST_AUTO_TEST_CASE( Test_WatchedFile )
+{
+    BOOST_CHECK( isWatchedFile( "A001.CR2" ) );
+    BOOST_CHECK( isWatchedFile( "A001_C002.nef" ) );
+    BOOST_CHECK( !isWatchedFile( "" ) );
+    BOOST_CHECK( !isWatchedFile( ".A001.CR2.Xy12ab" ) );
+    BOOST_CHECK( !isWatchedFile( "A001_aces.exr" ) );
+    BOOST_CHECK( !isWatchedFile( "A001.EXR" ) );
+    BOOST_CHECK( !isWatchedFile( "A001_aces.exr.params" ) );
+    BOOST_CHECK( !isWatchedFile( "A001.CR2.part" ) );
+    BOOST_CHECK( !isWatchedFile( "A001.CR2~" ) );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ClaimDir )
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() /
+                                  boost::filesystem::unique_path();
+    {
+        ClaimDir first( dir.string(), 60, "first" );
+        ClaimDir second( dir.string(), 60, "second" );
+
+        // one owner at a time, and none once converted
+        BOOST_CHECK( first.claim( "/card/A001.CR2" ) );
+        BOOST_CHECK( !second.claim( "/card/A001.CR2" ) );
+        BOOST_CHECK( second.claim( "/card/A002.CR2" ) );
+        first.release( "/card/A001.CR2", true );
+        BOOST_CHECK( !second.claim( "/card/A001.CR2" ) );
+        BOOST_CHECK( boost::filesystem::exists(
+            first.path( "/card/A001.CR2", "done" ) ) );
+
+        // same name, other directory
+        BOOST_CHECK( second.claim( "/other/A001.CR2" ) );
+
+        // a claim not touched for longer than the timeout is taken over,
+        // and the former owner can no longer release it
+        string claim = first.path( "/card/A003.CR2", "claim" );
+        BOOST_CHECK( first.claim( "/card/A003.CR2" ) );
+        boost::filesystem::last_write_time( claim, time( nullptr ) - 120 );
+        BOOST_CHECK( second.claim( "/card/A003.CR2" ) );
+        first.release( "/card/A003.CR2", false );
+        BOOST_CHECK( boost::filesystem::exists( claim ) );
+        second.release( "/card/A003.CR2", false );
+        BOOST_CHECK( boost::filesystem::exists(
+            second.path( "/card/A003.CR2", "failed" ) ) );
+    }
+
+    // the claims held are given up on destruction
+    ClaimDir third( dir.string(), 60, "third" );
+    BOOST_CHECK( !boost::filesystem::exists(
+        third.path( "/card/A002.CR2", "claim" ) ) );
+
+    boost::filesystem::remove_all( dir );
+};
+
+BOOST_AUTO_TEST_CASE( Test_Manifest )
+{
+    vector<string> fields =
+        splitCsv( "A001.CR2, \"a,b\" ,\"say \"\"hi\"\"\"," );
+    BOOST_CHECK_EQUAL( fields.size(), 4 );
+    BOOST_CHECK_EQUAL( fields[1], "a,b" );
+    BOOST_CHECK_EQUAL( fields[2], "say \"hi\"" );
+    BOOST_CHECK_EQUAL( fields[3], "" );
+
+    vector<string> columns;
+    string         error;
+    BOOST_CHECK( !parseManifestHeader( "input,exposure", columns, error ) );
+    BOOST_CHECK( !parseManifestHeader( "output", columns, error ) );
+    BOOST_CHECK( parseManifestHeader(
+        "Input,output,illuminant,half-size,options", columns, error ) );
+
+    ServerJob row;
+    BOOST_CHECK( parseManifestRow(
+        "A001.CR2,,3200K,yes,--headroom 4", columns, row, error ) );
+    BOOST_CHECK_EQUAL( row.output, "A001_aces.exr" );
+    vector<string> options = { "--wb-method", "1",          "3200K",
+                               "-h",          "--headroom", "4" };
+    BOOST_CHECK( row.options == options );
+
+    ServerJob invalid;
+    BOOST_CHECK(
+        !parseManifestRow( "A001.CR2,,,maybe", columns, invalid, error ) );
+    BOOST_CHECK( !parseManifestRow( ",out.exr", columns, invalid, error ) );
+
+    // the same settings by name in JSON
+    ServerJob json;
+    bool      shutdown;
+    BOOST_CHECK( parseServerJob(
+        "{\"input\": \"A001.CR2\", \"mat-method\": 1, \"headroom\": 6.5, "
+        "\"half-size\": true}",
+        json,
+        shutdown,
+        error ) );
+    options = { "--mat-method", "1", "--headroom", "6.5", "-h" };
+    BOOST_CHECK( json.options == options );
+};
+
+BOOST_AUTO_TEST_CASE( Test_Incremental )
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() /
+                                  boost::filesystem::unique_path();
+    boost::filesystem::create_directories( dir );
+
+    string raw    = ( dir / "A001.CR2" ).string();
+    string output = ( dir / "A001_aces.exr" ).string();
+    string proxy  = ( dir / "A001_half_aces.exr" ).string();
+    FORI( 3 )
+    {
+        const string &path = i == 0 ? raw : i == 1 ? output : proxy;
+        FILE         *file = fopen( path.c_str(), "w" );
+        fclose( file );
+    }
+
+    vector<string> outputs = { output, proxy };
+    BOOST_CHECK( !outputsUpToDate( raw, outputs, "0123456789abcdef" ) );
+    BOOST_CHECK( writeSettingsHash( output, "0123456789abcdef" ) );
+    BOOST_CHECK( !outputsUpToDate( raw, outputs, "0123456789abcdef" ) );
+    BOOST_CHECK( writeSettingsHash( proxy, "0123456789abcdef" ) );
+    BOOST_CHECK( outputsUpToDate( raw, outputs, "0123456789abcdef" ) );
+
+    // other settings, a missing proxy or a newer raw file
+    BOOST_CHECK( !outputsUpToDate( raw, outputs, "fedcba9876543210" ) );
+    outputs.push_back( ( dir / "A001_quarter_aces.exr" ).string() );
+    BOOST_CHECK( !outputsUpToDate( raw, outputs, "0123456789abcdef" ) );
+    outputs.pop_back();
+    boost::filesystem::last_write_time( output, time( nullptr ) - 60 );
+    BOOST_CHECK( !outputsUpToDate( raw, outputs, "0123456789abcdef" ) );
+    boost::filesystem::last_write_time( output, time( nullptr ) + 60 );
+    BOOST_CHECK( outputsUpToDate( raw, outputs, "0123456789abcdef" ) );
+
+    // an output written again takes the hash of its settings, even
+    // without --incremental
+    AcesImage image;
+    image.width    = 4;
+    image.height   = 2;
+    image.channels = 3;
+    image.allocate( nullptr );
+    fill( image.pixels, image.pixels + 24, uint16_t( 0 ) );
+    image.settingsHash = "fedcba9876543210";
+    AcesRender::writeACES( proxy.c_str(), image );
+    BOOST_CHECK( !outputsUpToDate( raw, outputs, "0123456789abcdef" ) );
+    BOOST_CHECK( outputsUpToDate( raw, { proxy }, "fedcba9876543210" ) );
+
+    image.settingsHash.clear();
+    AcesRender::writeACES( proxy.c_str(), image );
+    BOOST_CHECK( !boost::filesystem::exists( proxy + ".params" ) );
+
+    boost::filesystem::remove_all( dir );
+};
+
+BOOST_AUTO_TEST_CASE( Test_Journal )
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() /
+                                  boost::filesystem::unique_path();
+    boost::filesystem::create_directories( dir );
+    string path = ( dir / "batch.jsonl" ).string();
+
+    {
+        Journal journal;
+        BOOST_CHECK( journal.load( path ) );
+        BOOST_CHECK( journal.open( path, false ) );
+        journal.started( "A001.CR2" );
+        journal.finished( "A001.CR2", 0 );
+        journal.started( "A002.CR2" );
+        journal.started( "A003.CR2" );
+        journal.finished( "A003.CR2", 2 );
+    }
+
+    // killed while writing a line
+    FILE *file = fopen( path.c_str(), "a" );
+    fputs( "{\"event\":\"start\",\"fi", file );
+    fclose( file );
+
+    {
+        Journal journal;
+        BOOST_CHECK( journal.load( path ) );
+        BOOST_CHECK( journal.isFinished( "A001.CR2" ) );
+        BOOST_CHECK( !journal.isFinished( "A002.CR2" ) );
+
+        // failed, so tried again
+        BOOST_CHECK( !journal.isFinished( "A003.CR2" ) );
+        BOOST_CHECK_EQUAL( journal.interruptions( "A003.CR2" ), 0 );
+        BOOST_CHECK_EQUAL( journal.interruptions( "A002.CR2" ), 1 );
+        BOOST_CHECK_EQUAL( journal.interruptions( "A004.CR2" ), 0 );
+
+        BOOST_CHECK( journal.open( path, true ) );
+        journal.started( "A002.CR2" );
+    }
+
+    Journal journal;
+    BOOST_CHECK( journal.load( path ) );
+    BOOST_CHECK_EQUAL( journal.interruptions( "A002.CR2" ), 2 );
+
+    // outputs are written next to their place, under a hidden name
+    string output = ( dir / "A001_aces.exr" ).string();
+    string temp   = acesTempPath( output );
+    BOOST_CHECK_EQUAL(
+        boost::filesystem::path( temp ).parent_path(),
+        boost::filesystem::path( output ).parent_path() );
+    BOOST_CHECK_EQUAL(
+        boost::filesystem::path( temp ).filename().string().substr( 0, 11 ),
+        ".A001_aces." );
+    BOOST_CHECK_EQUAL( boost::filesystem::path( temp ).extension(), ".exr" );
+    BOOST_CHECK( acesTempPath( output ) != temp );
+
+    boost::filesystem::remove_all( dir );
+};